@@ -0,0 +1,248 @@
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+
+#include "asset_cache.h"
+
+using namespace std;
+
+AssetCache::AssetCache(double check_interval, bool watch_files) {
+    this->check_interval = check_interval;
+#ifdef __linux__
+    if (!watch_files) {
+        return;
+    }
+    this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->inotify_fd < 0) {
+        cerr << "inotify unavailable, asset cache falls back to mtime checks" << endl;
+    }
+#endif
+}
+
+AssetCache::~AssetCache() {
+#ifdef __linux__
+    if (this->inotify_fd >= 0) {
+        ::close(this->inotify_fd);
+    }
+#endif
+    // mappings still referenced by queued messages are released with the last view
+}
+
+bool AssetCache::load(const string & filename, Entry & entry) {
+#ifdef _WINDOWS
+    auto contents = make_shared<string>(load_image(filename));
+    entry.data = contents->data();
+    entry.size = contents->size();
+    entry.mapping = contents;
+    return true;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "asset cache can't open " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        ::close(fd);
+        return false;
+    }
+    
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    void * address = nullptr;
+    if (size > 0 && size < this->copy_below) {
+        // no mapping for a rewrite in place to pull out from under a view
+        auto contents = make_shared<string>(size, '\0');
+        size_t count = 0;
+        while (count < size) {
+            ssize_t length = ::read(fd, &(*contents)[count], size - count);
+            if (length <= 0) {
+                break;
+            }
+            count += static_cast<size_t>(length);
+        }
+        ::close(fd);
+        if (count < size) {
+            cerr << "asset cache can't read " << filename << " " << strerror(errno) << endl;
+            return false;
+        }
+        entry.mapping = contents;
+        entry.data = contents->data();
+        entry.mapped = false;
+    }
+    else {
+        if (size > 0) {
+            address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);  // the mapping keeps its own reference to the file
+        if (address == MAP_FAILED) {
+            cerr << "asset cache can't map " << filename << " " << strerror(errno) << endl;
+            return false;
+        }
+        entry.data = static_cast<const char *>(address);
+        entry.mapped = address != nullptr;
+    }
+    
+    if (entry.mapped) {
+        // whole file is about to be sent, start reading it in now
+        madvise(address, size, MADV_WILLNEED);
+        entry.mapping = shared_ptr<const void>(address, [size](const void * mapped) {
+            munmap(const_cast<void *>(mapped), size);
+        });
+    }
+    else if (size == 0) {
+        entry.mapping.reset();
+    }
+    entry.size = size;
+#ifdef __APPLE__
+    entry.mtime_ns = file_stat.st_mtimespec.tv_sec * 1000000000L + file_stat.st_mtimespec.tv_nsec;
+#else
+    entry.mtime_ns = file_stat.st_mtim.tv_sec * 1000000000L + file_stat.st_mtim.tv_nsec;
+#endif
+
+#ifdef __linux__
+    if (this->inotify_fd >= 0 && entry.watch < 0) {
+        // editors usually replace the file, so watch for that as well as in-place writes
+        uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+        entry.watch = inotify_add_watch(this->inotify_fd, filename.c_str(), mask);
+        if (entry.watch >= 0) {
+            watched_files[entry.watch] = filename;
+        }
+    }
+#endif
+    return true;
+#endif
+}
+
+void AssetCache::drain_notifications() {
+#ifdef __linux__
+    if (this->inotify_fd < 0) {
+        return;
+    }
+    
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t length = ::read(this->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            break;
+        }
+        for (char * position = buffer; position < buffer + length;) {
+            auto event = reinterpret_cast<inotify_event *>(position);
+            auto watched = watched_files.find(event->wd);
+            if (watched != watched_files.end()) {
+                auto entry = entries.find(watched->second);
+                if (entry != entries.end()) {
+                    entry->second.stale = true;
+                    if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                        // the watch followed the old inode, a new one is added on reload
+                        entry->second.watch = -1;
+                    }
+                }
+                if (event->mask & IN_IGNORED) {
+                    watched_files.erase(watched);
+                }
+            }
+            position += sizeof(inotify_event) + event->len;
+        }
+    }
+#endif
+}
+
+PayloadView AssetCache::get(const string & filename) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    drain_notifications();
+    
+    auto now = SteadyClock::now();
+    auto found = entries.find(filename);
+    if (found != entries.end()) {
+        Entry & entry = found->second;
+        Seconds since_check = now - entry.checked;
+        // a mapped file truncated since the last check would fault when the view is sent
+        if (!entry.stale && (entry.mapped || since_check.count() >= this->check_interval)) {
+            entry.checked = now;
+#ifndef _WINDOWS
+            // covers file systems where inotify doesn't report changes (nfs, some fuse mounts)
+            struct stat file_stat;
+            if (stat(filename.c_str(), &file_stat) == 0) {
+#ifdef __APPLE__
+                long mtime_ns = file_stat.st_mtimespec.tv_sec * 1000000000L + file_stat.st_mtimespec.tv_nsec;
+#else
+                long mtime_ns = file_stat.st_mtim.tv_sec * 1000000000L + file_stat.st_mtim.tv_nsec;
+#endif
+                if (mtime_ns != entry.mtime_ns || static_cast<size_t>(file_stat.st_size) != entry.size) {
+                    entry.stale = true;
+                }
+            }
+#endif
+        }
+        
+        if (!entry.stale) {
+            hit_count += 1;
+        }
+        else {
+            // views handed out earlier keep the old mapping alive
+            Entry refreshed;
+            refreshed.watch = entry.watch;
+            if (!load(filename, refreshed)) {
+                fail_count += 1;
+                return PayloadView();
+            }
+            refreshed.checked = now;
+            entry = refreshed;
+            refresh_count += 1;
+        }
+    }
+    else {
+        Entry entry;
+        if (!load(filename, entry)) {
+            fail_count += 1;
+            return PayloadView();
+        }
+        entry.checked = now;
+        entries[filename] = entry;
+        if (entry.mapped) {
+            map_count += 1;
+        }
+        else {
+            copy_count += 1;
+        }
+    }
+    
+    const Entry & entry = entries[filename];
+    PayloadView view;
+    view.owner = entry.mapping;
+    view.data = entry.data;
+    view.size = entry.size;
+    return view;
+}
+
+void AssetCache::release(const string & filename) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    auto found = entries.find(filename);
+    if (found == entries.end()) {
+        return;
+    }
+#ifdef __linux__
+    if (found->second.watch >= 0) {
+        inotify_rm_watch(this->inotify_fd, found->second.watch);
+        watched_files.erase(found->second.watch);
+    }
+#endif
+    entries.erase(found);
+}
+
+void AssetCache::dump(ofstream & out) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    out << "assets: " << entries.size() << " hits: " << hit_count << " mapped: " << map_count << " copied: " << copy_count
+        << " refreshed: " << refresh_count << " failed: " << fail_count << endl;
+}
@@ -0,0 +1,63 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <fstream>
+
+#include "comms.h"
+
+// Maps each source file once and hands out read-only views of it.
+// A view holds a reference to its mapping, so a file that is refreshed
+// stays mapped until the last message using the old contents has been sent.
+// Changes are picked up through inotify, with an mtime/size check as a fallback.
+// Refresh a big file by writing the new one beside it and renaming it over the old:
+// one rewritten in place changes under views already handed out, and pages cut off
+// by a truncation fault (SIGBUS) when the sender reads them. Small files are copied
+// instead, and a mapped file's size is checked each time a view of it is handed out.
+class AssetCache {
+public:
+    // check_interval: seconds between mtime checks of a cached file
+    // watch_files: use inotify too (one watch per file, keep off for very many files)
+    AssetCache(double check_interval = 1.0, bool watch_files = true);
+    ~AssetCache();
+    
+    // returns an empty view if the file can't be opened
+    PayloadView get(const string & filename);
+    // forget a file; outstanding views keep its mapping until they're dropped
+    void release(const string & filename);
+    void dump(ofstream & out);
+    
+    // files smaller than this are read into memory rather than mapped
+    size_t copy_below = 256 << 10;
+
+private:
+    struct Entry {
+        shared_ptr<const void> mapping;
+        const char * data = nullptr;
+        size_t size = 0;
+        long mtime_ns = 0;
+        bool mapped = false;
+        int watch = -1;
+        bool stale = false;
+        SteadyClock::time_point checked;
+    };
+    
+    bool load(const string & filename, Entry & entry);
+    void drain_notifications();
+
+    double check_interval;
+    int inotify_fd = -1;
+    mutex cache_mutex;
+    map<string, Entry> entries;
+    map<int, string> watched_files;
+    
+    long hit_count = 0;
+    long map_count = 0;
+    long copy_count = 0;
+    long refresh_count = 0;
+    long fail_count = 0;
+};
+
+#endif // ASSET_CACHE_H
@@ -0,0 +1,450 @@
+// In-process loopback benchmark for Comm: one server and one or more clients
+// over 127.0.0.1, sweeping payload size, send rate and blocking mode.
+// Reports MB/s, messages/s and p50/p99 one-way latency (send call to next_received).
+//
+// usage: MRR_Pi_bench_loopback [-p port] [-i shm://name | unix:///path] [-c max_clients] [-o results.csv]
+//                              [-m group:port [-l loss]]
+// -i measures the shared memory (one client only) or unix socket transport instead of tcp
+// -m sends the images to a multicast group instead (one client, NACKs over tcp); -l drops that
+// fraction of datagrams at the receiver to exercise repair. Loss and repair counts go to
+// bench_loopback_multicast.txt
+// The CONTROL rows stream frames as fast as they go while a START_TIMER is sent every 2ms,
+// their p50/p99 are the START_TIMER latencies
+// Before the sweep a BGR8 image goes by reference and as a preload, and has to arrive with its
+// pixel format and geometry
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <atomic>
+
+#include "comms.h"
+#include "multicast.h"
+
+// the stock server only takes one connection at a time
+class BenchServer : public Comm
+{
+protected:
+    bool allow_new_connection(const sockaddr_storage &sin_addr, socklen_t sin_size)
+    {
+        return true;
+    }
+};
+
+Comm *bench_server_factory()
+{
+    return new BenchServer();
+}
+
+struct Result
+{
+    long sent = 0;
+    long received = 0;
+    double seconds = 0;
+    double mb_per_second = 0;
+    double messages_per_second = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double control_p50 = 0;
+    double control_p99 = 0;
+};
+
+static long nanoseconds_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now().time_since_epoch()).count();
+}
+
+static double percentile(vector<double> &sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+// rate = messages per second per client, 0 = as fast as possible
+// with multicast each message goes out once to the group, clients only carry the NACKs back
+// control_interval > 0 also sends a START_TIMER that often from the first client while the images stream
+static Result run(Comm *server, Waiter &waiter, list<Comm *> &clients, size_t payload_size, double rate, Comm::BlockType block,
+                  MulticastSender *multicast = nullptr, double control_interval = 0)
+{
+    // enough messages for a stable number, without spending minutes on 4K frames
+    long per_client = static_cast<long>(max<size_t>(50, min<size_t>(20000, (256UL << 20) / max<size_t>(payload_size, 1) / clients.size())));
+    if (rate > 0)
+    {
+        per_client = min(per_client, static_cast<long>(rate * 3));
+    }
+
+    // the payload is shared by every message, the send time travels in the name
+    auto buffer = make_shared<string>(payload_size, 'x');
+    PayloadView payload;
+    payload.owner = buffer;
+    payload.data = buffer->data();
+    payload.size = buffer->size();
+
+    Result result;
+    long expected = per_client * static_cast<long>(clients.size());
+    vector<double> latencies;
+    latencies.reserve(expected);
+    vector<double> control_latencies;
+    long received_bytes = 0;
+
+    auto begin = SteadyClock::now();
+    auto deadline = begin + std::chrono::seconds(30);
+    atomic<bool> sending(true);
+    atomic<bool> receiving(true);
+    atomic<bool> lost(false);
+    thread sender([&]() {
+        for (long i = 0; i < per_client && receiving && !lost && SteadyClock::now() < deadline; i++)
+        {
+            if (rate > 0)
+            {
+                auto goal = begin + std::chrono::duration_cast<SteadyClock::duration>(Seconds(i / rate));
+                this_thread::sleep_until(goal);
+            }
+            if (multicast)
+            {
+                multicast->send(new MessageData(MessageData::MessageType::IMAGE, to_string(nanoseconds_now()), payload));
+                continue;
+            }
+            for (auto client : clients)
+            {
+                if (client->connect_result() != ConnectError::SUCCESS)
+                {
+                    // nothing more arrives from it, and a BLOCKING send to it only waits out its retries
+                    lost = true;
+                    break;
+                }
+                auto message_data = new MessageData(MessageData::MessageType::IMAGE, to_string(nanoseconds_now()), payload);
+                client->send(message_data, block);
+            }
+        }
+        sending = false;
+    });
+    thread controller([&]() {
+        while (control_interval > 0 && receiving)
+        {
+            clients.front()->send(new MessageData(MessageData::MessageType::START_TIMER, to_string(nanoseconds_now())));
+            this_thread::sleep_for(Seconds(control_interval));
+        }
+    });
+
+    auto last_received = begin;
+    while (result.received < expected && !lost && SteadyClock::now() < deadline)
+    {
+        // multicast frames that could not be repaired never arrive
+        if (multicast && !sending && SteadyClock::now() - last_received > std::chrono::seconds(1))
+        {
+            break;
+        }
+        MessageData *message_data = server->next_received();
+        if (message_data == nullptr)
+        {
+            waiter.wait_for(Seconds(0.001));
+            continue;
+        }
+        long now = nanoseconds_now();
+        last_received = SteadyClock::now();
+        if (message_data->message_type == MessageData::MessageType::IMAGE)
+        {
+            latencies.push_back((now - atol(message_data->image_name.c_str())) / 1e9);
+            received_bytes += static_cast<long>(message_data->payload_size());
+            result.received += 1;
+        }
+        else if (message_data->message_type == MessageData::MessageType::START_TIMER)
+        {
+            control_latencies.push_back((now - atol(message_data->image_name.c_str())) / 1e9);
+        }
+        delete message_data;
+    }
+    receiving = false;
+    sender.join();
+    controller.join();
+    if (lost)
+    {
+        cerr << "a client lost its connection, the run was cut short" << endl;
+    }
+
+    result.sent = expected;
+    result.seconds = Seconds(last_received - begin).count();
+    if (result.seconds > 0)
+    {
+        result.mb_per_second = received_bytes / result.seconds / 1e6;
+        result.messages_per_second = result.received / result.seconds;
+    }
+    sort(latencies.begin(), latencies.end());
+    result.p50 = percentile(latencies, .5);
+    result.p99 = percentile(latencies, .99);
+    sort(control_latencies.begin(), control_latencies.end());
+    result.control_p50 = percentile(control_latencies, .5);
+    result.control_p99 = percentile(control_latencies, .99);
+
+    // anything that arrives late belongs to this run, not the next one
+    this_thread::sleep_for(std::chrono::milliseconds(100));
+    while (auto message_data = server->next_received())
+    {
+        delete message_data;
+    }
+    return result;
+}
+
+// the server's copy of an image a client sent by reference or preloaded must show as the client sent it
+static bool check_image_views(Comm *server, Waiter &waiter, Comm *client)
+{
+    const int width = 320;
+    const int height = 240;
+    string pixels(static_cast<size_t>(width) * height * MessageData::bytes_per_pixel(MessageData::BGR8), '\0');
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        pixels[i] = static_cast<char>(i * 7);
+    }
+    auto owned = make_shared<string>(pixels);
+    PayloadView payload;
+    payload.owner = owned;
+    payload.data = owned->data();
+    payload.size = owned->size();
+
+    // the first goes whole and the server caches it, the other two are refs resolved from the cache
+    client->set_image_refs(true);
+    for (int i = 0; i < 3; i++)
+    {
+        Comm::fan_out_image({client}, "ref" + to_string(i), payload, width, height, MessageData::BGR8);
+        this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    client->set_image_refs(false);
+    client->send_preload("preloaded", payload, width, height, MessageData::BGR8);
+    client->send_display_now("preloaded");
+
+    int good = 0;
+    int bad = 0;
+    auto deadline = SteadyClock::now() + std::chrono::seconds(5);
+    while (good + bad < 4 && SteadyClock::now() < deadline)
+    {
+        MessageData *message_data = server->next_received();
+        if (message_data == nullptr)
+        {
+            waiter.wait_for(Seconds(0.01));
+            continue;
+        }
+        bool image = message_data->message_type == MessageData::MessageType::IMAGE ||
+                     message_data->message_type == MessageData::MessageType::DISPLAY_NOW;
+        if (image)
+        {
+            if (message_data->pixel_format == MessageData::BGR8 && message_data->width == width && message_data->height == height &&
+                message_data->payload_size() == pixels.size() && memcmp(message_data->payload_data(), pixels.data(), pixels.size()) == 0)
+            {
+                good += 1;
+            }
+            else
+            {
+                cerr << "'" << message_data->image_name << "' arrived as format " << message_data->pixel_format << " "
+                     << message_data->width << "x" << message_data->height << ", " << message_data->payload_size() << " bytes" << endl;
+                bad += 1;
+            }
+        }
+        delete message_data;
+    }
+    ofstream out("bench_loopback_image_refs.txt");
+    client->dump_image_refs(out, "client");
+    server->dump_image_refs(out, "server");
+    server->dump_preload(out, "server");
+    cout << "BGR8 by reference and preloaded: " << good << "/4 arrived intact" << endl;
+    return good == 4;
+}
+
+int main(int argc, char *argv[])
+{
+    string port = "5590";
+    string address = "127.0.0.1";
+    int max_clients = 2;
+    string csv_filename;
+    string multicast_address;
+    double simulated_loss = 0;
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            port = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            address = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            max_clients = max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            csv_filename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            multicast_address = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            simulated_loss = atof(argv[i + 1]);
+        }
+    }
+
+    Comm::log_messages = false;
+    bool shared_memory = address.compare(0, 6, "shm://") == 0;
+    if (shared_memory)
+    {
+        // a shared memory ring has exactly one client, and has to fit a 4K frame
+        max_clients = 1;
+        Comm::shm_slot_size = 9 << 20;
+    }
+    if (!multicast_address.empty())
+    {
+        // every server would see the same datagrams, one is enough
+        max_clients = 1;
+    }
+
+    // start_server only returns once the first client is connected
+    Waiter waiter;
+    Comm *server = nullptr;
+    string server_port_arg = port;
+    // servers ignore plain ip addresses
+    string server_address_arg = address.find("://") != string::npos ? address : "";
+    char *server_argv[] = {argv[0], (char *)"-p", &server_port_arg[0], (char *)"-i", &server_address_arg[0]};
+    thread server_thread([&]() { server = Comm::start_server(&waiter, 5, server_argv, bench_server_factory); });
+    this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    list<Comm *> all_clients;
+    for (int i = 0; i < max_clients; i++)
+    {
+        string ip_arg = address;
+        string port_arg = port;
+        char *client_argv[] = {argv[0], (char *)"-i", &ip_arg[0], (char *)"-p", &port_arg[0]};
+        list<Comm *> one = Comm::start_clients(nullptr, 5, client_argv);
+        if (one.empty())
+        {
+            cerr << "client " << i << " failed to connect" << endl;
+            return -1;
+        }
+        all_clients.push_back(one.front());
+    }
+    server_thread.join();
+    if (server == nullptr)
+    {
+        return -1;
+    }
+    // let the server's accept loop pick up every connection
+    this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    MulticastSender *multicast_sender = nullptr;
+    MulticastReceiver multicast_receiver;
+    if (!multicast_address.empty())
+    {
+        string group, group_port;
+        multicast_sender = new MulticastSender();
+        if (!split_group_address(multicast_address, group, group_port) || !multicast_receiver.open(group, group_port) ||
+            !multicast_sender->open(group, group_port))
+        {
+            return -1;
+        }
+        multicast_receiver.simulated_loss = simulated_loss;
+        multicast_receiver.start(server);
+        // NACKs are repaired on the clients' receive threads, as the test client does
+        for (auto client : all_clients)
+        {
+            client->set_multicast_sender(multicast_sender);
+        }
+    }
+
+    if (!check_image_views(server, waiter, all_clients.front()))
+    {
+        return -1;
+    }
+
+    // control message, 1K, 64K, one 1024x768 frame, one 4K frame
+    vector<size_t> payload_sizes = {16, 1024, 65536, 1024 * 768, 3840 * 2160};
+    vector<double> rates = {0, 30, 120};
+
+    ofstream csv;
+    if (!csv_filename.empty())
+    {
+        csv.open(csv_filename);
+        csv << "clients,payload_bytes,rate,mode,sent,received,seconds,mb_per_s,msgs_per_s,p50_ms,p99_ms" << endl;
+    }
+
+    cout << setw(7) << "clients" << setw(10) << "bytes" << setw(6) << "rate" << setw(13) << "mode"
+         << setw(8) << "recv" << setw(10) << "MB/s" << setw(11) << "msg/s" << setw(11) << "p50 ms" << setw(11) << "p99 ms" << endl;
+
+    auto report = [&](int client_count, size_t payload_size, double rate, const string &mode, const Result &result, double p50, double p99)
+    {
+        cout << setw(7) << client_count << setw(10) << payload_size << setw(6) << fixed << setprecision(0) << rate << setw(13) << mode
+             << setw(8) << result.received << setw(10) << fixed << setprecision(1) << result.mb_per_second
+             << setw(11) << setprecision(0) << result.messages_per_second
+             << setw(11) << setprecision(3) << p50 * 1000 << setw(11) << p99 * 1000 << endl;
+        if (csv.is_open())
+        {
+            csv << client_count << "," << payload_size << "," << rate << "," << mode << "," << result.sent << ","
+                << result.received << "," << result.seconds << "," << result.mb_per_second << ","
+                << result.messages_per_second << "," << p50 * 1000 << "," << p99 * 1000 << endl;
+        }
+    };
+
+    for (int client_count = 1; client_count <= max_clients; client_count++)
+    {
+        list<Comm *> clients(all_clients.begin(), next(all_clients.begin(), client_count));
+        for (auto block : {Comm::NON_BLOCKING, Comm::BLOCKING})
+        {
+            // the multicast send never blocks
+            if (multicast_sender && block == Comm::BLOCKING)
+            {
+                continue;
+            }
+            for (auto payload_size : payload_sizes)
+            {
+                for (auto rate : rates)
+                {
+                    Result result = run(server, waiter, clients, payload_size, rate, block, multicast_sender);
+                    report(client_count, payload_size, rate, multicast_sender ? "MULTICAST" : block == Comm::BLOCKING ? "BLOCKING" : "NON_BLOCKING",
+                           result, result.p50, result.p99);
+                }
+            }
+        }
+    }
+
+    // how long a control message waits while frames stream
+    if (!multicast_sender)
+    {
+        list<Comm *> clients(all_clients.begin(), next(all_clients.begin(), 1));
+        for (size_t payload_size : {static_cast<size_t>(1024 * 768), static_cast<size_t>(3840 * 2160)})
+        {
+            Result result = run(server, waiter, clients, payload_size, 0, Comm::NON_BLOCKING, nullptr, 0.002);
+            report(1, payload_size, 0, "CONTROL", result, result.control_p50, result.control_p99);
+        }
+    }
+
+    if (multicast_sender)
+    {
+        multicast_receiver.stop();
+        ofstream out("bench_loopback_multicast.txt");
+        multicast_sender->dump(out);
+        multicast_receiver.dump(out);
+        delete multicast_sender;
+    }
+
+    for (auto client : all_clients)
+    {
+        client->disconnect();
+        delete client;
+    }
+    server->disconnect();
+    delete server;
+    return 0;
+}
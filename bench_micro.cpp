@@ -0,0 +1,457 @@
+// Microbenchmarks for the mixer and protocol hot paths.
+// The video and resampler round trips also compare what comes out with what went in, and stop
+// with an error when it is off by more than a few levels.
+//
+// machine-readable output for comparing builds or machines:
+//   ./MRR_Pi_bench_micro --benchmark_out=micro.json --benchmark_out_format=json
+//   ./MRR_Pi_bench_micro --benchmark_out=micro.csv --benchmark_out_format=csv
+
+#include <benchmark/benchmark.h>
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cmath>
+
+#include "comms.h"
+#include "content_cache.h"
+#include "crc32c.h"
+#include "mixer_processor.h"
+#include "video_codec.h"
+#include "resampler.h"
+
+// VGA, the current 1024x768 displays, 1080p and 4K
+static void resolutions(benchmark::internal::Benchmark * bench) {
+    bench->Args({640, 480});
+    bench->Args({1024, 768});
+    bench->Args({1920, 1080});
+    bench->Args({3840, 2160});
+}
+
+static cv::Mat gradient(int width, int height, int offset) {
+    cv::Mat image(height, width, CV_8UC1);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            image.at<uchar>(y, x) = static_cast<uchar>((x + y + offset) & 0xff);
+        }
+    }
+    return image;
+}
+
+static void BM_Mixer_mix(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    cv::Mat image1 = gradient(width, height, 0);
+    cv::Mat image2 = gradient(width, height, 100);
+    Mixer mixer(width, height, 4, true);
+    mixer.push(image1, MessageData::GRAY8);
+    bool second = true;
+
+    for (auto _ : state) {
+        // keep it fading, so every frame blends two images
+        if (mixer.fade() >= 1) {
+            mixer.push(second ? image2 : image1, MessageData::GRAY8);
+            second = !second;
+        }
+        const cv::Mat & output = mixer.mix();
+        benchmark::DoNotOptimize(output.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * int64_t(width) * height);
+}
+BENCHMARK(BM_Mixer_mix)->Apply(resolutions)->Unit(benchmark::kMillisecond);
+
+// one Mixer per thread, as for several outputs: the time per frame should hold as channels are added
+// (up to the core count); it grows if they share anything or run out of memory bandwidth
+static void BM_Mixer_channels(benchmark::State & state) {
+    int width = 1024;
+    int height = 768;
+    cv::Mat image1 = gradient(width, height, 0);
+    cv::Mat image2 = gradient(width, height, 100);
+    Mixer mixer(width, height, 4, true, static_cast<unsigned>(state.thread_index()) + 1);
+    mixer.push(image1, MessageData::GRAY8);
+    bool second = true;
+
+    for (auto _ : state) {
+        if (mixer.fade() >= 1) {
+            mixer.push(second ? image2 : image1, MessageData::GRAY8);
+            second = !second;
+        }
+        const cv::Mat & output = mixer.mix();
+        benchmark::DoNotOptimize(output.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Mixer_channels)->ThreadRange(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// the gradient in each pixel format, spread over its bit depth
+static cv::Mat formatGradient(int width, int height, MessageData::PixelFormat pixelFormat, int offset) {
+    cv::Mat grey = gradient(width, height, offset);
+    cv::Mat image;
+    switch (pixelFormat) {
+        case MessageData::GRAY10:
+            grey.convertTo(image, CV_16U, 4);
+            break;
+        case MessageData::GRAY16:
+            grey.convertTo(image, CV_16U, 257);
+            break;
+        case MessageData::BGR8:
+            cv::cvtColor(grey, image, cv::COLOR_GRAY2BGR);
+            break;
+        default:
+            image = grey;
+            break;
+    }
+    return image;
+}
+
+// through the runtime dispatch, as the render loop calls it
+static void BM_Mixer_mix_format(benchmark::State & state) {
+    static const char * names[] = {"gray8", "gray10", "gray16", "bgr8"};
+    auto pixelFormat = static_cast<MessageData::PixelFormat>(state.range(0));
+    int width = static_cast<int>(state.range(1));
+    int height = static_cast<int>(state.range(2));
+    cv::Mat image1 = formatGradient(width, height, pixelFormat, 0);
+    cv::Mat image2 = formatGradient(width, height, pixelFormat, 100);
+    Mixer mixer(width, height, 4, true);
+    mixer.push(image1, pixelFormat);
+    bool second = true;
+
+    for (auto _ : state) {
+        if (mixer.fade() >= 1) {
+            mixer.push(second ? image2 : image1, pixelFormat);
+            second = !second;
+        }
+        const cv::Mat & output = mixer.mix();
+        benchmark::DoNotOptimize(output.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * int64_t(width) * height * MessageData::bytes_per_pixel(pixelFormat));
+    state.SetLabel(names[pixelFormat]);
+}
+static void format_resolutions(benchmark::internal::Benchmark * bench) {
+    for (int format = 0; format < MessageData::PIXEL_FORMAT_COUNT; format++) {
+        bench->Args({format, 1024, 768});
+        bench->Args({format, 1920, 1080});
+    }
+}
+BENCHMARK(BM_Mixer_mix_format)->Apply(format_resolutions)->Unit(benchmark::kMillisecond);
+
+// images arriving faster than they fade in, so about range(0) of them show at once; from 3 on
+// they are composited in one pass instead of blended two at a time
+static void BM_Mixer_layers(benchmark::State & state) {
+    int layers = static_cast<int>(state.range(0));
+    int width = 1024;
+    int height = 768;
+    std::vector<cv::Mat> images;
+    for (int image = 0; image < layers; ++image) {
+        images.push_back(gradient(width, height, image * 50));
+    }
+    Mixer mixer(width, height, 4, true);
+    mixer.maxLayers = layers;
+    mixer.push(images[0], MessageData::GRAY8);
+    int pushEvery = std::max(1, mixer.fadeFrames / (layers - 1));
+    long frame = 0;
+    long layersShown = 0;
+
+    for (auto _ : state) {
+        if (frame % pushEvery == 0) {
+            mixer.push(images[frame / pushEvery % layers], MessageData::GRAY8);
+        }
+        frame++;
+        const cv::Mat & output = mixer.mix();
+        benchmark::DoNotOptimize(output.data);
+        layersShown += mixer.layerCount();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["layers"] = benchmark::Counter(static_cast<double>(layersShown), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_Mixer_layers)->DenseRange(2, 8, 2)->Unit(benchmark::kMillisecond);
+
+// what each level the frame governor can step down to saves, four images fading in at once
+static void BM_Mixer_degraded(benchmark::State & state) {
+    auto degradation = static_cast<Mixer::Degradation>(state.range(0));
+    auto pixelFormat = static_cast<MessageData::PixelFormat>(state.range(1));
+    int width = 1024;
+    int height = 768;
+    std::vector<cv::Mat> images;
+    for (int image = 0; image < 4; ++image) {
+        images.push_back(formatGradient(width, height, pixelFormat, image * 50));
+    }
+    Mixer mixer(width, height, 4, true);
+    mixer.degradation = degradation;
+    mixer.push(images[0], pixelFormat);
+    int pushEvery = mixer.fadeFrames / 3;
+    long frame = 0;
+
+    for (auto _ : state) {
+        if (frame % pushEvery == 0) {
+            mixer.push(images[frame / pushEvery % images.size()], pixelFormat);
+        }
+        frame++;
+        const cv::Mat & output = mixer.mix();
+        benchmark::DoNotOptimize(output.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(std::string(Mixer::degradationName(degradation)) + (pixelFormat == MessageData::GRAY8 ? " gray8" : " gray16"));
+}
+static void degradations(benchmark::internal::Benchmark * bench) {
+    for (int degradation = 0; degradation < Mixer::DEGRADATION_COUNT; degradation++) {
+        bench->Args({degradation, MessageData::GRAY8});
+        bench->Args({degradation, MessageData::GRAY16});
+    }
+}
+BENCHMARK(BM_Mixer_degraded)->Apply(degradations)->Unit(benchmark::kMillisecond);
+
+static void BM_generateNoiseFrames(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    bool filter = state.range(2) != 0;
+
+    for (auto _ : state) {
+        std::vector<cv::Mat> noiseFrames = generateNoiseFrames(width, height, 1, filter);
+        benchmark::DoNotOptimize(noiseFrames.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * int64_t(width) * height);
+}
+static void noise_resolutions(benchmark::internal::Benchmark * bench) {
+    for (int filter = 0; filter <= 1; filter++) {
+        bench->Args({640, 480, filter});
+        bench->Args({1024, 768, filter});
+        bench->Args({1920, 1080, filter});
+        bench->Args({3840, 2160, filter});
+    }
+}
+BENCHMARK(BM_generateNoiseFrames)->Apply(noise_resolutions)->Unit(benchmark::kMillisecond);
+
+static void BM_createParabolicLUT(benchmark::State & state) {
+    auto pixelFormat = static_cast<MessageData::PixelFormat>(state.range(0));
+    for (auto _ : state) {
+        cv::Mat lut = createParabolicLUT(pixelFormat);
+        benchmark::DoNotOptimize(lut.data);
+    }
+}
+BENCHMARK(BM_createParabolicLUT)->Arg(MessageData::GRAY8)->Arg(MessageData::GRAY10)->Arg(MessageData::GRAY16);
+
+// smooth enough that a codec or a rescale shouldn't lose much of it
+static cv::Mat waves(int width, int height) {
+    cv::Mat image(height, width, CV_8UC1);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            image.at<uchar>(y, x) = cv::saturate_cast<uchar>(128 + 100 * std::sin(x / 40.0) * std::cos(y / 30.0));
+        }
+    }
+    return image;
+}
+
+static PayloadView view_of(const cv::Mat & image) {
+    auto owned = std::make_shared<std::string>(reinterpret_cast<const char *>(image.data), image.total() * image.elemSize());
+    PayloadView view;
+    view.owner = owned;
+    view.data = owned->data();
+    view.size = owned->size();
+    return view;
+}
+
+// a frame through the client's encoder (-e) and the server's decoder, as a VIDEO message; each
+// decoded frame is compared with the one that went in
+static void BM_video_round_trip(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    cv::Mat source = waves(width, height);
+    PayloadView frame = view_of(source);
+    VideoEncoder encoder;
+    if (!encoder.open(width, height, 30, 8000000)) {
+        state.SkipWithError("no encoder");
+        return;
+    }
+    VideoDecoder decoder;
+    long sent = 0;
+    long compared = 0;
+    double error = 0;
+
+    for (auto _ : state) {
+        std::string packet = encoder.encode(frame);
+        if (packet.empty()) {
+            state.SkipWithError("encode failed");
+            break;
+        }
+        decoder.decode(new MessageData(MessageData::MessageType::VIDEO, std::to_string(sent++), packet));
+        // one frame in, one out: nothing is held back
+        MessageData * decoded = nullptr;
+        auto deadline = SteadyClock::now() + std::chrono::seconds(1);
+        while ((decoded = decoder.next_decoded()) == nullptr && SteadyClock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        if (decoded == nullptr) {
+            state.SkipWithError("the decoder held a frame back");
+            break;
+        }
+        if (decoded->message_type == MessageData::MessageType::IMAGE && decoded->width == width && decoded->height == height &&
+            decoded->payload_size() == source.total()) {
+            cv::Mat output(height, width, CV_8UC1, const_cast<char *>(decoded->payload_data()));
+            error += cv::norm(source, output, cv::NORM_L1) / source.total();
+            compared += 1;
+        }
+        delete decoded;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(encoder.codec_name());
+    if (compared == 0) {
+        state.SkipWithError("no frame decoded");
+        return;
+    }
+    double mean_error = error / compared;
+    state.counters["mean_error"] = mean_error;
+    state.counters["decoded"] = benchmark::Counter(static_cast<double>(compared) / sent, benchmark::Counter::kDefaults);
+    if (mean_error > 4) {
+        state.SkipWithError("decoded frames differ from the source");
+    }
+}
+BENCHMARK(BM_video_round_trip)->Args({1024, 768})->Args({1920, 1080})->Unit(benchmark::kMillisecond);
+
+// a display sized frame scaled as the server scales a client's frame, then back, and compared;
+// halving takes the box filter, 640x480 area averaging and 1920x1080 bilinear
+static void BM_Resampler_round_trip(benchmark::State & state) {
+    static const char * names[] = {"gray8", "gray10", "gray16", "bgr8"};
+    int scaledWidth = static_cast<int>(state.range(0));
+    int scaledHeight = static_cast<int>(state.range(1));
+    auto pixelFormat = static_cast<MessageData::PixelFormat>(state.range(2));
+    int width = 1024;
+    int height = 768;
+    cv::Mat grey = waves(width, height);
+    cv::Mat source;
+    switch (pixelFormat) {
+        case MessageData::GRAY10:
+            grey.convertTo(source, CV_16U, 4);
+            break;
+        case MessageData::GRAY16:
+            grey.convertTo(source, CV_16U, 257);
+            break;
+        case MessageData::BGR8:
+            cv::cvtColor(grey, source, cv::COLOR_GRAY2BGR);
+            break;
+        default:
+            source = grey;
+            break;
+    }
+    size_t pixelBytes = MessageData::bytes_per_pixel(pixelFormat);
+    std::string scaled(size_t(scaledWidth) * scaledHeight * pixelBytes, '\0');
+    cv::Mat output(height, width, source.type());
+    Resampler resampler;
+
+    for (auto _ : state) {
+        resampler.resample(reinterpret_cast<const char *>(source.data), width, height, width * pixelBytes, &scaled[0], scaledWidth,
+                           scaledHeight, pixelFormat);
+        resampler.resample(scaled.data(), scaledWidth, scaledHeight, scaledWidth * pixelBytes, reinterpret_cast<char *>(output.data),
+                           width, height, pixelFormat);
+        benchmark::DoNotOptimize(output.data);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(names[pixelFormat]);
+    // in 8 bit levels whatever the format
+    double levels = pixelFormat == MessageData::GRAY10 ? 4 : pixelFormat == MessageData::GRAY16 ? 257 : 1;
+    double mean_error = cv::norm(source, output, cv::NORM_L1) / (source.total() * source.channels()) / levels;
+    state.counters["mean_error"] = mean_error;
+    if (mean_error > 2) {
+        state.SkipWithError("the round trip changed the frame");
+    }
+}
+static void resampler_sizes(benchmark::internal::Benchmark * bench) {
+    for (int format = 0; format < MessageData::PIXEL_FORMAT_COUNT; format++) {
+        bench->Args({512, 384, format});
+        bench->Args({640, 480, format});
+        bench->Args({1920, 1080, format});
+    }
+}
+BENCHMARK(BM_Resampler_round_trip)->Apply(resampler_sizes)->Unit(benchmark::kMillisecond);
+
+static void BM_serialize_header(benchmark::State & state) {
+    std::string name(static_cast<size_t>(state.range(0)), 'n');
+    MessageData message_data(MessageData::MessageType::IMAGE, name, std::string(1024, 'x'));
+
+    for (auto _ : state) {
+        std::string header = message_data.serialize_header();
+        benchmark::DoNotOptimize(header.data());
+    }
+}
+BENCHMARK(BM_serialize_header)->Arg(0)->Arg(32)->Arg(255);
+
+static void BM_deserialize(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    MessageData source(MessageData::MessageType::IMAGE, "../raw/24-06-03-04-30-10.raw__1234",
+                       std::string(size_t(width) * height, 'x'));
+    std::string wire = source.serialize_header();
+    wire.append(source.image_data);
+    std::string buffer;
+
+    for (auto _ : state) {
+        // refilling the receive buffer isn't part of deserialize
+        state.PauseTiming();
+        buffer = wire;
+        state.ResumeTiming();
+        MessageData * message_data = MessageData::deserialize(buffer, MessageState::ONGOING);
+        benchmark::DoNotOptimize(message_data);
+        delete message_data;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * int64_t(wire.size()));
+}
+BENCHMARK(BM_deserialize)->Args({0, 0})->Apply(resolutions)->Unit(benchmark::kMicrosecond);
+
+// paid once per image sent, and per image received, when image refs are on
+static void BM_content_hash(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    cv::Mat image = gradient(width, height, 0);
+    const char * data = reinterpret_cast<const char *>(image.data);
+    size_t size = size_t(width) * height;
+
+    for (auto _ : state) {
+        std::string hash = content_hash(data, size);
+        benchmark::DoNotOptimize(hash.data());
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(size));
+}
+BENCHMARK(BM_content_hash)->Apply(resolutions)->Unit(benchmark::kMicrosecond);
+
+// paid on the send thread and again on the receive thread when checksums are on
+static void BM_crc32c(benchmark::State & state) {
+    int width = static_cast<int>(state.range(0));
+    int height = static_cast<int>(state.range(1));
+    cv::Mat image = gradient(width, height, 0);
+    const char * data = reinterpret_cast<const char *>(image.data);
+    size_t size = size_t(width) * height;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(crc32c(data, size));
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(size));
+    state.SetLabel(crc32c_implementation());
+}
+BENCHMARK(BM_crc32c)->Apply(resolutions)->Unit(benchmark::kMicrosecond);
+
+static void BM_SD_increment(benchmark::State & state) {
+    SD sd;
+    sd.last = SteadyClock::now();
+    auto now = sd.last;
+    long drained = 0;
+
+    for (auto _ : state) {
+        now += std::chrono::milliseconds(33);
+        benchmark::DoNotOptimize(sd.increment(now));
+        // keep the sd history from growing for the whole run, as dump() would
+        if ((++drained & 0xffff) == 0) {
+            state.PauseTiming();
+            sd.sd_q.clear();
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SD_increment);
+
+BENCHMARK_MAIN();
@@ -6,9 +6,13 @@
 #ifndef _WINDOWS
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #include <stdio.h>
@@ -26,6 +30,13 @@
 #include <cmath>
 
 #include "comms.h"
+#include "shm_ring.h"
+#include "content_cache.h"
+#include "crc32c.h"
+#include "thread_config.h"
+#include "message_trace.h"
+#include "multicast.h"
+#include "timeline.h"
 
 using namespace std;
 
@@ -34,8 +45,27 @@ using namespace std;
 #endif
 
 int const MessageData::header_size = 6;  // 1 for type, 1 for name length, 4 for image length
+unsigned char const MessageData::crc_flag = 0x80;
+unsigned char const MessageData::geometry_flag = 0x40;
+size_t const MessageData::geometry_size = 2 * sizeof(uint16_t) + 1;
 string const Comm::default_port("5569");
 
+// a peer that went away shows up as a send error instead of a SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+bool Comm::log_messages = true;
+uint32_t Comm::shm_slot_count = 8;
+size_t Comm::shm_slot_size = 4 << 20;  // a 1024x768 frame with plenty of room, not a 4K one
+size_t Comm::memfd_min_size = 64 << 10;  // below this a copy down the socket is cheaper than a mapping
+size_t Comm::image_cache_bytes = 64 << 20;  // about 80 1024x768 frames
+size_t Comm::chunk_size = 32 << 10;  // about 0.3ms on a gigabit link, the most a control message waits for
+size_t Comm::max_message_size = 64 << 20;  // a 4K RGBA frame twice over
+// message bodies at least this big are read straight into place instead of through the receive buffer
+static const size_t direct_min_size = 16 << 10;
+
 string load_image(const string & raw_filename) {
     ifstream input_stream(raw_filename, ios::binary);
     ostringstream string_stream;
@@ -46,7 +76,7 @@ string load_image(const string & raw_filename) {
 string MessageData::serialize_header() const {
     string header;
     
-    header.push_back(static_cast<char>(this->message_type));
+    header.push_back(static_cast<char>(this->message_type | (has_crc ? crc_flag : 0) | (has_geometry() ? geometry_flag : 0)));
     
     auto image_name_length = this->image_name.size();
     if (image_name_length > 255) {
@@ -54,7 +84,7 @@ string MessageData::serialize_header() const {
     }
     header.push_back(static_cast<unsigned char>(image_name_length));
     
-    uint32_t image_size = (uint32_t) this->image_data.size();
+    uint32_t image_size = (uint32_t) (this->payload_size() + this->trailer().size());
     header.append(reinterpret_cast<char *>(&image_size), sizeof(image_size));
     
     if (image_name_length != 0) {
@@ -65,6 +95,88 @@ string MessageData::serialize_header() const {
     return header;
 }
 
+void MessageData::add_crc() {
+    crc = crc32c(payload_data(), payload_size());
+    has_crc = true;
+}
+
+bool MessageData::crc_matches() const {
+    return !has_crc || crc32c(payload_data(), payload_size()) == crc;
+}
+
+string MessageData::trailer() const {
+    string trailer;
+    if (has_geometry()) {
+        append_geometry(trailer);
+    }
+    if (has_crc) {
+        trailer.append(reinterpret_cast<const char *>(&crc), sizeof(crc));
+    }
+    return trailer;
+}
+
+void MessageData::take_trailer(unsigned char type_byte) {
+    auto shrink = [this](size_t count) {
+        if (payload.data) {
+            payload.size -= count;
+        }
+        else {
+            image_data.resize(image_data.size() - count);
+        }
+    };
+    
+    if (type_byte & crc_flag) {
+        has_crc = true;
+        size_t size = payload_size();
+        if (size < sizeof(crc)) {
+            // can't match anything, crc_matches says so
+            crc = ~crc32c(payload_data(), size);
+            return;
+        }
+        memcpy(&crc, payload_data() + size - sizeof(crc), sizeof(crc));
+        shrink(sizeof(crc));
+    }
+    if ((type_byte & geometry_flag) && payload_size() >= geometry_size) {
+        read_geometry(payload_data() + payload_size() - geometry_size);
+        shrink(geometry_size);
+    }
+}
+
+void MessageData::append_geometry(string & buffer) const {
+    buffer.append(reinterpret_cast<const char *>(&width), sizeof(width));
+    buffer.append(reinterpret_cast<const char *>(&height), sizeof(height));
+    buffer.push_back(static_cast<char>(pixel_format));
+}
+
+void MessageData::read_geometry(const char * geometry) {
+    memcpy(&width, geometry, sizeof(width));
+    memcpy(&height, geometry + sizeof(width), sizeof(height));
+    unsigned char format = static_cast<unsigned char>(geometry[sizeof(width) + sizeof(height)]);
+    // a format this end doesn't know: no geometry, the image only shows if it happens to fit
+    if (format >= PIXEL_FORMAT_COUNT) {
+        width = 0;
+        height = 0;
+        format = GRAY8;
+    }
+    pixel_format = static_cast<PixelFormat>(format);
+}
+
+size_t MessageData::bytes_per_pixel(PixelFormat pixel_format) {
+    switch (pixel_format) {
+        case GRAY10:
+        case GRAY16:
+            return 2;
+        case BGR8:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+MessageData::MessageType MessageData::type_of(unsigned char type_byte) {
+    return static_cast<MessageType>(type_byte & ~(crc_flag | geometry_flag));
+}
+
 MessageData::MessageData(MessageType message_type) {
     this->message_type = message_type;
 }
@@ -80,6 +192,12 @@ MessageData::MessageData(MessageType message_type, const string & image_name, co
     this->image_data = image_data;
 }
 
+MessageData::MessageData(MessageType message_type, const string & image_name, const PayloadView & payload) {
+    this->message_type = message_type;
+    this->image_name = image_name;
+    this->payload = payload;
+}
+
 MessageData::MessageData(MessageType message_type, int name_length, long image_length, string & buffer) {
     this->message_type = message_type;
     if (name_length > 0) {
@@ -90,16 +208,49 @@ MessageData::MessageData(MessageType message_type, int name_length, long image_l
     }
 }
 
+const char * MessageData::payload_data() const {
+    return payload.data ? payload.data : image_data.data();
+}
+
+size_t MessageData::payload_size() const {
+    return payload.data ? payload.size : image_data.size();
+}
+
+const PayloadView & MessageData::share_payload() {
+    if (!payload.data && !image_data.empty()) {
+        auto owned = make_shared<string>(std::move(image_data));
+        image_data.clear();
+        payload.owner = owned;
+        payload.data = owned->data();
+        payload.size = owned->size();
+    }
+    return payload;
+}
+
+ImageView::ImageView(MessageData * message_data)
+    : payload(message_data->share_payload()), width(message_data->width), height(message_data->height),
+      pixel_format(message_data->pixel_format) {
+}
+
+void ImageView::restore(MessageData * message_data) const {
+    message_data->image_data.clear();
+    message_data->payload = payload;
+    message_data->width = width;
+    message_data->height = height;
+    message_data->pixel_format = pixel_format;
+}
+
 MessageData * MessageData::deserialize(string & buffer, MessageState message_state) {
     if (buffer.size() < MessageData::header_size) {
         return nullptr;
     }
     
-    MessageType message_type = static_cast<MessageType>(buffer[0]);
+    unsigned char type_byte = static_cast<unsigned char>(buffer[0]);
+    MessageType message_type = type_of(type_byte);
     int name_length = static_cast<int>(buffer[1]);
     uint32_t image_length = *(reinterpret_cast<uint32_t *>(&buffer[2]));
     
-    if (message_state == MessageState::STARTED) {
+    if (message_state == MessageState::STARTED && Comm::log_messages) {
         cout << "got buffer mt:" << message_type << " nl:" << name_length << " il:" << image_length << endl;
     }
     
@@ -109,10 +260,62 @@ MessageData * MessageData::deserialize(string & buffer, MessageState message_sta
     
     auto message_data = new MessageData(message_type, name_length, image_length, buffer);
     buffer.erase(0, name_length + image_length + header_size);
+    message_data->take_trailer(type_byte);
+    
+    return message_data;
+}
+
+MessageData * MessageData::from_view(const PayloadView & message) {
+    if (message.size < MessageData::header_size) {
+        return nullptr;
+    }
     
+    unsigned char type_byte = static_cast<unsigned char>(message.data[0]);
+    MessageType message_type = type_of(type_byte);
+    int name_length = static_cast<unsigned char>(message.data[1]);
+    uint32_t image_length;
+    memcpy(&image_length, &message.data[2], sizeof(image_length));
+    if (message.size < name_length + image_length + header_size) {
+        return nullptr;
+    }
+    
+    auto message_data = new MessageData(message_type);
+    message_data->image_name.assign(&message.data[header_size], name_length);
+    if (image_length > 0) {
+        message_data->payload.owner = message.owner;
+        message_data->payload.data = &message.data[header_size + name_length];
+        message_data->payload.size = image_length;
+    }
+    message_data->take_trailer(type_byte);
     return message_data;
 }
 
+// called once per connection a message was queued on, the last one disposes of it
+static void release_sent(MessageData * message_data) {
+    if (--message_data->use_count <= 0) {
+        // cout << "comm deleting message data " << message_data->message_type << endl;
+        if (message_data->auto_delete) {
+            delete message_data;
+        }
+    }
+}
+
+Connection::~Connection() {
+    if (ingest) {
+        ingest->abandon();
+    }
+    if (last_image) {
+        release_sent(last_image);
+    }
+    delete send_ring;
+    delete receive_ring;
+#ifndef _WINDOWS
+    for (int fd : received_fds) {
+        ::close(fd);
+    }
+#endif
+}
+
 void Connection::stop() {
     keep_going_flag = false;
 
@@ -128,23 +331,90 @@ void Connection::stop() {
     }
 }
 
+// images keep their order in send_values, everything else is small and goes ahead of them
+static bool is_control(const MessageData * message_data) {
+    switch (message_data->message_type) {
+        case MessageData::MessageType::IMAGE:
+        case MessageData::MessageType::IMAGE_REF:
+        case MessageData::MessageType::PRELOAD:
+        case MessageData::MessageType::VIDEO:
+            return false;
+        default:
+            return true;
+    }
+}
+
 void Connection::send(MessageData * message_data) {
     lock_guard<mutex> guard(this->send_values_mutex);
-    send_values.emplace_back(message_data);
+    if (!is_control(message_data)) {
+        send_values.emplace_back(message_data);
+        return;
+    }
+    
+    // a control message about an image that is still on its way mustn't overtake it
+    if (!message_data->image_name.empty()) {
+        auto it = find_if(send_values.rbegin(), send_values.rend(), [message_data](MessageData * queued) {
+            return queued->image_name == message_data->image_name;
+        });
+        if (it != send_values.rend()) {
+            send_values.insert(it.base(), message_data);
+            return;
+        }
+        if (sending_name == message_data->image_name) {
+            send_values.emplace_front(message_data);
+            return;
+        }
+    }
+    control_values.emplace_back(message_data);
 }
 
 MessageData* Connection::next_send() {
     lock_guard<mutex> guard(this->send_values_mutex);
-    if (send_values.empty()) {
+    // the previous one is out by now
+    sending_name.clear();
+    deque<MessageData *> & queue = !control_values.empty() ? control_values : !send_values.empty() ? send_values : background_values;
+    if (queue.empty()) {
         return nullptr;
     }
 
-    MessageData* message_data = send_values.front();
-    send_values.pop_front();
+    MessageData* message_data = queue.front();
+    queue.pop_front();
+    if (!is_control(message_data)) {
+        sending_name = message_data->image_name;
+    }
 
     return message_data;
 };
 
+MessageData* Connection::next_control() {
+    lock_guard<mutex> guard(this->send_values_mutex);
+    if (control_values.empty()) {
+        return nullptr;
+    }
+    
+    MessageData* message_data = control_values.front();
+    control_values.pop_front();
+    return message_data;
+}
+
+void Connection::send_background(MessageData * message_data) {
+    lock_guard<mutex> guard(this->send_values_mutex);
+    background_values.emplace_back(message_data);
+}
+
+bool Connection::promote(const string & image_name) {
+    lock_guard<mutex> guard(this->send_values_mutex);
+    auto it = find_if(background_values.begin(), background_values.end(), [&image_name](MessageData * message_data) {
+        return message_data->image_name == image_name;
+    });
+    if (it == background_values.end()) {
+        return false;
+    }
+    send_values.emplace_back(*it);
+    background_values.erase(it);
+    return true;
+}
+
 void *get_in_addr(struct sockaddr *sa)
 {
     if (sa->sa_family == AF_INET) {
@@ -183,6 +453,14 @@ void cross_close(SOCKET sockfd) {
 #endif
 }
 
+void cross_shutdown(SOCKET sockfd) {
+#ifdef _WINDOWS
+    shutdown(sockfd, SD_BOTH);
+#else
+    shutdown(sockfd, SHUT_RDWR);
+#endif
+}
+
 int cross_poll(pollfd* ufds, unsigned int nfds, int timeout) {
 #ifdef _WINDOWS
     return WSAPoll(ufds, nfds, timeout);
@@ -223,6 +501,7 @@ Comm::~Comm() {
 #endif
 
     close_all();
+    delete image_cache;
 }
 
 list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFactory comm_factory) {
@@ -239,15 +518,23 @@ list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFa
         }
     }
     
-    if (port_numbers.size() != ip_addresses.size()) {
+    // fewer is fine, shm:// and unix:// addresses need no port
+    if (port_numbers.size() > ip_addresses.size()) {
         cout << "the count of port_numbers (" << port_numbers.size() << ") does not match the number of ip_addresses (" << ip_addresses.size() << ")" << endl;
     }
     
-    if (port_numbers.size() == 0) {
+    if (port_numbers.size() == 0 && ip_addresses.size() == 0) {
         // defaults
         port_numbers.push_back(Comm::default_port);
         ip_addresses.push_back("127.0.0.1");
     }
+    // unpaired ones get the defaults
+    while (port_numbers.size() < ip_addresses.size()) {
+        port_numbers.push_back(Comm::default_port);
+    }
+    while (ip_addresses.size() < port_numbers.size()) {
+        ip_addresses.push_back("127.0.0.1");
+    }
     
     std::list<string>::iterator port_it = port_numbers.begin();
     std::list<string>::iterator ip_it = ip_addresses.begin();
@@ -289,16 +576,21 @@ list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFa
 
 Comm * Comm::start_server(Waiter * waiter, int argc, char* argv[], CommFactory comm_factory) {
     string port_number(Comm::default_port);
+    string address;
     
     for (int i = 1; i < argc - 1; i++) {
         if (strcmp(argv[i],"-p") == 0) {
             port_number = argv[i+1];
         }
+        else if (strcmp(argv[i],"-i") == 0) {
+            // only shm:// and unix:// addresses mean anything to a server
+            address = argv[i+1];
+        }
     }
     
     Comm * comm = comm_factory ? comm_factory() : new Comm();
     comm->set_waiter(waiter);
-    comm->connect(Comm::Role::SERVER, "", port_number);
+    comm->connect(Comm::Role::SERVER, address, port_number);
     
     while (comm->connect_result() == ConnectError::PENDING) {
         this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -318,11 +610,82 @@ void Comm::set_connect_error(ConnectError a_connect_error) {
 }
 
 void Comm::sendAndReceive(Connection * remote_connection) {
+    remote_connection->last_sent = SteadyClock::now();
+    remote_connection->last_received = remote_connection->last_sent;
+    if (transport == Transport::TCP) {
+        // small writes (heartbeats, acks, headers) mustn't wait on nagle for the peer's delayed ack
+        int no_delay = 1;
+        setsockopt(remote_connection->sock_fd, IPPROTO_TCP, TCP_NODELAY, (const char *) &no_delay, sizeof(no_delay));
+#ifdef TCP_NOTSENT_LOWAT
+        if (chunk_size > 0) {
+            // the kernel holds about one chunk that isn't on the wire yet, so a control
+            // message sent between chunks isn't queued behind megabytes of image
+            int low_water = static_cast<int>(chunk_size);
+            setsockopt(remote_connection->sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *) &low_water, sizeof(low_water));
+        }
+#endif
+        if (chunk_size > 0) {
+            // the same on the way in: left to autotuning the receive buffer grows to tens of MB
+            // when the reader falls behind, and a control message queues behind all of it.
+            // 8 chunks still covers a gigabit link with 2ms of round trip
+            int receive_buffer = static_cast<int>(8 * chunk_size);
+            setsockopt(remote_connection->sock_fd, SOL_SOCKET, SO_RCVBUF, (const char *) &receive_buffer, sizeof(receive_buffer));
+        }
+    }
     local_connection.send_thread = new thread(&Comm::execute_send, this, remote_connection);
     local_connection.receive_thread = new thread(&Comm::execute_receive, this, remote_connection);
 }
 
+bool Comm::create_unix_socket(const string & address, SOCKET & sock_fd) {
+#ifdef _WINDOWS
+    cerr << "unix domain sockets aren't supported on windows" << endl;
+    return false;
+#else
+    string path = address.substr(7);  // after unix://
+    sockaddr_un socket_addr;
+    memset(&socket_addr, 0, sizeof(socket_addr));
+    socket_addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(socket_addr.sun_path)) {
+        cerr << "bad unix socket path '" << path << "'" << endl;
+        set_connect_error(ADDR_INFO_ERROR);
+        return false;
+    }
+    strncpy(socket_addr.sun_path, path.c_str(), sizeof(socket_addr.sun_path) - 1);
+    
+    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        cout << "opening unix socket" << endl;
+        return false;
+    }
+    
+    if (this->role == Role::SERVER) {
+        // a socket file left by an earlier run would make bind fail
+        unlink(path.c_str());
+        if (::bind(sock_fd, (struct sockaddr*) &socket_addr, sizeof(socket_addr)) == -1) {
+            cross_close(sock_fd);
+            cerr << "server bind failed on " << path << " " << strerror(errno) << endl;
+            return false;
+        }
+        cout << "server listening at " << path << endl;
+        return true;
+    }
+    
+    if (::connect(sock_fd, (struct sockaddr*) &socket_addr, sizeof(socket_addr)) == -1) {
+        cross_close(sock_fd);
+        cerr << "client: failed to connect to " << path << " " << strerror(errno) << endl;
+        set_connect_error(FAILED_TO_CONNECT);
+        return false;
+    }
+    cout << "client: connecting to " << path << endl;
+    return true;
+#endif
+}
+
 bool Comm::create_socket(const string & ip_address, const string & port, SOCKET & sock_fd) {
+    if (this->transport == Transport::UNIX) {
+        return create_unix_socket(ip_address, sock_fd);
+    }
+    
     if (this->role == Role::SERVER) {
         sock_fd = socket(AF_INET, SOCK_STREAM, 0);
         if (sock_fd < 0) {
@@ -330,6 +693,10 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
             return false;
         }
 
+        // a restarted server can listen again right away, so clients get their link back
+        int reuse = 1;
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse));
+
         sockaddr_in socket_addr;
         memset(&socket_addr, 0, sizeof(socket_addr));
         socket_addr.sin_family = AF_INET;
@@ -425,6 +792,9 @@ bool Comm::allow_new_connection(const sockaddr_storage& sin_addr, socklen_t sin_
 void Comm::got_new_connection(const sockaddr_storage& sin_addr, socklen_t sin_size) {
 }
 
+void Comm::prepare_image(MessageData * /* message_data */) {
+}
+
 void Comm::add_connection(Connection * remote_connection) {
     lock_guard<mutex> guard(this->remote_connections_mutex);
     this->remote_connections.emplace_back(remote_connection);
@@ -444,8 +814,14 @@ Comm::RemoteConnectionResult Comm::init_remote_connection(Connection* remote_con
 void Comm::execute_connect(Role role, const string & ip_address, const string & port) {
     // see https://beej.us/guide/bgnet/html/#a-simple-stream-client
 
+    ThreadConfig::enter(CONNECT_THREAD);
     this->role = role;
 
+    if (this->transport == Transport::SHM) {
+        execute_shm_connect(ip_address);
+        return;
+    }
+
     if (!create_socket(ip_address, port, local_connection.sock_fd)) {
         set_connect_error(CREATE_SOCKET_FAILURE);
         local_connection.keep_going_flag = false;
@@ -480,12 +856,14 @@ void Comm::execute_connect(Role role, const string & ip_address, const string &
                 SOCKET candidate_fd = accept(local_connection.sock_fd, (struct sockaddr*)&client_addr, &sin_size);
                 if (candidate_fd == -1) {
                     // cerr << "server accept failed or no connection attempt" << endl;
-                    this_thread::sleep_for(std::chrono::microseconds(100));
+                    ThreadConfig::sleep_for(std::chrono::microseconds(100));
                     continue;
                 }
 
-                char client_info_buffer[INET6_ADDRSTRLEN];
-                inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr*)&client_addr), client_info_buffer, sizeof client_info_buffer);
+                char client_info_buffer[INET6_ADDRSTRLEN] = "unix socket";
+                if (client_addr.ss_family != AF_UNIX) {
+                    inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr*)&client_addr), client_info_buffer, sizeof client_info_buffer);
+                }
                 cout << "server: got new connection from " << client_info_buffer << endl;
 
                 if (!allow_new_connection(client_addr, sin_size)) {
@@ -510,15 +888,206 @@ void Comm::execute_connect(Role role, const string & ip_address, const string &
             }
         }
         else {
-            sendAndReceive(&local_connection);
-            set_connect_error(ConnectError::SUCCESS);
+            execute_client(ip_address, port);
         }
     }
 
     cout << "exited connect thread" << endl;
 }
 
+// the client's connect thread stays to bring the link back whenever it drops
+void Comm::execute_client(const string & ip_address, const string & port) {
+    double backoff = min_backoff;
+    
+    while (true) {
+        sendAndReceive(&local_connection);
+        set_connect_error(ConnectError::SUCCESS);
+        // shared memory rings belong to the server, they can't be reopened from here
+        if (!reconnect_enabled || transport == Transport::SHM) {
+            return;
+        }
+        
+        auto connected_at = SteadyClock::now();
+        while (local_connection.keep_going_flag && !disconnecting) {
+            this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (disconnecting) {
+            return;
+        }
+        
+        auto lost_at = SteadyClock::now();
+        local_connection.stop();
+        cross_close(local_connection.sock_fd);
+        local_connection.received_so_far.clear();
+        drop_assembly(&local_connection);
+        local_connection.direct_remaining = 0;
+#ifndef _WINDOWS
+        for (int fd : local_connection.received_fds) {
+            ::close(fd);
+        }
+#endif
+        local_connection.received_fds.clear();
+        message_state = MessageState::WAITING;
+        set_connect_error(RECONNECTING);
+        cerr << "lost connection to " << ip_address << ":" << port << ", reconnecting" << endl;
+        
+        // a link that keeps dropping right away doesn't get hammered
+        if (Seconds(lost_at - connected_at).count() > max_backoff) {
+            backoff = min_backoff;
+        }
+        
+        bool connected = false;
+        while (!disconnecting) {
+            connected = create_socket(ip_address, port, local_connection.sock_fd);
+            if (connected) {
+                break;
+            }
+            set_connect_error(RECONNECTING);
+            auto retry_at = SteadyClock::now() + std::chrono::duration_cast<SteadyClock::duration>(Seconds(backoff));
+            while (!disconnecting && SteadyClock::now() < retry_at) {
+                this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            backoff = min(backoff * 2, max_backoff);
+        }
+        if (!connected) {
+            return;
+        }
+        
+        local_connection.keep_going_flag = true;
+        apply_reconnect_policy();
+        
+        double blackout = Seconds(SteadyClock::now() - lost_at).count();
+        {
+            lock_guard<mutex> guard(this->link_mutex);
+            reconnect_count += 1;
+            last_blackout = blackout;
+            longest_blackout = max(longest_blackout, blackout);
+            total_blackout += blackout;
+        }
+        cout << "reconnected to " << ip_address << ":" << port << " after " << blackout << "s" << endl;
+    }
+}
+
+void Comm::apply_reconnect_policy() {
+    // whatever was in flight went down with the old connection
+    flow.reset();
+    
+    MessageData * last_image = local_connection.last_image;
+    local_connection.last_image = nullptr;
+    deque<MessageData *> dropped;
+    auto now = SteadyClock::now();
+    {
+        lock_guard<mutex> guard(local_connection.send_values_mutex);
+        deque<MessageData *> & queue = local_connection.send_values;
+        
+        if (reconnect_policy == ReconnectPolicy::DROP_QUEUE) {
+            dropped.swap(queue);
+            dropped.insert(dropped.end(), local_connection.background_values.begin(), local_connection.background_values.end());
+            local_connection.background_values.clear();
+            dropped.insert(dropped.end(), local_connection.control_values.begin(), local_connection.control_values.end());
+            local_connection.control_values.clear();
+        }
+        else if (reconnect_policy == ReconnectPolicy::KEEP_LATEST) {
+            // the newest image supersedes the rest, control messages stay
+            auto newest = find_if(queue.rbegin(), queue.rend(), [](MessageData * message_data) {
+                return message_data->message_type == MessageData::MessageType::IMAGE;
+            });
+            deque<MessageData *> kept;
+            for (MessageData * message_data : queue) {
+                if (message_data->message_type == MessageData::MessageType::IMAGE && (newest == queue.rend() || message_data != *newest)) {
+                    dropped.push_back(message_data);
+                }
+                else {
+                    kept.push_back(message_data);
+                }
+            }
+            if (newest == queue.rend() && last_image) {
+                // nothing newer to show, send the last image again (it may not have arrived)
+                kept.push_front(last_image);
+                last_image = nullptr;
+            }
+            queue.swap(kept);
+        }
+        
+        for (MessageData * message_data : queue) {
+            if (message_data->message_type == MessageData::MessageType::IMAGE || message_data->message_type == MessageData::MessageType::VIDEO) {
+                flow.requeued(message_data->image_name, now);
+            }
+        }
+    }
+    
+    if (last_image) {
+        release_sent(last_image);
+    }
+    for (MessageData * message_data : dropped) {
+        release_sent(message_data);
+    }
+    lock_guard<mutex> guard(this->link_mutex);
+    dropped_on_reconnect += static_cast<long>(dropped.size());
+}
+
+void Comm::connection_lost(Connection * remote_connection, ConnectError connect_error) {
+    set_connect_error(connect_error);
+    if (connect_error == HEARTBEAT_TIMEOUT) {
+        lock_guard<mutex> guard(this->link_mutex);
+        heartbeat_timeout_count += 1;
+    }
+    
+    if (!remote_connection->receive_ring) {
+        // wakes a send thread that's stuck writing to a peer that stopped reading
+        cross_shutdown(remote_connection->sock_fd);
+    }
+    if (is_server()) {
+        if (!remote_connection->receive_ring) {
+            cross_close(remote_connection->sock_fd);
+        }
+        remove_connection(remote_connection);
+    }
+    remote_connection->keep_going_flag = false;
+}
+
+bool Comm::heartbeat_expired(Connection * remote_connection) const {
+    if (heartbeat_timeout <= 0) {
+        return false;
+    }
+    Seconds quiet = SteadyClock::now() - remote_connection->last_received;
+    return quiet.count() > heartbeat_timeout;
+}
+
+// a read-only copy of the payload that the receiver can map; -1 if unavailable
+static int make_sealed_memfd(const char * data, size_t size) {
+#ifdef __linux__
+    int memfd = memfd_create("mrr_image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        return -1;
+    }
+    
+    size_t written = 0;
+    while (written < size) {
+        ssize_t count = ::write(memfd, data + written, size - written);
+        if (count <= 0) {
+            ::close(memfd);
+            return -1;
+        }
+        written += static_cast<size_t>(count);
+    }
+    
+    // once sealed the receiver can map it without the sender being able to change or truncate it
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        ::close(memfd);
+        return -1;
+    }
+    return memfd;
+#else
+    return -1;
+#endif
+}
+
 ConnectError Comm::send_one(Connection * connection, MessageData * message_data) {
+    if (connection->send_ring) {
+        return send_one_shm(connection, message_data);
+    }
+    
     pollfd ufds[1];
     ufds[0].fd = connection->sock_fd;
     ufds[0].events = POLLOUT;
@@ -528,38 +1097,58 @@ ConnectError Comm::send_one(Connection * connection, MessageData * message_data)
         set_connect_error(SEND_POLL_ERROR);
         connection->keep_going_flag = false;
         cerr << "send poll error" << endl;
+        release_sent(message_data);
         return SEND_POLL_ERROR;
     }
 
     if (poll_result == 0) {
-        // possibly means socket is already busy sending?
+        // possibly means socket is already busy sending? the caller tries again or gives up on it
         return SEND_TIMEOUT;
     }
    
-    const string header = message_data->serialize_header();
+    bool memfd_image = transport == Transport::UNIX && message_data->message_type == MessageData::MessageType::IMAGE &&
+                       message_data->payload_size() >= memfd_min_size;
+    if (!memfd_image) {
+        add_checksum(message_data);
+    }
+    const string header = message_data->header.empty() ? message_data->serialize_header() : message_data->header;
+    const string trailer = message_data->trailer();
     auto header_size = header.size();
-    auto image_size = message_data->image_data.size();
+    auto image_size = message_data->payload_size();
+    
+    if (memfd_image) {
+        int memfd = make_sealed_memfd(message_data->payload_data(), image_size);
+        if (memfd >= 0) {
+            return send_one_fd(connection, message_data, header, memfd);
+        }
+        // otherwise the payload goes down the socket as usual
+    }
+    
+    if (chunk_size > 0 && header_size + image_size + trailer.size() > chunk_size) {
+        return send_chunked(connection, message_data, header);
+    }
+    
     long sent = 0;
     switch (role) {
         case Role::SERVER:
         case Role::CLIENT:
             auto begin = SteadyClock::now();
-            sent = ::send(connection->sock_fd, header.data(), header_size, 0);
-            if (message_data->image_data.size() > 0) {
-                sent += ::send(connection->sock_fd, message_data->image_data.data(), image_size, 0);
+            sent = ::send(connection->sock_fd, header.data(), header_size, send_flags);
+            if (image_size > 0) {
+                sent += ::send(connection->sock_fd, message_data->payload_data(), image_size, send_flags);
+            }
+            if (!trailer.empty()) {
+                sent += ::send(connection->sock_fd, trailer.data(), trailer.size(), send_flags);
             }
             Seconds seconds = (SteadyClock::now() - begin);
-            cout << "sent h:" << header_size << " ty:" << static_cast<int>(header[0]) << " i:" << image_size << " t:" << seconds.count() << "s" << endl;
+            if (log_messages) {
+                cout << "sent h:" << header_size << " ty:" << static_cast<int>(header[0]) << " i:" << image_size << " t:" << seconds.count() << "s" << endl;
+            }
             break;
     }
-    if (--message_data->use_count <= 0) {
-        // cout << "comm deleting message data " << message_data->message_type << endl;
-        if (message_data->auto_delete) {
-            delete message_data;
-        }
-    }
+    release_sent(message_data);
 
-    if (sent != header_size + image_size) {
+    if (sent != header_size + image_size + trailer.size()) {
         set_connect_error(SEND_COUNT_FAILURE);
         connection->keep_going_flag = false;
         cerr << "send count failure sent:" << sent << " hs:" << header_size << " is:" << image_size << endl;
@@ -569,49 +1158,641 @@ ConnectError Comm::send_one(Connection * connection, MessageData * message_data)
     return ConnectError::SUCCESS;
 }
 
-void Comm::execute_send(Connection * remote_connection) {
-    while (true) {
-        while (MessageData * message_data = remote_connection->next_send()) {
-            ConnectError result = send_one(remote_connection, message_data);
-            if (result == ConnectError::SUCCESS) {
-                continue;
+ConnectError Comm::send_chunked(Connection * connection, MessageData * message_data, const string & header) {
+    // the message is these three pieces back to back, a chunk may straddle them
+    const string trailer = message_data->trailer();
+    struct Piece {
+        const char * data;
+        size_t size;
+    } pieces[] = {{header.data(), header.size()}, {message_data->payload_data(), message_data->payload_size()}, {trailer.data(), trailer.size()}};
+    uint32_t total_size = static_cast<uint32_t>(header.size() + message_data->payload_size() + trailer.size());
+    auto begin = SteadyClock::now();
+    
+    // each CHUNK is a message of its own: the usual header, then the total size and offset
+    char prefix[MessageData::header_size + 2 * sizeof(uint32_t)];
+    prefix[0] = static_cast<char>(MessageData::MessageType::CHUNK);
+    prefix[1] = 0;
+    
+    for (uint32_t offset = 0; offset < total_size; ) {
+        // whatever control messages came in meanwhile go out before the next chunk
+        while (MessageData * control = connection->next_control()) {
+            ConnectError result = send_retrying(connection, control);
+            if (result != ConnectError::SUCCESS) {
+                release_sent(message_data);
+                return result;
             }
-            
-            long counter = 0;
-            while (result == SEND_TIMEOUT && counter < 100) {
-                result = send_one(remote_connection, message_data);
-                counter += 1;
-                this_thread::sleep_for(std::chrono::microseconds(10));
+            interleaved_count += 1;
+        }
+        
+        if (offset > 0) {
+            pollfd ufds[1];
+            ufds[0].fd = connection->sock_fd;
+            ufds[0].events = POLLOUT;
+            int poll_result = cross_poll(ufds, 1, 500);
+            if (poll_result == -1) {
+                set_connect_error(SEND_POLL_ERROR);
+                connection->keep_going_flag = false;
+                cerr << "send poll error" << endl;
+                release_sent(message_data);
+                return SEND_POLL_ERROR;
             }
-            
-            if (result == ConnectError::SUCCESS) {
-                continue;
+            if (poll_result == 0) {
+                // the retry starts over, the receiver drops the partial message when it sees offset 0
+                return SEND_TIMEOUT;
             }
-            
-            break;
         }
-
-        if (!remote_connection->keep_going_flag) {
-            break;
+        
+        uint32_t size = static_cast<uint32_t>(min<size_t>(chunk_size, total_size - offset));
+        uint32_t chunk_length = size + 2 * sizeof(uint32_t);
+        memcpy(&prefix[2], &chunk_length, sizeof(chunk_length));
+        memcpy(&prefix[MessageData::header_size], &total_size, sizeof(total_size));
+        memcpy(&prefix[MessageData::header_size + sizeof(uint32_t)], &offset, sizeof(offset));
+        long sent;
+#ifdef _WINDOWS
+        string chunk(prefix, sizeof(prefix));
+#else
+        iovec parts[4];
+        parts[0].iov_base = prefix;
+        parts[0].iov_len = sizeof(prefix);
+        int part_count = 1;
+#endif
+        size_t piece_start = 0;
+        for (const Piece & piece : pieces) {
+            size_t begin_at = max<size_t>(offset, piece_start);
+            size_t end_at = min<size_t>(offset + size, piece_start + piece.size);
+            if (begin_at < end_at) {
+#ifdef _WINDOWS
+                chunk.append(piece.data + begin_at - piece_start, end_at - begin_at);
+#else
+                parts[part_count].iov_base = const_cast<char *>(piece.data + begin_at - piece_start);
+                parts[part_count++].iov_len = end_at - begin_at;
+#endif
+            }
+            piece_start += piece.size;
         }
+#ifdef _WINDOWS
+        sent = ::send(connection->sock_fd, chunk.data(), chunk.size(), send_flags);
+#else
+        msghdr message = {};
+        message.msg_iov = parts;
+        message.msg_iovlen = part_count;
+        sent = sendmsg(connection->sock_fd, &message, send_flags);
+#endif
+        if (sent != static_cast<long>(sizeof(prefix) + size)) {
+            set_connect_error(SEND_COUNT_FAILURE);
+            connection->keep_going_flag = false;
+            cerr << "send count failure chunk sent:" << sent << " offset:" << offset << " size:" << size << endl;
+            release_sent(message_data);
+            return SEND_COUNT_FAILURE;
+        }
+        offset += size;
+    }
+    
+    if (log_messages) {
+        Seconds seconds = SteadyClock::now() - begin;
+        cout << "sent chunked h:" << header.size() << " ty:" << static_cast<int>(header[0]) << " i:" << message_data->payload_size() << " t:" << seconds.count() << "s" << endl;
+    }
+    chunked_count += 1;
+    release_sent(message_data);
+    return ConnectError::SUCCESS;
+}
 
+void Comm::add_checksum(MessageData * message_data) {
+    // a header that's already serialized (fan_out) has had its say
+    if (!checksums || message_data->has_crc || !message_data->header.empty() || message_data->payload_size() == 0 ||
+        (message_data->message_type != MessageData::MessageType::IMAGE && message_data->message_type != MessageData::MessageType::PRELOAD &&
+         message_data->message_type != MessageData::MessageType::VIDEO)) {
+        return;
+    }
+    message_data->add_crc();
+    crc_added_count += 1;
+}
+
+ConnectError Comm::send_retrying(Connection * connection, MessageData * message_data, int retries) {
+    ConnectError result = send_one(connection, message_data);
+    
+    long counter = 0;
+    while (result == SEND_TIMEOUT && counter < retries) {
+        result = send_one(connection, message_data);
+        counter += 1;
         this_thread::sleep_for(std::chrono::microseconds(10));
     }
+    if (result == SEND_TIMEOUT) {
+        release_sent(message_data);
+    }
+    return result;
+}
+
+void Comm::execute_shm_connect(const string & address) {
+    // one ring each way, named after the address: shm://display_1 -> /mrr_display_1_c2s, /mrr_display_1_s2c
+    string base = "/mrr_" + address.substr(6);
+    string client_to_server = base + "_c2s";
+    string server_to_client = base + "_s2c";
+    local_connection.sock_fd = -1;
+    
+    if (is_server()) {
+        ShmRing * receive_ring = ShmRing::create(client_to_server, shm_slot_count, shm_slot_size);
+        ShmRing * send_ring = ShmRing::create(server_to_client, shm_slot_count, shm_slot_size);
+        if (receive_ring == nullptr || send_ring == nullptr) {
+            delete receive_ring;
+            delete send_ring;
+            set_connect_error(CREATE_SOCKET_FAILURE);
+            local_connection.keep_going_flag = false;
+            return;
+        }
+        cout << "server waiting on shared memory " << base << endl;
+        
+        // the client opens the server->client ring first, so once it's attached to this one it has both
+        while (local_connection.keep_going_flag && !receive_ring->peer_attached()) {
+            this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (!local_connection.keep_going_flag) {
+            delete receive_ring;
+            delete send_ring;
+            return;
+        }
+        
+        cout << "server: got shared memory connection on " << base << endl;
+        Connection * remote_connection = new Connection;
+        remote_connection->local = false;
+        remote_connection->sock_fd = -1;
+        remote_connection->receive_ring = receive_ring;
+        remote_connection->send_ring = send_ring;
+        add_connection(remote_connection);
+        set_connect_error(ConnectError::SUCCESS);
+        sendAndReceive(remote_connection);
+    }
+    else {
+        // like a tcp connect, give the server a moment to come up
+        auto deadline = SteadyClock::now() + std::chrono::seconds(5);
+        while (local_connection.receive_ring == nullptr || local_connection.send_ring == nullptr) {
+            if (local_connection.receive_ring == nullptr) {
+                local_connection.receive_ring = ShmRing::open(server_to_client);
+            }
+            if (local_connection.receive_ring != nullptr && local_connection.send_ring == nullptr) {
+                local_connection.send_ring = ShmRing::open(client_to_server);
+            }
+            if (SteadyClock::now() > deadline) {
+                cerr << "client: no shared memory server at " << base << endl;
+                set_connect_error(FAILED_TO_CONNECT);
+                local_connection.keep_going_flag = false;
+                return;
+            }
+            this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        
+        cout << "client: connected to shared memory " << base << endl;
+        sendAndReceive(&local_connection);
+        set_connect_error(ConnectError::SUCCESS);
+    }
+    
+    cout << "exited connect thread" << endl;
+}
+
+ConnectError Comm::send_one_fd(Connection * connection, MessageData * message_data, const string & header, int memfd) {
+#ifdef _WINDOWS
+    return SEND_COUNT_FAILURE;
+#else
+    // same header, but the payload bytes don't follow on the stream
+    string fd_header(header);
+    fd_header[0] = static_cast<char>(MessageData::MessageType::IMAGE_FD | (message_data->has_geometry() ? MessageData::geometry_flag : 0));
+    // no crc trailer either, even when fan_out computed one; the geometry follows the name
+    uint32_t image_length = static_cast<uint32_t>(message_data->payload_size());
+    memcpy(&fd_header[2], &image_length, sizeof(image_length));
+    if (message_data->has_geometry()) {
+        message_data->append_geometry(fd_header);
+    }
+    
+    iovec io_vector;
+    io_vector.iov_base = &fd_header[0];
+    io_vector.iov_len = fd_header.size();
+    
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &io_vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    cmsghdr * control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(control_message), &memfd, sizeof(int));
+    
+    auto begin = SteadyClock::now();
+    long sent = sendmsg(connection->sock_fd, &message, send_flags);
+    // the receiver holds its own descriptor now
+    ::close(memfd);
+    if (log_messages) {
+        Seconds seconds = SteadyClock::now() - begin;
+        cout << "sent fd h:" << fd_header.size() << " i:" << message_data->payload_size() << " t:" << seconds.count() << "s" << endl;
+    }
+    release_sent(message_data);
+    
+    if (sent != static_cast<long>(fd_header.size())) {
+        set_connect_error(SEND_COUNT_FAILURE);
+        connection->keep_going_flag = false;
+        cerr << "send count failure sent:" << sent << " hs:" << fd_header.size() << endl;
+        return SEND_COUNT_FAILURE;
+    }
+    return ConnectError::SUCCESS;
+#endif
+}
+
+long Comm::receive_with_fds(Connection * connection, char * buffer, size_t buffer_size) {
+#ifdef _WINDOWS
+    return recv(connection->sock_fd, buffer, buffer_size, 0);
+#else
+    iovec io_vector;
+    io_vector.iov_base = buffer;
+    io_vector.iov_len = buffer_size;
+    
+    char control[CMSG_SPACE(sizeof(int) * 16)];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &io_vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    long received_count = recvmsg(connection->sock_fd, &message, MSG_CMSG_CLOEXEC);
+    if (received_count < 0) {
+        return received_count;
+    }
+    
+    for (cmsghdr * control_message = CMSG_FIRSTHDR(&message); control_message != nullptr; control_message = CMSG_NXTHDR(&message, control_message)) {
+        if (control_message->cmsg_level != SOL_SOCKET || control_message->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t fd_count = (control_message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < fd_count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(control_message) + i * sizeof(int), sizeof(int));
+            connection->received_fds.push_back(fd);
+        }
+    }
+    if (message.msg_flags & MSG_CTRUNC) {
+        cerr << "file descriptors were dropped, raise the control buffer size" << endl;
+    }
+    return received_count;
+#endif
+}
+
+MessageData * Comm::next_message(Connection * connection) {
+    string & buffer = connection->received_so_far;
+    if (buffer.size() < MessageData::header_size || MessageData::type_of(buffer[0]) != MessageData::MessageType::IMAGE_FD) {
+        MessageData * message_data = MessageData::deserialize(buffer, message_state);
+        if (message_data && message_data->message_type == MessageData::MessageType::CHUNK) {
+            message_data = dechunk(connection, message_data);
+            return message_data ? message_data : next_message(connection);
+        }
+        return message_data;
+    }
+    
+#ifdef _WINDOWS
+    return nullptr;
+#else
+    int name_length = static_cast<unsigned char>(buffer[1]);
+    uint32_t image_length;
+    memcpy(&image_length, &buffer[2], sizeof(image_length));
+    size_t geometry_size = (buffer[0] & MessageData::geometry_flag) ? MessageData::geometry_size : 0;
+    if (buffer.size() < MessageData::header_size + name_length + geometry_size) {
+        return nullptr;
+    }
+    
+    string image_name = buffer.substr(MessageData::header_size, name_length);
+    string geometry = buffer.substr(MessageData::header_size + name_length, geometry_size);
+    buffer.erase(0, MessageData::header_size + name_length + geometry_size);
+    if (connection->received_fds.empty()) {
+        cerr << "image '" << image_name << "' arrived without its memfd, dropped" << endl;
+        return next_message(connection);
+    }
+    int memfd = connection->received_fds.front();
+    connection->received_fds.pop_front();
+    
+    // only map what the sender can no longer change or shrink underneath us
+    struct stat memfd_stat;
+    void * address = MAP_FAILED;
+#ifdef __linux__
+    int seals = fcntl(memfd, F_GET_SEALS);
+    bool sealed = seals != -1 && (seals & F_SEAL_WRITE) && (seals & F_SEAL_SHRINK);
+#else
+    bool sealed = false;
+#endif
+    if (sealed && fstat(memfd, &memfd_stat) == 0 && memfd_stat.st_size >= static_cast<off_t>(image_length) && image_length > 0) {
+        address = mmap(nullptr, image_length, PROT_READ, MAP_SHARED, memfd, 0);
+    }
+    ::close(memfd);
+    if (address == MAP_FAILED) {
+        cerr << "image '" << image_name << "' memfd couldn't be mapped, dropped" << endl;
+        return next_message(connection);
+    }
+    
+    auto message_data = new MessageData(MessageData::MessageType::IMAGE, image_name);
+    if (!geometry.empty()) {
+        message_data->read_geometry(geometry.data());
+    }
+    message_data->payload.owner = shared_ptr<const void>(address, [image_length](const void * mapped) {
+        munmap(const_cast<void *>(mapped), image_length);
+    });
+    message_data->payload.data = static_cast<const char *>(address);
+    message_data->payload.size = image_length;
+    return message_data;
+#endif
+}
+
+MessageData * Comm::dechunk(Connection * connection, MessageData * chunk) {
+    const size_t prefix_size = 2 * sizeof(uint32_t);
+    uint32_t total_size = 0;
+    uint32_t offset = 0;
+    size_t size = chunk->payload_size();
+    if (size >= prefix_size) {
+        memcpy(&total_size, chunk->payload_data(), sizeof(total_size));
+        memcpy(&offset, chunk->payload_data() + sizeof(total_size), sizeof(offset));
+        size -= prefix_size;
+    }
+    
+    if (total_size > max_message_size) {
+        // a corrupt or hostile header, nothing after it on this connection can be trusted
+        cerr << "chunked message of " << total_size << " bytes is over the limit of " << max_message_size << ", disconnecting" << endl;
+        delete chunk;
+        connection->received_so_far.clear();
+        connection_lost(connection, CONNECTION_FAILURE);
+        return nullptr;
+    }
+    if (offset == 0) {
+        // a new message; a half received one before it was abandoned by the sender
+        begin_assembly(connection, total_size);
+    }
+    if (!connection->assembly || size == 0 || offset != connection->assembled || total_size != connection->assembly_size || offset + size > total_size) {
+        cerr << "chunk out of order offset:" << offset << " size:" << size << " total:" << total_size << ", dropped" << endl;
+        drop_assembly(connection);
+        delete chunk;
+        return nullptr;
+    }
+    memcpy(connection->assembly.get() + offset, chunk->payload_data() + prefix_size, size);
+    delete chunk;
+    return assembled(connection, size);
+}
+
+void Comm::begin_assembly(Connection * connection, size_t size) {
+    drop_assembly(connection);
+    // not a string, that would zero the whole thing first
+    connection->assembly = shared_ptr<char>(new char[size], default_delete<char[]>());
+    connection->assembly_size = size;
+}
+
+void Comm::drop_assembly(Connection * connection) {
+    if (connection->ingest && !connection->ingest->complete()) {
+        connection->ingest->abandon();
+        ingest_abandoned_count += 1;
+    }
+    connection->ingest.reset();
+    connection->assembly.reset();
+    connection->assembly_size = 0;
+    connection->assembled = 0;
+}
+
+MessageData * Comm::assembled(Connection * connection, size_t count) {
+    connection->assembled += count;
+    const char * bytes = connection->assembly.get();
+    
+    unsigned char type_byte = connection->assembled > 0 ? static_cast<unsigned char>(bytes[0]) : 0;
+    if (ingest_row_bytes > 0 && !connection->ingest && connection->assembled >= MessageData::header_size &&
+        MessageData::type_of(type_byte) == MessageData::MessageType::IMAGE) {
+        size_t name_length = static_cast<unsigned char>(bytes[1]);
+        uint32_t image_length;
+        memcpy(&image_length, &bytes[2], sizeof(image_length));
+        size_t payload_offset = MessageData::header_size + name_length;
+        // the crc is only checked on the whole message, an ingest frame that fails it just never gets its IMAGE
+        size_t trailer_size = ((type_byte & MessageData::crc_flag) ? sizeof(uint32_t) : 0) +
+                              ((type_byte & MessageData::geometry_flag) ? MessageData::geometry_size : 0);
+        if (connection->assembled >= payload_offset && image_length >= ingest_row_bytes + trailer_size && payload_offset + image_length == connection->assembly_size) {
+            auto frame = make_shared<IngestFrame>();
+            frame->image_name.assign(&bytes[MessageData::header_size], name_length);
+            frame->payload.owner = connection->assembly;
+            frame->payload.data = bytes + payload_offset;
+            frame->payload.size = image_length - trailer_size;
+            frame->row_bytes = ingest_row_bytes;
+            frame->band_rows = ingest_band_rows;
+            connection->ingest = frame;
+            {
+                lock_guard<mutex> guard(this->ingest_mutex);
+                ingest_frames.push_back(frame);
+                // nobody's looking, don't hold on to every frame
+                while (ingest_frames.size() > 4) {
+                    ingest_frames.pop_front();
+                }
+            }
+            ingest_count += 1;
+            if (waiter) {
+                waiter->notify();
+            }
+        }
+    }
+    if (connection->ingest) {
+        connection->ingest->advance(connection->assembled - (connection->ingest->payload.data - bytes));
+    }
+    if (connection->assembled < connection->assembly_size) {
+        return nullptr;
+    }
+    
+    // the message's payload stays a view into the assembly, an ingest frame shares it
+    PayloadView whole;
+    whole.owner = connection->assembly;
+    whole.data = bytes;
+    whole.size = connection->assembly_size;
+    drop_assembly(connection);
+    MessageData * message_data = MessageData::from_view(whole);
+    if (!message_data) {
+        cerr << "assembled message is malformed, dropped" << endl;
+    }
+    return message_data;
+}
+
+void Comm::begin_direct(Connection * connection) {
+    string & buffer = connection->received_so_far;
+    if (buffer.size() < MessageData::header_size) {
+        return;
+    }
+    auto message_type = MessageData::type_of(buffer[0]);
+    size_t name_length = static_cast<unsigned char>(buffer[1]);
+    uint32_t image_length;
+    memcpy(&image_length, &buffer[2], sizeof(image_length));
+    if (image_length < direct_min_size || message_type == MessageData::MessageType::IMAGE_FD) {
+        return;
+    }
+    if (MessageData::header_size + name_length + image_length > max_message_size) {
+        // a corrupt or hostile header, nothing after it on this connection can be trusted
+        cerr << "message of " << image_length << " bytes is over the limit of " << max_message_size << ", disconnecting" << endl;
+        buffer.clear();
+        connection_lost(connection, CONNECTION_FAILURE);
+        return;
+    }
+    
+    // whatever is in the buffer belongs to this message, the complete ones before it are gone
+    if (message_type != MessageData::MessageType::CHUNK) {
+        size_t message_size = MessageData::header_size + name_length + image_length;
+        begin_assembly(connection, message_size);
+        size_t count = buffer.size();
+        memcpy(connection->assembly.get(), buffer.data(), count);
+        buffer.clear();
+        connection->direct_remaining = message_size - count;
+        assembled(connection, count);
+        return;
+    }
+    
+    const size_t prefix_size = 2 * sizeof(uint32_t);
+    size_t prefix_end = MessageData::header_size + name_length + prefix_size;
+    if (buffer.size() < prefix_end) {
+        return;
+    }
+    uint32_t total_size;
+    uint32_t offset;
+    memcpy(&total_size, &buffer[prefix_end - prefix_size], sizeof(total_size));
+    memcpy(&offset, &buffer[prefix_end - sizeof(offset)], sizeof(offset));
+    size_t size = image_length - prefix_size;
+    if (total_size > max_message_size) {
+        cerr << "chunked message of " << total_size << " bytes is over the limit of " << max_message_size << ", disconnecting" << endl;
+        buffer.clear();
+        connection_lost(connection, CONNECTION_FAILURE);
+        return;
+    }
+    if (offset == 0) {
+        begin_assembly(connection, total_size);
+    }
+    if (!connection->assembly || offset != connection->assembled || total_size != connection->assembly_size || offset + size > total_size) {
+        // dechunk drops it once it's all in
+        return;
+    }
+    size_t count = buffer.size() - prefix_end;
+    memcpy(connection->assembly.get() + offset, &buffer[prefix_end], count);
+    buffer.clear();
+    connection->direct_remaining = size - count;
+    assembled(connection, count);
+}
+
+ConnectError Comm::send_one_shm(Connection * connection, MessageData * message_data) {
+    add_checksum(message_data);
+    const string header = message_data->header.empty() ? message_data->serialize_header() : message_data->header;
+    const string trailer = message_data->trailer();
+    auto image_size = message_data->payload_size();
+    if (header.size() + image_size + trailer.size() > connection->send_ring->max_message_size()) {
+        // drop this one, the ring itself is fine
+        cerr << "message too large for shared memory slot h:" << header.size() << " i:" << image_size << endl;
+        release_sent(message_data);
+        return SEND_COUNT_FAILURE;
+    }
+    
+    auto begin = SteadyClock::now();
+    if (!connection->send_ring->write(header, message_data->payload_data(), image_size, 0.5, trailer)) {
+        if (connection->send_ring->peer_closed()) {
+            set_connect_error(SERVER_DISCONNECTED);
+            connection->keep_going_flag = false;
+            cerr << "shared memory peer went away" << endl;
+            release_sent(message_data);
+            return SERVER_DISCONNECTED;
+        }
+        // every slot is still held by the reader
+        return SEND_TIMEOUT;
+    }
+    
+    if (log_messages) {
+        Seconds seconds = SteadyClock::now() - begin;
+        cout << "sent shm h:" << header.size() << " ty:" << static_cast<int>(header[0]) << " i:" << image_size << " t:" << seconds.count() << "s" << endl;
+    }
+    release_sent(message_data);
+    return ConnectError::SUCCESS;
+}
+
+void Comm::execute_send(Connection * remote_connection) {
+    ThreadConfig::enter(SEND_THREAD);
+    while (true) {
+        while (MessageData * message_data = remote_connection->next_send()) {
+            if (!is_server() && reconnect_enabled && message_data->message_type == MessageData::MessageType::IMAGE) {
+                // one more reference, in case it has to go out again after a reconnect
+                message_data->use_count += 1;
+                if (remote_connection->last_image) {
+                    release_sent(remote_connection->last_image);
+                }
+                remote_connection->last_image = message_data;
+            }
+            
+            TIMELINE_ZONE("send");
+            ConnectError result;
+            {
+                lock_guard<mutex> guard(remote_connection->write_mutex);
+                result = send_retrying(remote_connection, message_data);
+            }
+            if (result != ConnectError::SUCCESS) {
+                break;
+            }
+            remote_connection->last_sent = SteadyClock::now();
+        }
+
+        if (!remote_connection->keep_going_flag) {
+            break;
+        }
+        
+        if (heartbeat_interval > 0) {
+            auto now = SteadyClock::now();
+            Seconds quiet = now - remote_connection->last_sent;
+            if (quiet.count() >= heartbeat_interval) {
+                // not retried, a timeout means the peer has plenty to read already
+                auto heartbeat = new MessageData(MessageData::MessageType::HEARTBEAT);
+                heartbeat->use_count = 1;
+                lock_guard<mutex> guard(remote_connection->write_mutex);
+                send_retrying(remote_connection, heartbeat, 0);
+                remote_connection->last_sent = now;
+            }
+        }
+
+        ThreadConfig::sleep_for(std::chrono::microseconds(10));
+    }
 
     cout << "exited send thread" << endl;
 }
 
 void Comm::execute_receive(Connection * remote_connection) {
+    ThreadConfig::enter(RECEIVE_THREAD);
+    if (remote_connection->receive_ring) {
+        execute_shm_receive(remote_connection);
+        return;
+    }
+    
     pollfd ufds[1];
     ufds[0].fd = remote_connection->sock_fd;
     ufds[0].events = POLLIN;
-    char buffer[512];
+    // headers and small messages; big bodies are read straight into place, see begin_direct
+    static const size_t buffer_size = 64 << 10;
+    unique_ptr<char[]> buffer(new char[buffer_size]);
     long counter = 0;
+    // wake up often enough to notice a silent peer in time
+    int poll_timeout = heartbeat_timeout > 0 ? 100 : 500;
     
     SD sd;
+    auto received = [this, &sd, remote_connection](MessageData * message_data) {
+        if (log_messages) {
+            Seconds seconds = SteadyClock::now() - this->receive_begin;
+            cout << "receive i:" << message_data->payload_size() << " t:" << seconds.count() << "s" << endl;
+        }
+        
+        if (message_data->message_type == MessageData::MessageType::DISPLAY_NOW) {
+            sd.increment(SteadyClock::now());
+            if (sd.count % 30 == 0) {
+                std::ofstream out("server_dn_counter.txt");
+                sd.dump(out, "DISPLAY_NOW");
+            }
+        }
+        message_state = MessageState::WAITING;
+        deliver_received(message_data, remote_connection);
+    };
 
     while (true) {
-        int poll_result = cross_poll(ufds, 1, 500);
+        int poll_result = cross_poll(ufds, 1, poll_timeout);
         if (poll_result == -1) {
             set_connect_error(RECEIVE_POLL_ERROR);
             remote_connection->keep_going_flag = false;
@@ -622,76 +1803,76 @@ void Comm::execute_receive(Connection * remote_connection) {
         if (poll_result == 0) {
             counter += 1;
             // cout << "receive timeout " << counter << endl;
+            if (heartbeat_expired(remote_connection)) {
+                cerr << "nothing heard from the remote for " << heartbeat_timeout << "s" << endl;
+                connection_lost(remote_connection, HEARTBEAT_TIMEOUT);
+                break;
+            }
         }
         else {
             if (ufds[0].events & POLLIN) {
                 counter = 0;
+                char * target = buffer.get();
+                size_t target_size = buffer_size;
+                bool direct = remote_connection->direct_remaining > 0;
+                if (direct) {
+                    target = remote_connection->assembly.get() + remote_connection->assembled;
+                    target_size = remote_connection->direct_remaining;
+                }
                 long received_count = 0;
+                TIMELINE_ZONE("receive");
                 switch (this->role) {
                     case Role::SERVER:
                     case Role::CLIENT:
-                        received_count = recv(remote_connection->sock_fd, buffer, sizeof(buffer), 0);
+                        if (transport == Transport::UNIX) {
+                            received_count = receive_with_fds(remote_connection, target, target_size);
+                        }
+                        else {
+                            received_count = recv(remote_connection->sock_fd, target, target_size, 0);
+                        }
                         break;
                 }
                 if (received_count <= 0) {
                     cerr << "remote disconnected while looking for incoming" << endl;
-                    set_connect_error(SERVER_DISCONNECTED);
-                    if (is_server()) {
-                        cross_close(remote_connection->sock_fd);
-                        lock_guard<mutex> guard(this->remote_connections_mutex);
-                        this->remote_connections.remove(remote_connection);
-                        this->deleted_remote_connections.emplace_back(remote_connection);
-                    }
-  
-                    remote_connection->keep_going_flag = false;
+                    connection_lost(remote_connection, SERVER_DISCONNECTED);
                     break;
                 }
 
-                remote_connection->received_so_far.append(buffer, received_count);
-                if (message_state == MessageState::WAITING) {
-                    message_state = MessageState::WAITING_FOR_HEADER;
-                    receive_begin = SteadyClock::now();
-                }
-                
-                if (remote_connection->received_so_far.size() >= MessageData::header_size) {
-                    switch (message_state) {
-                        case MessageState::WAITING:
-                        case MessageState::WAITING_FOR_HEADER:
-                            message_state = MessageState::STARTED;
-                            // cout << "started" << endl;
-                            break;
-                        case MessageState::STARTED:
-                            message_state = MessageState::ONGOING;
-                            // cout << "ongoing" << endl;
-                            break;
-                        case MessageState::ONGOING:
-                            break;
+                remote_connection->last_received = SteadyClock::now();
+                if (direct) {
+                    remote_connection->direct_remaining -= received_count;
+                    if (MessageData * message_data = assembled(remote_connection, received_count)) {
+                        received(message_data);
                     }
                 }
-
-                // cout << "so far:" << received_so_far << endl;
-                while (MessageData * message_data = MessageData::deserialize(remote_connection->received_so_far, message_state)) {
-
-                    Seconds seconds = SteadyClock::now() - this->receive_begin;
-                    cout << "receive i:" << message_data->image_data.size() << " t:" << seconds.count() << "s" << endl;
+                else {
+                    remote_connection->received_so_far.append(buffer.get(), received_count);
+                    if (message_state == MessageState::WAITING) {
+                        message_state = MessageState::WAITING_FOR_HEADER;
+                        receive_begin = SteadyClock::now();
+                    }
                     
-                    if (message_data->message_type == MessageData::MessageType::DISPLAY_NOW) {
-                        sd.increment(SteadyClock::now());
-                        if (sd.count % 30 == 0) {
-                            std::ofstream out("server_dn_counter.txt");
-                            sd.dump(out, "DISPLAY_NOW");
+                    if (remote_connection->received_so_far.size() >= MessageData::header_size) {
+                        switch (message_state) {
+                            case MessageState::WAITING:
+                            case MessageState::WAITING_FOR_HEADER:
+                                message_state = MessageState::STARTED;
+                                // cout << "started" << endl;
+                                break;
+                            case MessageState::STARTED:
+                                message_state = MessageState::ONGOING;
+                                // cout << "ongoing" << endl;
+                                break;
+                            case MessageState::ONGOING:
+                                break;
                         }
                     }
-                    message_state = MessageState::WAITING;
-                    {
-                        // lock within tight scope
-                        lock_guard<mutex> guard(this->received_values_mutex);
-                        received_values.emplace_back(message_data);
-                    }
-                    
-                    if (waiter) {
-                        waiter->notify();
+
+                    // cout << "so far:" << received_so_far << endl;
+                    while (MessageData * message_data = next_message(remote_connection)) {
+                        received(message_data);
                     }
+                    begin_direct(remote_connection);
                 }
             }
         }
@@ -704,13 +1885,158 @@ void Comm::execute_receive(Connection * remote_connection) {
     cout << "exited receive thread" << endl;
 }
 
+void Comm::execute_shm_receive(Connection * remote_connection) {
+    while (remote_connection->keep_going_flag) {
+        PayloadView message;
+        if (!remote_connection->receive_ring->read(message, heartbeat_timeout > 0 ? 0.1 : 0.5)) {
+            if (remote_connection->receive_ring->peer_closed()) {
+                cerr << "shared memory peer went away" << endl;
+                connection_lost(remote_connection, SERVER_DISCONNECTED);
+            }
+            else if (heartbeat_expired(remote_connection)) {
+                cerr << "nothing heard from the shared memory peer for " << heartbeat_timeout << "s" << endl;
+                connection_lost(remote_connection, HEARTBEAT_TIMEOUT);
+            }
+            continue;
+        }
+        remote_connection->last_received = SteadyClock::now();
+        
+        // no copy: the payload is read straight out of the slot, which is
+        // handed back to the writer when the message is deleted
+        MessageData * message_data = MessageData::from_view(message);
+        if (message_data == nullptr) {
+            cerr << "malformed shared memory message of " << message.size << " bytes" << endl;
+            continue;
+        }
+        if (log_messages) {
+            cout << "receive shm i:" << message_data->payload_size() << endl;
+        }
+        deliver_received(message_data, remote_connection);
+    }
+    
+    cout << "exited receive thread" << endl;
+}
+
+void Comm::deliver_received(MessageData * message_data, Connection * remote_connection) {
+    TIMELINE_ZONE("deliver");
+    if (message_data->message_type == MessageData::MessageType::HEARTBEAT) {
+        // only there to show the link is alive
+        delete message_data;
+        return;
+    }
+    
+    if (message_data->has_crc) {
+        crc_checked_count += 1;
+        if (!message_data->crc_matches()) {
+            crc_mismatch_count += 1;
+            cerr << "'" << message_data->image_name << "' failed its CRC32C check, dropped" << endl;
+            delete message_data;
+            return;
+        }
+    }
+    
+    // as it arrived, before prepare_image; an IMAGE_REF once it is the IMAGE it names, a miss is resent whole
+    MessageTrace * message_trace = trace.load();
+    bool image_ref = message_data->message_type == MessageData::MessageType::IMAGE_REF;
+    if (message_trace && !image_ref) {
+        // the trace holds the payload until it is written, a ring slot mustn't wait on that
+        keep_payload(message_data);
+        message_trace->record(message_data, SteadyClock::now());
+    }
+    
+    if (!is_server() && message_data->message_type == MessageData::MessageType::ACK) {
+        // acks only feed flow control, they aren't handed to the caller
+        flow.acked(message_data->image_name, SteadyClock::now());
+        delete message_data;
+        return;
+    }
+    if (!is_server() && message_data->message_type == MessageData::MessageType::CACHE_MISS) {
+        resend_missed_image(message_data);
+        delete message_data;
+        return;
+    }
+    MulticastSender * sender = multicast_sender.load();
+    if (sender && message_data->message_type == MessageData::MessageType::NACK) {
+        // repaired while the server still waits for it
+        sender->repair(*message_data);
+        delete message_data;
+        return;
+    }
+    if (is_server() && !resolve_image_ref(message_data, remote_connection)) {
+        return;
+    }
+    if (message_trace && image_ref) {
+        message_trace->record(message_data, SteadyClock::now());
+    }
+    if (is_server() && message_data->message_type == MessageData::MessageType::PRELOAD) {
+        prepare_image(message_data);
+        if (preload.budget_bytes > 0) {
+            keep_payload(message_data);
+            preload.stage(message_data->image_name, ImageView(message_data));
+            delete message_data;
+            return;
+        }
+    }
+    if (is_server() && message_data->message_type == MessageData::MessageType::DISPLAY_NOW && !message_data->image_name.empty()) {
+        ImageView staged;
+        if (preload.take(message_data->image_name, staged)) {
+            staged.restore(message_data);
+        }
+    }
+    
+    {
+        // lock within tight scope
+        lock_guard<mutex> guard(this->received_values_mutex);
+        received_values.emplace_back(message_data);
+    }
+    
+    if (waiter) {
+        waiter->notify();
+    }
+}
+
+void Comm::set_trace(MessageTrace * trace) {
+    this->trace = trace;
+}
+
+void Comm::set_multicast_sender(MulticastSender * sender) {
+    multicast_sender = sender;
+}
+
+void Comm::receive_external(MessageData * message_data) {
+    deliver_received(message_data);
+}
+
+void Comm::remove_connection(Connection * remote_connection) {
+    lock_guard<mutex> guard(this->remote_connections_mutex);
+    this->remote_connections.remove(remote_connection);
+    this->deleted_remote_connections.emplace_back(remote_connection);
+}
+
 bool Comm::connect(Role pending_role, const string & ip_address, const string & port) {
     if (connect_thread != nullptr) {
         return false;
     }
 
-    this->ip_address = (pending_role == Role::CLIENT ? ip_address : "localhost");
+    if (ip_address.compare(0, 6, "shm://") == 0) {
+        this->transport = Transport::SHM;
+    }
+    else if (ip_address.compare(0, 7, "unix://") == 0) {
+        this->transport = Transport::UNIX;
+    }
+    else {
+        this->transport = Transport::TCP;
+    }
+    this->ip_address = (pending_role == Role::CLIENT || this->transport != Transport::TCP) ? ip_address : "localhost";
     this->ip_port = port;
+    this->disconnecting = false;
+    if (pending_role == Role::SERVER && image_cache_bytes > 0) {
+        lock_guard<mutex> guard(this->image_cache_mutex);
+        if (!image_cache) {
+            // an IMAGE_REF can only name an image that was kept when it arrived whole
+            image_cache = new ContentCache(image_cache_bytes);
+        }
+    }
 
     cout << "attempting to connect to " << this->ip_address << ":" << port << " as " << (pending_role == Role::CLIENT ? "client" : "server") << endl;
 
@@ -731,6 +2057,7 @@ void Comm::disconnect() {
 
     cout << "disconnecting" << endl;
 
+    this->disconnecting = true;
     this->local_connection.keep_going_flag = false;
 
     connect_thread->join();
@@ -743,6 +2070,11 @@ void Comm::disconnect() {
     }
 
     cross_close(this->local_connection.sock_fd);
+#ifndef _WINDOWS
+    if (is_server() && transport == Transport::UNIX) {
+        unlink(this->ip_address.substr(7).c_str());
+    }
+#endif
 }
 
 void Comm::close_one(Connection* remote_connection) {
@@ -754,6 +2086,9 @@ void Comm::close_one(Connection* remote_connection) {
         cross_close(remote_connection->sock_fd);
         delete remote_connection;
     }
+    else if (remote_connection->receive_ring) {
+        delete remote_connection;
+    }
 }
 
 void Comm::close_all() {
@@ -770,15 +2105,17 @@ void Comm::close_all() {
 }
 
 ConnectError Comm::send(MessageData * message_data, BlockType block) {
-    bool result = false;
+    ConnectError result = ConnectError::SUCCESS;
     if (is_server()) {
         lock_guard<mutex> guard(this->remote_connections_mutex);
         message_data->use_count = static_cast<int>(this->remote_connections.size());
         for (Connection* remote_connection : this->remote_connections) {
             if (block == BLOCKING) {
-                auto result = this->send_one(remote_connection, message_data);
-                if (result != ConnectError::SUCCESS) {
-                    return result;
+                // every connection releases its use, the first failure is the one reported
+                lock_guard<mutex> write_guard(remote_connection->write_mutex);
+                ConnectError sent = send_retrying(remote_connection, message_data);
+                if (result == ConnectError::SUCCESS) {
+                    result = sent;
                 }
             }
             else {
@@ -787,16 +2124,77 @@ ConnectError Comm::send(MessageData * message_data, BlockType block) {
         }
     }
     else {
+        if (MessageData * ref = image_ref(message_data)) {
+            if (message_data->auto_delete) {
+                delete message_data;
+            }
+            message_data = ref;
+        }
         message_data->use_count = 1;
         if (block == BLOCKING) {
-            this->send_one(&this->local_connection, message_data);
+            lock_guard<mutex> guard(this->local_connection.write_mutex);
+            result = send_retrying(&this->local_connection, message_data);
         }
         else {
             this->local_connection.send(message_data);
         }
     }
     
-    return ConnectError::SUCCESS;
+    return result;
+}
+
+void Comm::fan_out(const list<Comm *> & targets, MessageData * message_data) {
+    if (targets.empty()) {
+        if (message_data->auto_delete) {
+            delete message_data;
+        }
+        return;
+    }
+    
+    // everything the send threads read is set before the first enqueue
+    bool any_refs = any_of(targets.begin(), targets.end(), [](Comm * comm) { return comm->image_refs; });
+    if (any_refs && message_data->message_type == MessageData::MessageType::IMAGE && message_data->payload_size() > 0) {
+        message_data->share_payload();
+        message_data->content_hash = content_hash(message_data->payload_data(), message_data->payload_size());
+    }
+    // once for all of them; then every target sends the trailer, the header says there is one
+    auto with_checksums = find_if(targets.begin(), targets.end(), [](Comm * comm) { return comm->checksums; });
+    if (with_checksums != targets.end()) {
+        (*with_checksums)->add_checksum(message_data);
+    }
+    message_data->header = message_data->serialize_header();
+    message_data->use_count = static_cast<int>(targets.size());
+    
+    auto now = SteadyClock::now();
+    for (Comm * comm : targets) {
+        if (message_data->message_type == MessageData::MessageType::IMAGE && comm->flow.window > 0) {
+            comm->flow.sent(message_data->image_name, now);
+        }
+        if (comm->is_server()) {
+            // a server broadcasts to its own connections, see Comm::send
+            cerr << "fan_out only supports client connections" << endl;
+            if (--message_data->use_count <= 0 && message_data->auto_delete) {
+                delete message_data;
+            }
+            continue;
+        }
+        if (MessageData * ref = comm->image_ref(message_data)) {
+            ref->use_count = 1;
+            comm->local_connection.send(ref);
+            release_sent(message_data);
+            continue;
+        }
+        comm->local_connection.send(message_data);
+    }
+}
+
+void Comm::fan_out_image(const list<Comm *> & targets, const string & image_name, const PayloadView & payload, int width, int height,
+                         MessageData::PixelFormat pixel_format) {
+    auto message_data = new MessageData(MessageData::MessageType::IMAGE, image_name, payload);
+    message_data->width = static_cast<uint16_t>(width);
+    message_data->height = static_cast<uint16_t>(height);
+    message_data->pixel_format = pixel_format;
+    fan_out(targets, message_data);
 }
 
 MessageData * Comm::next_received() {
@@ -812,13 +2210,59 @@ MessageData * Comm::next_received() {
 }
 
 void Comm::send_display_now(const string & image_name) {
+    // a preload that hasn't gone out yet mustn't arrive after its DISPLAY_NOW
+    if (!is_server() && !image_name.empty()) {
+        local_connection.promote(image_name);
+    }
     this->send(new MessageData(MessageData::MessageType::DISPLAY_NOW, image_name));
 }
 
+void Comm::send_preload(const string & image_name, const PayloadView & payload, int width, int height,
+                        MessageData::PixelFormat pixel_format) {
+    auto message_data = new MessageData(MessageData::MessageType::PRELOAD, image_name, payload);
+    message_data->width = static_cast<uint16_t>(width);
+    message_data->height = static_cast<uint16_t>(height);
+    message_data->pixel_format = pixel_format;
+    message_data->use_count = 1;
+    local_connection.send_background(message_data);
+    preload_sent_count += 1;
+}
+
+void Comm::set_preload_budget(size_t bytes) {
+    lock_guard<mutex> guard(preload.stage_mutex);
+    preload.budget_bytes = bytes;
+}
+
+void Comm::dump_preload(ofstream & out, const string & label) {
+    if (!is_server()) {
+        lock_guard<mutex> guard(local_connection.send_values_mutex);
+        out << label << " preloads sent: " << preload_sent_count << " queued: " << local_connection.background_values.size() << endl;
+        return;
+    }
+    preload.dump(out, label);
+}
+
 void Comm::send_image(const string & image_name, const string & image_data) {
+    if (flow.window > 0) {
+        flow.sent(image_name, SteadyClock::now());
+    }
     this->send(new MessageData(MessageData::MessageType::IMAGE, image_name, image_data));
 }
 
+void Comm::send_image(const string & image_name, const PayloadView & payload) {
+    if (flow.window > 0) {
+        flow.sent(image_name, SteadyClock::now());
+    }
+    this->send(new MessageData(MessageData::MessageType::IMAGE, image_name, payload));
+}
+
+void Comm::send_video(const string & image_name, const string & packet) {
+    if (flow.window > 0) {
+        flow.sent(image_name, SteadyClock::now());
+    }
+    this->send(new MessageData(MessageData::MessageType::VIDEO, image_name, packet));
+}
+
 void Comm::send_start_timer() {
     this->send(new MessageData(MessageData::MessageType::START_TIMER));
 }
@@ -827,6 +2271,257 @@ void Comm::send_ack(const string &image_name) {
     this->send(new MessageData(MessageData::MessageType::ACK, image_name));
 }
 
+void Comm::set_flow_control(int window, double fps) {
+    lock_guard<mutex> guard(flow.flow_mutex);
+    flow.window = window;
+    flow.min_interval = fps > 0 ? 1.0 / fps : 0;
+}
+
+bool Comm::ready_to_send() {
+    if (!is_server() && connect_result() != ConnectError::SUCCESS) {
+        // nothing to send on while the link is down
+        lock_guard<mutex> guard(flow.flow_mutex);
+        flow.skipped_count += 1;
+        return false;
+    }
+    return flow.can_send(SteadyClock::now());
+}
+
+void Comm::set_heartbeat(double interval, double timeout) {
+    this->heartbeat_interval = interval;
+    this->heartbeat_timeout = timeout;
+}
+
+void Comm::set_reconnect(bool enabled, ReconnectPolicy policy, double min_backoff, double max_backoff) {
+    this->reconnect_enabled = enabled;
+    this->reconnect_policy = policy;
+    this->min_backoff = min_backoff;
+    this->max_backoff = max(min_backoff, max_backoff);
+}
+
+long Comm::reconnects() {
+    lock_guard<mutex> guard(this->link_mutex);
+    return reconnect_count;
+}
+
+void Comm::set_image_refs(bool enabled) {
+    this->image_refs = enabled;
+}
+
+MessageData * Comm::image_ref(MessageData * message_data) {
+    if (!image_refs || is_server() || message_data->message_type != MessageData::MessageType::IMAGE || message_data->payload_size() == 0) {
+        return nullptr;
+    }
+    
+    ContentCache * cache;
+    {
+        lock_guard<mutex> guard(this->image_cache_mutex);
+        if (!image_cache) {
+            image_cache = new ContentCache(image_cache_bytes);
+        }
+        cache = image_cache;
+    }
+    
+    if (message_data->content_hash.empty()) {
+        message_data->content_hash = content_hash(message_data->payload_data(), message_data->payload_size());
+    }
+    // the same bytes sent as another image go whole again, the server keeps one image per hash
+    ImageView cached;
+    if (cache->get(message_data->content_hash, cached) && cached.width == message_data->width && cached.height == message_data->height &&
+        cached.pixel_format == message_data->pixel_format) {
+        ref_sent_count += 1;
+        bytes_saved += static_cast<long>(message_data->payload_size());
+        return new MessageData(MessageData::MessageType::IMAGE_REF, message_data->image_name, message_data->content_hash);
+    }
+    
+    // the server has it once this arrives; kept here in case it reports a miss anyway
+    cache->put(message_data->content_hash, ImageView(message_data));
+    full_sent_count += 1;
+    return nullptr;
+}
+
+bool Comm::resolve_image_ref(MessageData * message_data, Connection * remote_connection) {
+    if (message_data->message_type == MessageData::MessageType::IMAGE_REF) {
+        ContentCache * cache;
+        {
+            lock_guard<mutex> guard(this->image_cache_mutex);
+            cache = image_cache;
+        }
+        
+        string hash(message_data->payload_data(), message_data->payload_size());
+        ImageView cached;
+        if (cache && cache->get(hash, cached)) {
+            message_data->message_type = MessageData::MessageType::IMAGE;
+            cached.restore(message_data);
+            message_data->content_hash = hash;
+            return true;
+        }
+        
+        miss_reported_count += 1;
+        auto cache_miss = new MessageData(MessageData::MessageType::CACHE_MISS, message_data->image_name, hash);
+        if (remote_connection) {
+            // only the client that sent the ref can resend the image
+            cache_miss->use_count = 1;
+            remote_connection->send(cache_miss);
+        }
+        else {
+            send(cache_miss);
+        }
+        delete message_data;
+        return false;
+    }
+    
+    if (message_data->message_type == MessageData::MessageType::IMAGE && message_data->payload_size() > 0) {
+        ContentCache * cache;
+        {
+            lock_guard<mutex> guard(this->image_cache_mutex);
+            cache = image_cache;
+        }
+        if (cache) {
+            // the client's refs name what it sent, the cache keeps what prepare_image made of it
+            message_data->content_hash = content_hash(message_data->payload_data(), message_data->payload_size());
+        }
+        prepare_image(message_data);
+        if (cache) {
+            keep_payload(message_data);
+            cache->put(message_data->content_hash, ImageView(message_data));
+        }
+    }
+    return true;
+}
+
+void Comm::keep_payload(MessageData * message_data) {
+    if (transport == Transport::SHM && message_data->payload.data) {
+        // a copy, so the ring slot is handed back now instead of whenever the copy is dropped
+        auto owned = make_shared<string>(message_data->payload_data(), message_data->payload_size());
+        message_data->payload.owner = owned;
+        message_data->payload.data = owned->data();
+        message_data->payload.size = owned->size();
+    }
+}
+
+void Comm::resend_missed_image(MessageData * cache_miss) {
+    miss_reported_count += 1;
+    
+    ContentCache * cache;
+    {
+        lock_guard<mutex> guard(this->image_cache_mutex);
+        cache = image_cache;
+    }
+    string hash(cache_miss->payload_data(), cache_miss->payload_size());
+    ImageView image;
+    if (!cache || !cache->peek(hash, image)) {
+        resend_failed_count += 1;
+        cerr << "server is missing image '" << cache_miss->image_name << "' " << content_hash_hex(hash) << ", no longer here either" << endl;
+        return;
+    }
+    
+    auto message_data = new MessageData(MessageData::MessageType::IMAGE, cache_miss->image_name);
+    image.restore(message_data);
+    message_data->use_count = 1;
+    local_connection.send(message_data);
+    resent_count += 1;
+}
+
+void Comm::dump_image_refs(ofstream & out, const string & label) {
+    out << label << " refs_sent: " << ref_sent_count << " full_sent: " << full_sent_count << " bytes_saved: " << bytes_saved
+        << " misses: " << miss_reported_count << " resent: " << resent_count << " resend_failed: " << resend_failed_count << endl;
+    lock_guard<mutex> guard(this->image_cache_mutex);
+    if (image_cache) {
+        image_cache->dump(out, label + " cache");
+    }
+}
+
+void Comm::dump_link(ofstream & out, const string & label) {
+    lock_guard<mutex> guard(this->link_mutex);
+    out << label << " reconnects: " << reconnect_count << " heartbeat_timeouts: " << heartbeat_timeout_count
+        << " dropped_on_reconnect: " << dropped_on_reconnect << endl;
+    out << "blackout last: " << last_blackout << "s longest: " << longest_blackout << "s total: " << total_blackout << "s" << endl;
+    out << "chunked messages: " << chunked_count << " control messages between chunks: " << interleaved_count << endl;
+    out << "ingest frames: " << ingest_count << " abandoned: " << ingest_abandoned_count << endl;
+}
+
+void Comm::set_ingest(size_t row_bytes, size_t band_rows) {
+    // set before images arrive, the receive threads read these unlocked
+    ingest_row_bytes = row_bytes;
+    ingest_band_rows = max<size_t>(band_rows, 1);
+}
+
+shared_ptr<IngestFrame> Comm::next_ingest() {
+    lock_guard<mutex> guard(this->ingest_mutex);
+    if (ingest_frames.empty()) {
+        return nullptr;
+    }
+    
+    auto frame = ingest_frames.front();
+    ingest_frames.pop_front();
+    return frame;
+}
+
+size_t IngestFrame::rows() const {
+    return row_bytes > 0 ? payload.size / row_bytes : 0;
+}
+
+size_t IngestFrame::completed_rows() const {
+    return watermark.load(std::memory_order_acquire);
+}
+
+bool IngestFrame::complete() const {
+    return completed_rows() >= rows();
+}
+
+bool IngestFrame::abandoned() const {
+    return dropped;
+}
+
+bool IngestFrame::wait_rows(size_t row_count, double timeout) {
+    row_count = min(row_count, rows());
+    unique_lock<mutex> lock(this->ingest_mutex);
+    rows_arrived.wait_for(lock, Seconds(timeout), [this, row_count] {
+        return dropped || completed_rows() >= row_count;
+    });
+    return !dropped && completed_rows() >= row_count;
+}
+
+void IngestFrame::advance(size_t received_bytes) {
+    // the last row counts once every byte is in, a partial one included
+    size_t received_rows = rows();
+    if (received_bytes < payload.size) {
+        received_rows = min(received_bytes / row_bytes, rows() - 1);
+        // only whole bands, waking the readers for every recv would cost more than it saves
+        received_rows -= received_rows % band_rows;
+    }
+    if (received_rows <= watermark.load(std::memory_order_relaxed)) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(this->ingest_mutex);
+        watermark.store(received_rows, std::memory_order_release);
+    }
+    rows_arrived.notify_all();
+}
+
+void IngestFrame::abandon() {
+    {
+        lock_guard<mutex> guard(this->ingest_mutex);
+        dropped = true;
+    }
+    rows_arrived.notify_all();
+}
+
+void Comm::set_checksums(bool enabled) {
+    checksums = enabled;
+}
+
+void Comm::dump_checksums(ofstream & out, const string & label) {
+    out << label << " crc32c (" << crc32c_implementation() << ") added: " << crc_added_count << " checked: " << crc_checked_count
+        << " mismatched: " << crc_mismatch_count << endl;
+}
+
+FlowControl & Comm::flow_control() {
+    return flow;
+}
+
 void Comm::set_waiter(Waiter *waiter) {
     this->waiter = waiter;
 }
@@ -884,6 +2579,135 @@ void SD::dump(ofstream & out, const string & label) {
     out << endl;
 }
 
+bool FlowControl::can_send(const SteadyClock::time_point & now) {
+    lock_guard<mutex> guard(this->flow_mutex);
+    if (this->window <= 0) {
+        return true;
+    }
+    
+    // give up on frames the remote never acknowledged, otherwise the window stays shut
+    for (auto it = this->in_flight.begin(); it != this->in_flight.end();) {
+        Seconds age = now - it->second;
+        if (age.count() > this->stale_timeout) {
+            it = this->in_flight.erase(it);
+            this->expired_count += 1;
+        }
+        else {
+            ++it;
+        }
+    }
+    
+    if (static_cast<int>(this->in_flight.size()) >= this->window || now < this->next_send) {
+        this->skipped_count += 1;
+        return false;
+    }
+    
+    return true;
+}
+
+void FlowControl::sent(const string & image_name, const SteadyClock::time_point & now) {
+    lock_guard<mutex> guard(this->flow_mutex);
+    this->in_flight[image_name] = now;
+    this->sent_count += 1;
+    // half a nominal frame of slack, so the caller's own pacing jitter doesn't cause skips
+    Seconds wait(interval() - this->min_interval / 2);
+    this->next_send = now + std::chrono::duration_cast<SteadyClock::duration>(wait);
+}
+
+void FlowControl::acked(const string & image_name, const SteadyClock::time_point & now) {
+    lock_guard<mutex> guard(this->flow_mutex);
+    auto it = this->in_flight.find(image_name);
+    if (it == this->in_flight.end()) {
+        // late ack for an expired frame, or one not sent under flow control
+        this->unknown_ack_count += 1;
+        return;
+    }
+    
+    double rtt = this->rtt_sd.increment(now, it->second);
+    this->in_flight.erase(it);
+    this->acked_count += 1;
+    // same smoothing as TCP's srtt (rfc 6298)
+    this->srtt = (this->acked_count == 1) ? rtt : (0.875 * this->srtt + 0.125 * rtt);
+}
+
+void FlowControl::reset() {
+    lock_guard<mutex> guard(this->flow_mutex);
+    this->expired_count += static_cast<long>(this->in_flight.size());
+    this->in_flight.clear();
+    this->next_send = SteadyClock::time_point();
+}
+
+void FlowControl::requeued(const string & image_name, const SteadyClock::time_point & now) {
+    lock_guard<mutex> guard(this->flow_mutex);
+    if (this->window > 0) {
+        this->in_flight[image_name] = now;
+    }
+}
+
+double FlowControl::interval() const {
+    // with 'window' frames in flight per round trip the receiver is kept busy without queueing
+    double paced = (this->window > 0) ? this->srtt / this->window : 0;
+    return max(this->min_interval, paced);
+}
+
+void FlowControl::dump(ofstream & out, const string & label) {
+    {
+        lock_guard<mutex> guard(this->flow_mutex);
+        out << label << " window: " << this->window << " in_flight: " << this->in_flight.size() << endl;
+        out << "sent: " << this->sent_count << " acked: " << this->acked_count << " skipped: " << this->skipped_count
+            << " expired: " << this->expired_count << " unknown_ack: " << this->unknown_ack_count << endl;
+        out << "srtt: " << this->srtt << "s interval: " << interval() << "s" << endl;
+    }
+    this->rtt_sd.dump(out, label + " rtt");
+}
+
+void PreloadStage::stage(const string & image_name, const ImageView & image) {
+    lock_guard<mutex> guard(this->stage_mutex);
+    auto it = this->images.find(image_name);
+    if (it != this->images.end()) {
+        // sent again, the newer copy wins
+        this->size_bytes -= it->second.payload.size;
+        this->order.erase(find(this->order.begin(), this->order.end(), image_name));
+        this->images.erase(it);
+    }
+    
+    this->images[image_name] = image;
+    this->order.push_back(image_name);
+    this->size_bytes += image.payload.size;
+    this->staged_count += 1;
+    
+    while (this->size_bytes > this->budget_bytes && !this->order.empty()) {
+        auto oldest = this->images.find(this->order.front());
+        this->size_bytes -= oldest->second.payload.size;
+        this->images.erase(oldest);
+        this->order.pop_front();
+        this->evicted_count += 1;
+    }
+}
+
+bool PreloadStage::take(const string & image_name, ImageView & image) {
+    lock_guard<mutex> guard(this->stage_mutex);
+    auto it = this->images.find(image_name);
+    if (it == this->images.end()) {
+        this->miss_count += 1;
+        return false;
+    }
+    
+    image = it->second;
+    this->size_bytes -= it->second.payload.size;
+    this->order.erase(find(this->order.begin(), this->order.end(), image_name));
+    this->images.erase(it);
+    this->hit_count += 1;
+    return true;
+}
+
+void PreloadStage::dump(ofstream & out, const string & label) {
+    lock_guard<mutex> guard(this->stage_mutex);
+    out << label << " staged: " << this->images.size() << " bytes: " << this->size_bytes << "/" << this->budget_bytes << endl;
+    out << "preloads: " << this->staged_count << " shown: " << this->hit_count << " not_staged: " << this->miss_count
+        << " evicted: " << this->evicted_count << endl;
+}
+
 void Display::queue_image_for_display(MessageData * message_data) {
     lock_guard<mutex> guard(this->queues_mutex);
     pending_images[message_data->image_name] = message_data;
@@ -913,6 +2737,7 @@ void Display::set_display_function(DisplayFunction display_function) {
 }
 
 void Display::execute_display() {
+    ThreadConfig::enter(DISPLAY_THREAD);
     this->fwrite_sd.last = SteadyClock::now();
     while (keep_going) {
         MessageData * to_display = nullptr;
@@ -946,6 +2771,6 @@ void Display::execute_display() {
             delete to_display;
         }
         
-        this_thread::sleep_for(std::chrono::microseconds(1));
+        ThreadConfig::sleep_for(std::chrono::microseconds(1));
     }
 }
@@ -24,6 +24,8 @@ typedef int SOCKET;
 #include <chrono>
 #include <map>
 #include <atomic>
+#include <memory>
+#include <cstdint>
 
 using namespace std;
 
@@ -47,6 +49,10 @@ enum ConnectError {
     CONNECTION_FAILURE,
     CREATE_SOCKET_FAILURE,
     SEND_TIMEOUT,
+    // nothing heard from the peer within the heartbeat timeout
+    HEARTBEAT_TIMEOUT,
+    // client lost the link and is trying to get it back
+    RECONNECTING,
 };
 
 enum MessageState {
@@ -56,31 +62,160 @@ enum MessageState {
     ONGOING
 };
 
+// read-only bytes owned elsewhere (a mapped file, a buffer shared between messages);
+// the owner keeps them alive for as long as any view is held
+struct PayloadView {
+    shared_ptr<const void> owner;
+    const char * data = nullptr;
+    size_t size = 0;
+    
+    bool empty() const { return size == 0; }
+};
+
 struct MessageData {
     static const int header_size;
+    // or'ed into the type byte on the wire: a 4 byte CRC32C of the payload follows it,
+    // counted in the header's image length
+    static const unsigned char crc_flag;
+    // or'ed into the type byte on the wire: the image's geometry (width and height, 2 bytes each,
+    // then the pixel format, 1 byte) follows the payload, ahead of any crc, also counted in the image length
+    static const unsigned char geometry_flag;
+    static const size_t geometry_size;
     
     enum MessageType {
         NONE,
         DISPLAY_NOW,
         IMAGE,
         START_TIMER,
-        ACK
+        ACK,
+        // wire only: an IMAGE whose payload travels as a memfd over a unix socket,
+        // it is delivered to the caller as a plain IMAGE
+        IMAGE_FD,
+        // server -> client: multicast fragments to resend, see multicast.h
+        NACK,
+        // either way when nothing else was sent for a while, never handed to the caller
+        HEARTBEAT,
+        // client -> server: an image the server has seen before, the payload is its 16 byte
+        // content_hash; delivered to the caller as a plain IMAGE
+        IMAGE_REF,
+        // server -> client: the IMAGE_REF wasn't in the cache, send the whole image
+        CACHE_MISS,
+        // client -> server: an image to stage until a DISPLAY_NOW names it; sent at low priority
+        PRELOAD,
+        // wire only: a slice of a bigger message, so control messages can go out in between;
+        // the payload starts with the whole message's size and this slice's offset (4 bytes each)
+        CHUNK,
+        // client -> server: one frame of an encoded stream, see video_codec.h; acked like an IMAGE
+        VIDEO
+    };
+    
+    // how an image's pixels are laid out, rows back to back without padding
+    enum PixelFormat {
+        GRAY8,
+        // little endian 16 bit samples, only the low 10 bits used
+        GRAY10,
+        GRAY16,
+        // 3 bytes per pixel, blue first, as OpenCV keeps them
+        BGR8,
+        PIXEL_FORMAT_COUNT
     };
     
     MessageType message_type;
     string image_name;
     string image_data;
+    // when set, sent instead of image_data without copying it
+    PayloadView payload;
+    // serialized once up front when the same message is queued on several connections
+    string header;
+    // computed once when image refs are on, see content_cache.h
+    string content_hash;
+    // sent as a trailer, or as received (the payload no longer includes it)
+    bool has_crc = false;
+    uint32_t crc = 0;
+    // the image's size in pixels when the sender gave it, 0 = not given
+    uint16_t width = 0;
+    uint16_t height = 0;
+    // sent with the geometry; without one an image is taken to be GRAY8
+    PixelFormat pixel_format = GRAY8;
     std::atomic<int> use_count;
     bool auto_delete = true;
     
     MessageData(MessageType message_type);
     MessageData(MessageType message_type, const string & image_name);
     MessageData(MessageType message_type, const string & image_name, const string & image_data);
+    MessageData(MessageType message_type, const string & image_name, const PayloadView & payload);
     MessageData(MessageType message_type, int name_length, long image_length, string & buffer);
+    const char * payload_data() const;
+    size_t payload_size() const;
+    // turns image_data into a view other owners can hold on to (moved, not copied)
+    const PayloadView & share_payload();
     string serialize_header() const;
+    // computes crc over the payload, before the header is serialized
+    void add_crc();
+    bool crc_matches() const;
+    bool has_geometry() const { return width > 0 && height > 0; }
+    void append_geometry(string & buffer) const;
+    // geometry_size bytes as append_geometry wrote them
+    void read_geometry(const char * geometry);
+    static size_t bytes_per_pixel(PixelFormat pixel_format);
+    // what follows the payload: the geometry, then the crc; empty without either
+    string trailer() const;
+    // receive side: moves the trailer the type byte's flags announce off the end of the payload
+    void take_trailer(unsigned char type_byte);
+    // the type byte without its flags
+    static MessageType type_of(unsigned char type_byte);
     static MessageData * deserialize(string & buffer, MessageState message_state);
+    // a message that is already complete in memory; the payload stays a view into it
+    static MessageData * from_view(const PayloadView & message);
+};
+
+// an image held apart from the message it came in (cached, staged), with what it takes to show it
+struct ImageView {
+    PayloadView payload;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    MessageData::PixelFormat pixel_format = MessageData::GRAY8;
+    
+    ImageView() {}
+    // shares message_data's payload (see share_payload) and takes its geometry
+    explicit ImageView(MessageData * message_data);
+    // message_data's payload and geometry become this image's
+    void restore(MessageData * message_data) const;
+};
+
+// an IMAGE while it is still arriving, see Comm::set_ingest: the payload fills front to back,
+// and rows below completed_rows() are final and can be read while the rest is on the wire
+struct IngestFrame {
+    string image_name;
+    // sized for the whole image up front
+    PayloadView payload;
+    size_t row_bytes = 0;
+    // the watermark moves a band at a time
+    size_t band_rows = 64;
+    
+    size_t rows() const;
+    size_t completed_rows() const;
+    bool complete() const;
+    bool abandoned() const;
+    // false if the rows didn't arrive in time or never will
+    bool wait_rows(size_t row_count, double timeout);
+    
+    // receive thread only
+    void advance(size_t received_bytes);
+    void abandon();
+    
+private:
+    atomic<size_t> watermark{0};
+    atomic<bool> dropped{false};
+    mutex ingest_mutex;
+    condition_variable rows_arrived;
 };
 
+class ShmRing;  // shm_ring.h
+class ContentCache;  // content_cache.h
+class MessageTrace;  // message_trace.h
+class MulticastSender;  // multicast.h
+
 struct Connection {
     SOCKET sock_fd = 0;
     bool keep_going_flag = true;
@@ -91,11 +226,108 @@ struct Connection {
     mutex send_values_mutex;
     // keeps the list of pending key/values to send
     deque<MessageData *> send_values;
+    // high priority (everything but images), sent ahead of send_values and between the chunks of a big message
+    deque<MessageData *> control_values;
+    // the image the send thread is working on, a control message naming it has to wait for it
+    string sending_name;
+    // low priority (PRELOAD), only sent while send_values is empty
+    deque<MessageData *> background_values;
     string received_so_far;
+    // set instead of sock_fd for shm:// connections
+    ShmRing * send_ring = nullptr;
+    ShmRing * receive_ring = nullptr;
+    // file descriptors passed with SCM_RIGHTS on unix:// connections, in arrival order
+    deque<int> received_fds;
+    // a big message put together in place, from CHUNKs or read straight off the socket
+    shared_ptr<char> assembly;
+    size_t assembly_size = 0;
+    size_t assembled = 0;
+    // bytes of the current message still to be read straight into assembly
+    size_t direct_remaining = 0;
+    // the assembly's IMAGE as handed out by Comm::next_ingest
+    shared_ptr<IngestFrame> ingest;
+    // for heartbeats, each only touched by its own thread
+    SteadyClock::time_point last_sent;
+    SteadyClock::time_point last_received;
+    // client with reconnect on: the newest image handed to the socket, held for a resend
+    MessageData * last_image = nullptr;
+    // one writer at a time: the send thread, and callers sending BLOCKING
+    mutex write_mutex;
 
+    ~Connection();
     void stop();
     MessageData* next_send();
+    MessageData* next_control();
     void send(MessageData * message_data);
+    void send_background(MessageData * message_data);
+    // moves a queued background message for image_name to the end of send_values
+    bool promote(const string & image_name);
+};
+
+struct SD {
+    static const long warm_up = 300;
+    
+    long count = 0;
+    SteadyClock::time_point last;
+    double mean = 0;
+    double sum_squares = 0;
+    mutex sd_mutex;
+    deque<double> sd_q;
+    
+    double increment(const SteadyClock::time_point & current);
+    double increment(const SteadyClock::time_point & current, const SteadyClock::time_point & previous);
+    double increment(const Seconds & seconds);
+    void dump(ofstream & out, const string & label);
+};
+
+// windowed flow control for one connection: at most 'window' IMAGE messages
+// may be waiting for an ACK, and the send interval stretches with the
+// measured round trip so a slow receiver doesn't build up a queue
+struct FlowControl {
+    int window = 0;  // 0 = unlimited, no flow control
+    double min_interval = 0;  // seconds, the fastest the caller wants to send
+    double stale_timeout = 2.0;  // seconds before an unacked frame is given up on
+    
+    mutex flow_mutex;
+    map<string, SteadyClock::time_point> in_flight;
+    SteadyClock::time_point next_send;
+    double srtt = 0;  // smoothed round trip time in seconds
+    long sent_count = 0;
+    long acked_count = 0;
+    long skipped_count = 0;
+    long expired_count = 0;
+    long unknown_ack_count = 0;
+    SD rtt_sd;
+    
+    bool can_send(const SteadyClock::time_point & now);
+    void sent(const string & image_name, const SteadyClock::time_point & now);
+    void acked(const string & image_name, const SteadyClock::time_point & now);
+    // the connection went away with these in flight, none of them will be acked
+    void reset();
+    // in flight again after a reconnect, without counting as another send
+    void requeued(const string & image_name, const SteadyClock::time_point & now);
+    double interval() const;
+    void dump(ofstream & out, const string & label);
+};
+
+// server side: images sent ahead with PRELOAD, held until a DISPLAY_NOW names them;
+// the oldest are dropped once they take more than budget_bytes
+struct PreloadStage {
+    size_t budget_bytes = 64 << 20;  // 0 = don't stage, PRELOADs go to the caller
+    
+    mutex stage_mutex;
+    deque<string> order;  // oldest first
+    map<string, ImageView> images;
+    size_t size_bytes = 0;
+    long staged_count = 0;
+    long hit_count = 0;
+    long miss_count = 0;
+    long evicted_count = 0;
+    
+    void stage(const string & image_name, const ImageView & image);
+    // removes it from the stage
+    bool take(const string & image_name, ImageView & image);
+    void dump(ofstream & out, const string & label);
 };
 
 struct Waiter {
@@ -134,6 +366,22 @@ public:
         NON_BLOCKING
     };
     
+    // picked by the address: "shm://name" is a shared memory ring between
+    // processes on the same host, "unix:///path" a unix domain socket,
+    // anything else is an ip address for TCP
+    enum Transport {
+        TCP,
+        SHM,
+        UNIX
+    };
+    
+    // what happens to the send queue when a client reconnects
+    enum ReconnectPolicy {
+        KEEP_QUEUE,  // send everything that was queued during the outage
+        KEEP_LATEST,  // only the newest queued image; if none, resend the last one sent
+        DROP_QUEUE
+    };
+    
     // returns false if instance is already connected or connecting
     bool connect(Role role, const string & ip_address, const string & port);
     void set_waiter(Waiter * waiter);
@@ -142,22 +390,99 @@ public:
     MessageData * next_received();
     void disconnect();
     ConnectError send(MessageData * message_data, BlockType block=NON_BLOCKING);
+    // a staged (PRELOAD) image is sent ahead of it if it's still queued
     void send_display_now(const string & image_name = "");
     void send_image(const string & image_name, const string & image_data);
+    // the payload goes to the socket straight from the view, it is not copied
+    void send_image(const string & image_name, const PayloadView & payload);
+    // a frame encoded by a VideoEncoder; flow control counts it like an image
+    void send_video(const string & image_name, const string & packet);
     void send_start_timer();
     void send_ack(const string & image_name);
+    // client side: queued behind everything else; the server stages it and a DISPLAY_NOW
+    // with the same name is then handed to the caller with the image as its payload
+    void send_preload(const string & image_name, const PayloadView & payload, int width = 0, int height = 0,
+                      MessageData::PixelFormat pixel_format = MessageData::GRAY8);
+    // server side: memory for staged images, see PreloadStage
+    void set_preload_budget(size_t bytes);
+    void dump_preload(ofstream & out, const string & label);
+    
+    // server side, tcp:// (unix:// memfd images and shm:// arrive whole): IMAGEs of at least one row are
+    // also handed out by next_ingest as soon as their header is in, and fill in while they arrive (row_bytes 0 = off)
+    void set_ingest(size_t row_bytes, size_t band_rows = 64);
+    shared_ptr<IngestFrame> next_ingest();
+    
+    // client side: IMAGE and PRELOAD payloads go out with a CRC32C trailer, computed on the send
+    // thread (unix:// memfd images excepted, nothing can touch them on the way); a server checks
+    // every trailer it gets and drops the images that fail
+    void set_checksums(bool enabled);
+    void dump_checksums(ofstream & out, const string & label);
+    
+    // window = max unacked images (0 turns flow control off), fps = the nominal send rate
+    void set_flow_control(int window, double fps);
+    // client side: true if another image may be sent now; otherwise the frame is counted as skipped
+    bool ready_to_send();
+    FlowControl & flow_control();
+    // interval = seconds of quiet before a HEARTBEAT is sent, timeout = seconds without hearing
+    // from the peer before the connection is dropped; 0 turns either off
+    void set_heartbeat(double interval, double timeout);
+    // client side (tcp and unix://): after the link drops, reconnect with exponential backoff
+    void set_reconnect(bool enabled, ReconnectPolicy policy = KEEP_LATEST, double min_backoff = 0.1, double max_backoff = 5.0);
+    // client side: how often the link has come back, e.g. to restart a stream that depends on what came before
+    long reconnects();
+    void dump_link(ofstream & out, const string & label);
+    // client side: images the server should already have go as an IMAGE_REF of a few bytes,
+    // the whole image is only sent again if the server reports a CACHE_MISS
+    void set_image_refs(bool enabled);
+    void dump_image_refs(ofstream & out, const string & label);
+    // server side: every message received from here on (heartbeats aside) also goes to trace, as it
+    // arrived; an IMAGE_REF as the IMAGE it resolved to, one that missed isn't traced (the client
+    // sends the image again). nullptr stops. Traced shm:// payloads are copied out of their ring slot
+    void set_trace(MessageTrace * trace);
+    // client side: NACKs from the server go to sender->repair() on the receive thread as they
+    // arrive, instead of to next_received(). nullptr stops
+    void set_multicast_sender(MulticastSender * sender);
+    // hands over a message that arrived some other way (e.g. multicast) as if this Comm had received it
+    void receive_external(MessageData * message_data);
+    // a received message held past the next few (a cache, a stage, an image still showing) must not
+    // pin one of the few shm ring slots: its payload is copied out of the slot, on other transports
+    // it is left where it is
+    void keep_payload(MessageData * message_data);
     const string & ip() const;
     const string & port() const;
     
+    // queues one message on every target; the header is serialized once and the
+    // payload is shared, the last connection to send it deletes message_data
+    static void fan_out(const list<Comm *> & targets, MessageData * message_data);
+    // width and height, when given, go along with the pixel format so a server can scale the image to its display
+    static void fan_out_image(const list<Comm *> & targets, const string & image_name, const PayloadView & payload, int width = 0, int height = 0,
+                              MessageData::PixelFormat pixel_format = MessageData::GRAY8);
+    
     static Comm * start_server(Waiter * waiter, int argc, char* argv[], CommFactory = nullptr);
     static list<Comm *> start_clients(Waiter * waiter, int argc, char* argv[], CommFactory = nullptr);
     static const string default_port;
+    // per-message send/receive logging, turn off when measuring throughput
+    static bool log_messages;
+    // shared memory rings, set before the server connects; the client uses what the server created
+    static uint32_t shm_slot_count;
+    static size_t shm_slot_size;
+    // on unix:// connections, images at least this big are passed as a sealed memfd
+    static size_t memfd_min_size;
+    // the server's cache for IMAGE_REF (0 = none), and the client's idea of what's in it
+    static size_t image_cache_bytes;
+    // on tcp:// and unix:// connections, messages bigger than this go out as CHUNKs (0 = whole)
+    static size_t chunk_size;
+    // a peer announcing a bigger message than this is disconnected before anything is allocated for it
+    static size_t max_message_size;
 
 protected:
     // only for SERVER roles
     virtual bool allow_new_connection(const sockaddr_storage & sin_addr, socklen_t sin_size);
     // only for SERVER roles
     virtual void got_new_connection(const  sockaddr_storage& sin_addr, socklen_t sin_size);
+    // only for SERVER roles: every IMAGE and PRELOAD, on the thread that received it, before it is
+    // cached, staged or handed out; e.g. to scale it to the display off the render loop
+    virtual void prepare_image(MessageData * message_data);
 
 private:
     void execute_connect(Role pending_role, const string & ip_address, const string & port);
@@ -167,12 +492,47 @@ private:
     void sendAndReceive(Connection * remote_connection);
     // returns false if failed; if true sock_fd = new socket
     bool create_socket(const string & ip_address, const string & port, SOCKET & sock_fd);
+    bool create_unix_socket(const string & address, SOCKET & sock_fd);
     bool is_server() const;
     void close_all();
     void close_one(Connection* remote_connection);
     void add_connection(Connection * remote_connection);
     RemoteConnectionResult init_remote_connection(Connection* remote_connection, SOCKET candidate_fd);
+    // releases message_data (see use_count) unless it returns SEND_TIMEOUT, then it is still the caller's
     ConnectError send_one(Connection * remote_connection, MessageData * message_data);
+    void execute_shm_connect(const string & address);
+    ConnectError send_one_shm(Connection * remote_connection, MessageData * message_data);
+    void execute_shm_receive(Connection * remote_connection);
+    void remove_connection(Connection * remote_connection);
+    // remote_connection is the one it arrived on, nullptr when it came some other way (receive_external)
+    void deliver_received(MessageData * message_data, Connection * remote_connection = nullptr);
+    ConnectError send_one_fd(Connection * remote_connection, MessageData * message_data, const string & header, int memfd);
+    ConnectError send_chunked(Connection * remote_connection, MessageData * message_data, const string & header);
+    // send_one until it doesn't time out, or retries times; always releases message_data.
+    // The caller holds the connection's write_mutex
+    ConnectError send_retrying(Connection * remote_connection, MessageData * message_data, int retries = 100);
+    // returns the whole message once its last CHUNK is in, and takes ownership of chunk
+    MessageData * dechunk(Connection * remote_connection, MessageData * chunk);
+    void begin_assembly(Connection * remote_connection, size_t size);
+    void drop_assembly(Connection * remote_connection);
+    // count more bytes landed in the assembly; the whole message once it's all there
+    MessageData * assembled(Connection * remote_connection, size_t count);
+    // a big message at the front of received_so_far carries on straight into an assembly
+    void begin_direct(Connection * remote_connection);
+    long receive_with_fds(Connection * remote_connection, char * buffer, size_t buffer_size);
+    MessageData * next_message(Connection * remote_connection);
+    void execute_client(const string & ip_address, const string & port);
+    void connection_lost(Connection * remote_connection, ConnectError connect_error);
+    bool heartbeat_expired(Connection * remote_connection) const;
+    void apply_reconnect_policy();
+    // client side: an IMAGE_REF to send instead of message_data, or nullptr to send it whole
+    MessageData * image_ref(MessageData * message_data);
+    // server side: fills in IMAGE_REFs and caches images; false if message_data was consumed,
+    // a miss is reported back on remote_connection
+    bool resolve_image_ref(MessageData * message_data, Connection * remote_connection);
+    void resend_missed_image(MessageData * cache_miss);
+    // client side: the CRC32C trailer, when checksums are on and the header isn't out yet
+    void add_checksum(MessageData * message_data);
 
 private:
     string ip_address;
@@ -183,10 +543,58 @@ private:
     mutex received_values_mutex;
     mutex remote_connections_mutex;
     Role role = Comm::Role::CLIENT;
+    Transport transport = Transport::TCP;
     Connection local_connection;
     Waiter * waiter = nullptr;
+    FlowControl flow;
     MessageState message_state = MessageState::WAITING;
     SteadyClock::time_point receive_begin;
+    double heartbeat_interval = 1.0;
+    double heartbeat_timeout = 3.0;
+    bool reconnect_enabled = true;
+    ReconnectPolicy reconnect_policy = ReconnectPolicy::KEEP_LATEST;
+    double min_backoff = 0.1;
+    double max_backoff = 5.0;
+    atomic<bool> disconnecting{false};
+    
+    mutex link_mutex;
+    long reconnect_count = 0;
+    long heartbeat_timeout_count = 0;
+    long dropped_on_reconnect = 0;
+    double last_blackout = 0;
+    double longest_blackout = 0;
+    double total_blackout = 0;
+    atomic<long> chunked_count{0};
+    atomic<long> interleaved_count{0};
+    
+    size_t ingest_row_bytes = 0;
+    size_t ingest_band_rows = 64;
+    mutex ingest_mutex;
+    deque<shared_ptr<IngestFrame>> ingest_frames;
+    atomic<long> ingest_count{0};
+    atomic<long> ingest_abandoned_count{0};
+    
+    bool image_refs = false;
+    // a client creates it on first use, a server when it connects (unless image_cache_bytes is 0)
+    ContentCache * image_cache = nullptr;
+    mutex image_cache_mutex;
+    atomic<long> ref_sent_count{0};
+    atomic<long> full_sent_count{0};
+    atomic<long> bytes_saved{0};
+    atomic<long> miss_reported_count{0};
+    atomic<long> resent_count{0};
+    atomic<long> resend_failed_count{0};
+    
+    PreloadStage preload;
+    atomic<long> preload_sent_count{0};
+    
+    bool checksums = false;
+    atomic<long> crc_added_count{0};
+    atomic<long> crc_checked_count{0};
+    atomic<long> crc_mismatch_count{0};
+    
+    atomic<MessageTrace *> trace{nullptr};
+    atomic<MulticastSender *> multicast_sender{nullptr};
 
     // keeps the list of incoming values
     deque<MessageData *> received_values;
@@ -195,22 +603,6 @@ private:
     list<Connection*> deleted_remote_connections;
 };
 
-struct SD {
-    static const long warm_up = 300;
-    
-    long count = 0;
-    SteadyClock::time_point last;
-    double mean = 0;
-    double sum_squares = 0;
-    mutex sd_mutex;
-    deque<double> sd_q;
-    
-    double increment(const SteadyClock::time_point & current);
-    double increment(const SteadyClock::time_point & current, const SteadyClock::time_point & previous);
-    double increment(const Seconds & seconds);
-    void dump(ofstream & out, const string & label);
-};
-
 typedef void (*DisplayFunction)(const string & image_data);
 
 struct Display {
@@ -0,0 +1,159 @@
+#include <string.h>
+
+#include "content_cache.h"
+
+using namespace std;
+
+static inline uint64_t rotl64(uint64_t x, int8_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3_x64_128, after Austin Appleby's public domain reference
+string content_hash(const char * data, size_t size) {
+    const uint8_t * bytes = reinterpret_cast<const uint8_t *>(data);
+    const size_t block_count = size / 16;
+    
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    
+    for (size_t i = 0; i < block_count; i++) {
+        uint64_t k1;
+        uint64_t k2;
+        // memcpy, the payload may not be 8 byte aligned
+        memcpy(&k1, bytes + i * 16, sizeof(k1));
+        memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+        
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    
+    const uint8_t * tail = bytes + block_count * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch (size & 15) {
+        case 15: k2 ^= uint64_t(tail[14]) << 48; // fallthrough
+        case 14: k2 ^= uint64_t(tail[13]) << 40; // fallthrough
+        case 13: k2 ^= uint64_t(tail[12]) << 32; // fallthrough
+        case 12: k2 ^= uint64_t(tail[11]) << 24; // fallthrough
+        case 11: k2 ^= uint64_t(tail[10]) << 16; // fallthrough
+        case 10: k2 ^= uint64_t(tail[9]) << 8; // fallthrough
+        case 9: k2 ^= uint64_t(tail[8]);
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            // fallthrough
+        case 8: k1 ^= uint64_t(tail[7]) << 56; // fallthrough
+        case 7: k1 ^= uint64_t(tail[6]) << 48; // fallthrough
+        case 6: k1 ^= uint64_t(tail[5]) << 40; // fallthrough
+        case 5: k1 ^= uint64_t(tail[4]) << 32; // fallthrough
+        case 4: k1 ^= uint64_t(tail[3]) << 24; // fallthrough
+        case 3: k1 ^= uint64_t(tail[2]) << 16; // fallthrough
+        case 2: k1 ^= uint64_t(tail[1]) << 8; // fallthrough
+        case 1: k1 ^= uint64_t(tail[0]);
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    
+    string hash(16, '\0');
+    memcpy(&hash[0], &h1, sizeof(h1));
+    memcpy(&hash[8], &h2, sizeof(h2));
+    return hash;
+}
+
+string content_hash_hex(const string & hash) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned char c : hash) {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 15]);
+    }
+    return hex;
+}
+
+ContentCache::ContentCache(size_t capacity_bytes) : capacity_bytes(capacity_bytes) {
+}
+
+bool ContentCache::get(const string & hash, ImageView & image) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    auto it = this->entries.find(hash);
+    if (it == this->entries.end()) {
+        this->miss_count += 1;
+        return false;
+    }
+    
+    this->hit_count += 1;
+    this->recency.splice(this->recency.begin(), this->recency, it->second.position);
+    image = it->second.image;
+    return true;
+}
+
+bool ContentCache::peek(const string & hash, ImageView & image) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    auto it = this->entries.find(hash);
+    if (it == this->entries.end()) {
+        return false;
+    }
+    image = it->second.image;
+    return true;
+}
+
+void ContentCache::put(const string & hash, const ImageView & image) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    auto it = this->entries.find(hash);
+    if (it != this->entries.end()) {
+        const ImageView & cached = it->second.image;
+        if (cached.width == image.width && cached.height == image.height && cached.pixel_format == image.pixel_format) {
+            // same content again, it's just more recent now
+            this->recency.splice(this->recency.begin(), this->recency, it->second.position);
+            return;
+        }
+        // the same bytes read as another image, the newer one wins
+        this->size_bytes -= cached.payload.size;
+        this->recency.erase(it->second.position);
+        this->entries.erase(it);
+    }
+    if (image.payload.size > this->capacity_bytes) {
+        return;
+    }
+    
+    this->recency.push_front(hash);
+    Entry & entry = this->entries[hash];
+    entry.image = image;
+    entry.position = this->recency.begin();
+    this->size_bytes += image.payload.size;
+    this->put_count += 1;
+    
+    while (this->size_bytes > this->capacity_bytes) {
+        auto oldest = this->entries.find(this->recency.back());
+        this->size_bytes -= oldest->second.image.payload.size;
+        this->entries.erase(oldest);
+        this->recency.pop_back();
+        this->evict_count += 1;
+    }
+}
+
+void ContentCache::dump(ofstream & out, const string & label) {
+    lock_guard<mutex> guard(this->cache_mutex);
+    out << label << " entries: " << this->entries.size() << " bytes: " << this->size_bytes << "/" << this->capacity_bytes << endl;
+    out << "hits: " << this->hit_count << " misses: " << this->miss_count << " stored: " << this->put_count
+        << " evicted: " << this->evict_count << endl;
+}
@@ -0,0 +1,52 @@
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <fstream>
+
+#include "comms.h"
+
+// MurmurHash3_x64_128 of the bytes, as 16 raw bytes.
+// Not cryptographic: it identifies repeated frames, it doesn't authenticate them.
+string content_hash(const char * data, size_t size);
+// 32 hex digits, for logs
+string content_hash_hex(const string & hash);
+
+// Images keyed by content_hash, least recently used dropped first once
+// their total size passes the capacity. Entries are views, so a cached
+// frame shares its bytes with any message that still holds it; each keeps
+// the geometry and pixel format it was stored with.
+class ContentCache {
+public:
+    explicit ContentCache(size_t capacity_bytes);
+    
+    // counts a hit or a miss; a hit becomes the most recently used
+    bool get(const string & hash, ImageView & image);
+    // same, but without touching the counters
+    bool peek(const string & hash, ImageView & image);
+    void put(const string & hash, const ImageView & image);
+    void dump(ofstream & out, const string & label);
+
+private:
+    struct Entry {
+        ImageView image;
+        list<string>::iterator position;
+    };
+    
+    size_t capacity_bytes;
+    size_t size_bytes = 0;
+    mutex cache_mutex;
+    // most recently used first
+    list<string> recency;
+    unordered_map<string, Entry> entries;
+    
+    long hit_count = 0;
+    long miss_count = 0;
+    long put_count = 0;
+    long evict_count = 0;
+};
+
+#endif // CONTENT_CACHE_H
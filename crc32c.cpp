@@ -0,0 +1,211 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM
+#endif
+
+// reflected Castagnoli polynomial
+static const uint32_t polynomial = 0x82f63b78;
+
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const unsigned char * bytes, size_t size);
+
+// slicing by 8: eight bytes per step through eight tables, about 4x a plain byte table
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+// a * b modulo the polynomial, both reflected (after zlib's crc32_combine)
+static uint32_t multiply_mod(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    while (m != 0) {
+        if (a & m) {
+            product ^= b;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * size) modulo the polynomial: running a CRC over size zero bytes multiplies it by this
+static uint32_t zeros_operator(size_t size) {
+    uint32_t power = 1u << 30;  // x^1
+    uint32_t result = 1u << 31;  // x^0
+    for (size_t n = size * 8; n != 0; n >>= 1) {
+        if (n & 1) {
+            result = multiply_mod(power, result);
+        }
+        power = multiply_mod(power, power);
+    }
+    return result;
+}
+
+// the hardware CRC takes 3 cycles but can start one every cycle, so three streams of
+// stream_bytes each run side by side and are stitched together afterwards
+static const size_t stream_bytes = 8192;
+
+struct Crc32cShifts {
+    uint32_t one = zeros_operator(stream_bytes);
+    uint32_t two = zeros_operator(2 * stream_bytes);
+};
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char * bytes, size_t size) {
+    static const Crc32cTables tables;
+    const auto & table = tables.table;
+
+    while (size >= 8) {
+        // little endian, like every machine this runs on
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = table[0][(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char * bytes, size_t size) {
+#ifdef __x86_64__
+    static const Crc32cShifts shifts;
+    while (size >= 3 * stream_bytes) {
+        uint64_t a = crc;
+        uint64_t b = 0;
+        uint64_t c = 0;
+        for (size_t i = 0; i < stream_bytes; i += 8) {
+            uint64_t word_a;
+            uint64_t word_b;
+            uint64_t word_c;
+            memcpy(&word_a, bytes + i, sizeof(word_a));
+            memcpy(&word_b, bytes + stream_bytes + i, sizeof(word_b));
+            memcpy(&word_c, bytes + 2 * stream_bytes + i, sizeof(word_c));
+            a = _mm_crc32_u64(a, word_a);
+            b = _mm_crc32_u64(b, word_b);
+            c = _mm_crc32_u64(c, word_c);
+        }
+        crc = multiply_mod(shifts.two, static_cast<uint32_t>(a)) ^ multiply_mod(shifts.one, static_cast<uint32_t>(b)) ^ static_cast<uint32_t>(c);
+        bytes += 3 * stream_bytes;
+        size -= 3 * stream_bytes;
+    }
+
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while (size >= 4) {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        bytes += 4;
+        size -= 4;
+    }
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char * bytes, size_t size) {
+    static const Crc32cShifts shifts;
+    while (size >= 3 * stream_bytes) {
+        uint32_t a = crc;
+        uint32_t b = 0;
+        uint32_t c = 0;
+        for (size_t i = 0; i < stream_bytes; i += 8) {
+            uint64_t word_a;
+            uint64_t word_b;
+            uint64_t word_c;
+            memcpy(&word_a, bytes + i, sizeof(word_a));
+            memcpy(&word_b, bytes + stream_bytes + i, sizeof(word_b));
+            memcpy(&word_c, bytes + 2 * stream_bytes + i, sizeof(word_c));
+            a = __crc32cd(a, word_a);
+            b = __crc32cd(b, word_b);
+            c = __crc32cd(c, word_c);
+        }
+        crc = multiply_mod(shifts.two, a) ^ multiply_mod(shifts.one, b) ^ c;
+        bytes += 3 * stream_bytes;
+        size -= 3 * stream_bytes;
+    }
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32cb(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+static Crc32cFunction pick_crc32c(const char ** name) {
+#ifdef CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return crc32c_sse42;
+    }
+#endif
+#ifdef CRC32C_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        *name = "armv8";
+        return crc32c_armv8;
+    }
+#endif
+    *name = "table";
+    return crc32c_table;
+}
+
+static const char * implementation_name = nullptr;
+static const Crc32cFunction implementation = pick_crc32c(&implementation_name);
+
+uint32_t crc32c(const char * data, size_t size, uint32_t crc) {
+    return ~implementation(~crc, reinterpret_cast<const unsigned char *>(data), size);
+}
+
+const char * crc32c_implementation() {
+    return implementation_name;
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli, as in iSCSI and ext4) of the bytes. Pass a previous result as crc
+// to continue it: crc32c(b, crc32c(a)) == crc32c(a followed by b).
+// Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them, a table otherwise.
+uint32_t crc32c(const char * data, size_t size, uint32_t crc = 0);
+// "sse4.2", "armv8" or "table", for logs
+const char * crc32c_implementation();
+
+#endif // CRC32C_H
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <algorithm>
+
+#include "frame_governor.h"
+
+using namespace std;
+
+FrameGovernor::FrameGovernor(double budget, const vector<string> & level_names, int max_level)
+    : budget(budget), level_names(level_names), max_level(max(0, min(max_level, static_cast<int>(level_names.size()) - 1))),
+      level_frames(level_names.size(), 0), level_late(level_names.size(), 0), level_seconds(level_names.size(), 0) {
+}
+
+int FrameGovernor::update(double work, double mix, const SteadyClock::time_point & now) {
+    if (!started) {
+        level_since = now;
+        started = true;
+    }
+    level_frames[current] += 1;
+    level_late[current] += work > budget ? 1 : 0;
+    work_sd.increment(Seconds(work));
+    // a step up that has held this long has found its level
+    if (frames_since_step_up >= 0 && ++frames_since_step_up >= step_up_frames) {
+        frames_since_step_up = -1;
+        backoff = 1;
+    }
+
+    if (work > high_water * budget) {
+        under_count = 0;
+        if (mix < min_mix_share * work) {
+            // a cheaper mix wouldn't bring it back
+            not_mix_count += 1;
+            over_count = 0;
+        }
+        else if (++over_count >= step_down_frames && current < max_level) {
+            if (frames_since_step_up >= 0) {
+                // that step up was too soon, wait longer before the next
+                backoff = min(backoff * 2, max_backoff);
+                frames_since_step_up = -1;
+            }
+            step(current + 1, work, mix, now);
+        }
+    }
+    else if (work < low_water * budget) {
+        over_count = 0;
+        if (++under_count >= step_up_frames * backoff && current > 0) {
+            step(current - 1, work, mix, now);
+            frames_since_step_up = 0;
+        }
+    }
+    else {
+        over_count = 0;
+        under_count = 0;
+    }
+    return current;
+}
+
+void FrameGovernor::step(int to, double work, double mix, const SteadyClock::time_point & now) {
+    Seconds at_level = now - level_since;
+    level_seconds[current] += at_level.count();
+    cout << "frame governor: " << level_names[current] << " -> " << level_names[to] << " after " << at_level.count()
+         << "s, work " << work * 1000 << "ms mix " << mix * 1000 << "ms of " << budget * 1000 << "ms" << endl;
+    current = to;
+    level_since = now;
+    over_count = 0;
+    under_count = 0;
+    switch_count += 1;
+}
+
+void FrameGovernor::dump(ofstream & out, const string & label) {
+    out << label << " level: " << level_names[current] << " switches: " << switch_count << " backoff: " << backoff
+        << " late outside the mix: " << not_mix_count << endl;
+    for (size_t level = 0; level < level_names.size(); level++) {
+        double seconds = level_seconds[level];
+        if (started && static_cast<int>(level) == current) {
+            seconds += Seconds(SteadyClock::now() - level_since).count();
+        }
+        out << label << " " << level_names[level] << " frames: " << level_frames[level] << " late: " << level_late[level]
+            << " s: " << seconds << endl;
+    }
+    work_sd.dump(out, label + " work");
+}
@@ -0,0 +1,61 @@
+#ifndef FRAME_GOVERNOR_H
+#define FRAME_GOVERNOR_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "comms.h"
+
+// Keeps frames on time by trading quality for it: after every frame it is given how long the
+// frame's work took and how much of that was the mix, and when the work keeps running out of
+// headroom it steps to the next cheaper level, stepping back once there is room again. Level 0 is
+// full quality; what the others do is up to the caller (the server maps them onto the Mixer's
+// degradations). Only the mix gets cheaper, so a frame that is late for some other reason (a slow
+// imshow, say) doesn't step it down. Each switch is logged, and dump() has the frames and the time
+// spent at each level.
+class FrameGovernor {
+public:
+    // budget: seconds a frame may take; level_names: one per level, full quality first;
+    // max_level: the cheapest level it may go to, 0 = watch only
+    FrameGovernor(double budget, const vector<string> & level_names, int max_level);
+
+    // work over this share of the budget for step_down_frames frames in a row steps down a level
+    double high_water = .85;
+    int step_down_frames = 3;
+    // under this share for step_up_frames in a row steps back up; a step up that is undone within
+    // that many frames doubles the wait before the next one, up to max_backoff times
+    double low_water = .5;
+    int step_up_frames = 90;
+    int max_backoff = 16;
+    // the mix must be at least this share of the work for a step down to help
+    double min_mix_share = .25;
+
+    // after each frame, its work and mix in seconds; the level for the next frame
+    int update(double work, double mix, const SteadyClock::time_point & now);
+    int level() const { return current; }
+    void dump(ofstream & out, const string & label);
+
+private:
+    void step(int to, double work, double mix, const SteadyClock::time_point & now);
+
+    double budget;
+    vector<string> level_names;
+    int max_level;
+    int current = 0;
+    int over_count = 0;
+    int under_count = 0;
+    int backoff = 1;
+    long frames_since_step_up = -1;  // -1 = no step up to undo
+    SteadyClock::time_point level_since;
+    bool started = false;
+
+    long switch_count = 0;
+    long not_mix_count = 0;  // frames over high water with too little of it in the mix
+    vector<long> level_frames;
+    vector<long> level_late;  // over budget
+    vector<double> level_seconds;
+    SD work_sd;
+};
+
+#endif // FRAME_GOVERNOR_H
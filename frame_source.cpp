@@ -0,0 +1,263 @@
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#include "frame_source.h"
+#include "thread_config.h"
+
+using namespace std;
+
+#ifndef _WINDOWS
+static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+
+FrameSource::FrameSource(int read_ahead) : keep_going(true), consumed(0), prefetched(0) {
+    this->read_ahead = read_ahead > 0 ? read_ahead : 1;
+}
+
+FrameSource::~FrameSource() {
+    stop();
+}
+
+FrameSource * FrameSource::open(const string & path, size_t frame_size, int read_ahead) {
+#ifdef _WINDOWS
+    cerr << "frame sources need mmap, not available on windows" << endl;
+    return nullptr;
+#else
+    struct stat path_stat;
+    if (stat(path.c_str(), &path_stat) != 0) {
+        cerr << "can't open frame source " << path << " " << strerror(errno) << endl;
+        return nullptr;
+    }
+    
+    if (S_ISDIR(path_stat.st_mode)) {
+        auto source = new FrameDirectorySource(read_ahead);
+        if (!source->open(path)) {
+            delete source;
+            return nullptr;
+        }
+        return source;
+    }
+    
+    auto source = new RawFileSource(read_ahead);
+    if (!source->open(path, frame_size)) {
+        delete source;
+        return nullptr;
+    }
+    return source;
+#endif
+}
+
+void FrameSource::start() {
+    if (prefetch_thread == nullptr && count > 0) {
+        prefetch_thread = new thread(&FrameSource::execute_prefetch, this);
+    }
+}
+
+void FrameSource::stop() {
+    keep_going = false;
+    if (prefetch_thread) {
+        prefetch_waiter.notify();
+        prefetch_thread->join();
+        delete prefetch_thread;
+        prefetch_thread = nullptr;
+    }
+}
+
+long FrameSource::frame_count() const {
+    return count;
+}
+
+PayloadView FrameSource::next_frame() {
+    if (count == 0) {
+        return PayloadView();
+    }
+    
+    long index = consumed.load();
+    if (index >= prefetched.load()) {
+        // the page faults for this frame land on the caller
+        underrun_count += 1;
+    }
+    PayloadView view = frame(index % count);
+    frame_consumed(index % count);
+    consumed = index + 1;
+    prefetch_waiter.notify();
+    return view;
+}
+
+void FrameSource::execute_prefetch() {
+    ThreadConfig::enter(PREFETCH_THREAD);
+    while (keep_going) {
+        long index = prefetched.load();
+        if (index >= consumed.load() + read_ahead) {
+            prefetch_waiter.wait_for(Seconds(0.005));
+            continue;
+        }
+        if (index < consumed.load()) {
+            // fell behind; skip what's already been handed out
+            prefetched = consumed.load();
+            continue;
+        }
+        
+        auto begin = SteadyClock::now();
+        PayloadView view = frame(index % count);
+#ifndef _WINDOWS
+        if (view.size > 0) {
+            // start the read for the whole frame, then fault every page in on this thread
+            auto aligned = reinterpret_cast<uintptr_t>(view.data) & ~(page_size - 1);
+            auto length = reinterpret_cast<uintptr_t>(view.data) + view.size - aligned;
+            madvise(reinterpret_cast<void *>(aligned), length, MADV_WILLNEED);
+            volatile char sink = 0;
+            for (size_t offset = 0; offset < view.size; offset += page_size) {
+                sink += view.data[offset];
+            }
+            sink += view.data[view.size - 1];
+        }
+#endif
+        prefetch_sd.increment(SteadyClock::now(), begin);
+        prefetched = index + 1;
+    }
+}
+
+void FrameSource::dump(ofstream & out) {
+    out << "source frames: " << count << " sent: " << consumed.load() << " prefetched: " << prefetched.load()
+        << " underruns: " << underrun_count << endl;
+    prefetch_sd.dump(out, "prefetch");
+}
+
+RawFileSource::RawFileSource(int read_ahead) : FrameSource(read_ahead) {
+}
+
+RawFileSource::~RawFileSource() {
+    stop();
+}
+
+bool RawFileSource::open(const string & filename, size_t frame_size) {
+#ifdef _WINDOWS
+    return false;
+#else
+    if (frame_size == 0) {
+        return false;
+    }
+    
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "can't open frame file " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(frame_size)) {
+        cerr << "frame file " << filename << " is shorter than one frame" << endl;
+        ::close(fd);
+        return false;
+    }
+    
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    void * address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        cerr << "can't map frame file " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    
+    // played front to back: lets the kernel read ahead aggressively and drop pages behind us
+    madvise(address, size, MADV_SEQUENTIAL);
+    
+    this->mapping = shared_ptr<const void>(address, [size](const void * mapped) {
+        munmap(const_cast<void *>(mapped), size);
+    });
+    this->data = static_cast<const char *>(address);
+    this->frame_size = frame_size;
+    this->count = static_cast<long>(size / frame_size);
+    if (size % frame_size != 0) {
+        cerr << "frame file " << filename << " has " << size % frame_size << " trailing bytes, ignored" << endl;
+    }
+    cout << "streaming " << this->count << " frames from " << filename << endl;
+    
+    start();
+    return true;
+#endif
+}
+
+PayloadView RawFileSource::frame(long index) {
+    PayloadView view;
+    view.owner = this->mapping;
+    view.data = this->data + static_cast<size_t>(index) * this->frame_size;
+    view.size = this->frame_size;
+    return view;
+}
+
+// files are expected to have a common prefix and an increasing number: "frame_9" sorts before "frame_10"
+static bool frame_name_less(const string & left, const string & right) {
+    if (left.size() != right.size()) {
+        return left.size() < right.size();
+    }
+    return left < right;
+}
+
+FrameDirectorySource::FrameDirectorySource(int read_ahead) : FrameSource(read_ahead), asset_cache(60, false) {
+}
+
+FrameDirectorySource::~FrameDirectorySource() {
+    stop();
+}
+
+bool FrameDirectorySource::open(const string & directory) {
+#ifdef _WINDOWS
+    return false;
+#else
+    DIR * dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        cerr << "can't open frame directory " << directory << " " << strerror(errno) << endl;
+        return false;
+    }
+    
+    while (dirent * entry = readdir(dir)) {
+        string name(entry->d_name);
+        if (name.empty() || name[0] == '.') {
+            continue;
+        }
+        string path = directory + "/" + name;
+        struct stat file_stat;
+        if (stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            filenames.push_back(name);
+        }
+    }
+    closedir(dir);
+    
+    sort(filenames.begin(), filenames.end(), frame_name_less);
+    for (auto & name : filenames) {
+        name = directory + "/" + name;
+    }
+    
+    this->count = static_cast<long>(filenames.size());
+    if (this->count == 0) {
+        cerr << "no frames in " << directory << endl;
+        return false;
+    }
+    cout << "streaming " << this->count << " frame files from " << directory << endl;
+    
+    start();
+    return true;
+#endif
+}
+
+PayloadView FrameDirectorySource::frame(long index) {
+    return asset_cache.get(filenames[index]);
+}
+
+void FrameDirectorySource::frame_consumed(long index) {
+    // only the frames between the consumer and the prefetcher need to stay mapped,
+    // the view that was just handed out keeps this one alive until it's sent
+    asset_cache.release(filenames[index]);
+}
@@ -0,0 +1,89 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+
+#include "comms.h"
+#include "asset_cache.h"
+
+// A sequence of frames played in order (and looped), for sending long
+// pre-rendered clips instead of the debug stills.
+// A prefetch thread keeps the next read_ahead frames resident, so next_frame()
+// hands out views whose pages are already faulted in.
+// Asking for a frame the prefetcher hasn't reached yet counts as an underrun.
+class FrameSource {
+public:
+    virtual ~FrameSource();
+    
+    // path is either one file of concatenated frame_size frames, or a directory
+    // of one file per frame, played in numeric/name order; nullptr if it can't be opened
+    static FrameSource * open(const string & path, size_t frame_size, int read_ahead = 8);
+    
+    // empty view if the source has no frames
+    PayloadView next_frame();
+    long frame_count() const;
+    void dump(ofstream & out);
+
+protected:
+    FrameSource(int read_ahead);
+    // derived classes call start() once frame(index) works, and stop() in their destructor
+    void start();
+    void stop();
+    // a view of the frame that doesn't touch its pages
+    virtual PayloadView frame(long index) = 0;
+    // called once a frame has been handed out
+    virtual void frame_consumed(long /* index */) {}
+    
+    long count = 0;
+
+private:
+    void execute_prefetch();
+    
+    int read_ahead;
+    thread * prefetch_thread = nullptr;
+    atomic<bool> keep_going;
+    Waiter prefetch_waiter;
+    // both count up forever, the frame index is the value modulo count
+    atomic<long> consumed;
+    atomic<long> prefetched;
+    long underrun_count = 0;
+    SD prefetch_sd;
+};
+
+// frames of a fixed size concatenated in one large file
+class RawFileSource : public FrameSource {
+public:
+    RawFileSource(int read_ahead);
+    ~RawFileSource();
+    bool open(const string & filename, size_t frame_size);
+
+protected:
+    PayloadView frame(long index);
+
+private:
+    shared_ptr<const void> mapping;
+    const char * data = nullptr;
+    size_t frame_size = 0;
+};
+
+// one file per frame, in a directory
+class FrameDirectorySource : public FrameSource {
+public:
+    FrameDirectorySource(int read_ahead);
+    ~FrameDirectorySource();
+    bool open(const string & directory);
+
+protected:
+    PayloadView frame(long index);
+    void frame_consumed(long index);
+
+private:
+    vector<string> filenames;
+    AssetCache asset_cache;
+};
+
+#endif // FRAME_SOURCE_H
@@ -0,0 +1,270 @@
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#include "message_trace.h"
+#include "content_cache.h"
+#include "thread_config.h"
+
+using namespace std;
+
+const char MessageTrace::magic[8] = {'M', 'R', 'R', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t MessageTrace::version;
+
+template <typename T>
+static void append_value(string & buffer, T value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+MessageTrace::~MessageTrace() {
+    close();
+}
+
+bool MessageTrace::open(const string & filename, size_t max_queued_bytes) {
+    file.open(filename, ios::binary | ios::trunc);
+    if (!file) {
+        cerr << "can't write message trace " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    file.write(magic, sizeof(magic));
+    file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    this->max_queued_bytes = max_queued_bytes;
+    start = SteadyClock::now();
+    write_thread = new thread(&MessageTrace::execute_write, this);
+    return true;
+}
+
+void MessageTrace::record(MessageData * message_data, const SteadyClock::time_point & arrived) {
+    if (write_thread == nullptr || !keep_going) {
+        return;
+    }
+    Entry entry;
+    entry.arrived = arrived;
+    entry.message_type = message_data->message_type;
+    entry.image_name = message_data->image_name;
+    entry.width = message_data->width;
+    entry.height = message_data->height;
+    entry.pixel_format = message_data->pixel_format;
+    if (message_data->payload_size() > 0) {
+        entry.payload = message_data->share_payload();
+    }
+    {
+        lock_guard<mutex> guard(queue_mutex);
+        if (queued_bytes + entry.payload.size > max_queued_bytes) {
+            dropped_count += 1;
+            return;
+        }
+        queued_bytes += entry.payload.size;
+        queue.push_back(entry);
+    }
+    recorded_count += 1;
+    write_waiter.notify();
+}
+
+void MessageTrace::execute_write() {
+    ThreadConfig::enter(TRACE_THREAD);
+    while (true) {
+        Entry entry;
+        bool got = false;
+        {
+            lock_guard<mutex> guard(queue_mutex);
+            if (!queue.empty()) {
+                entry = queue.front();
+                queue.pop_front();
+                got = true;
+            }
+        }
+        if (!got) {
+            if (!keep_going) {
+                break;
+            }
+            write_waiter.wait_for(Seconds(0.01));
+            continue;
+        }
+        write(entry);
+        {
+            lock_guard<mutex> guard(queue_mutex);
+            queued_bytes -= entry.payload.size;
+        }
+        behind_sd.increment(SteadyClock::now(), entry.arrived);
+    }
+    file.flush();
+}
+
+void MessageTrace::write(const Entry & entry) {
+    string record;
+    uint32_t payload_id = no_payload;
+    if (!entry.payload.empty()) {
+        string hash = content_hash(entry.payload.data, entry.payload.size);
+        auto found = payload_ids.find(hash);
+        if (found != payload_ids.end()) {
+            payload_id = found->second;
+            repeated_count += 1;
+        }
+        else {
+            payload_id = static_cast<uint32_t>(payload_ids.size());
+            payload_ids[hash] = payload_id;
+            append_value(record, static_cast<uint8_t>(PAYLOAD));
+            append_value(record, payload_id);
+            append_value(record, static_cast<uint32_t>(entry.payload.size));
+            file.write(record.data(), record.size());
+            file.write(entry.payload.data, entry.payload.size);
+            byte_count += record.size() + entry.payload.size;
+            payload_count += 1;
+            record.clear();
+        }
+    }
+
+    auto since_start = chrono::duration_cast<chrono::microseconds>(entry.arrived - start).count();
+    size_t name_length = min(entry.image_name.size(), static_cast<size_t>(255));
+    append_value(record, static_cast<uint8_t>(MESSAGE));
+    append_value(record, static_cast<uint64_t>(max(since_start, static_cast<decltype(since_start)>(0))));
+    append_value(record, static_cast<uint8_t>(entry.message_type));
+    append_value(record, static_cast<uint8_t>(name_length));
+    record.append(entry.image_name, 0, name_length);
+    append_value(record, entry.width);
+    append_value(record, entry.height);
+    append_value(record, static_cast<uint8_t>(entry.pixel_format));
+    append_value(record, payload_id);
+    file.write(record.data(), record.size());
+    byte_count += record.size();
+}
+
+void MessageTrace::close() {
+    keep_going = false;
+    if (write_thread) {
+        write_waiter.notify();
+        write_thread->join();
+        delete write_thread;
+        write_thread = nullptr;
+    }
+    if (file.is_open()) {
+        file.close();
+    }
+}
+
+void MessageTrace::dump(ofstream & out, const string & label) {
+    size_t queued;
+    {
+        lock_guard<mutex> guard(queue_mutex);
+        queued = queue.size();
+    }
+    out << label << " messages: " << recorded_count << " dropped: " << dropped_count << " payloads: " << payload_count
+        << " repeated: " << repeated_count << " queued: " << queued << " MB: " << byte_count / 1e6 << endl;
+    behind_sd.dump(out, label + " behind");
+}
+
+bool TraceReader::open(const string & filename) {
+#ifdef _WINDOWS
+    return false;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "can't open message trace " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat file_stat;
+    size_t header_size = sizeof(MessageTrace::magic) + sizeof(MessageTrace::version);
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(header_size)) {
+        cerr << "message trace " << filename << " is too short" << endl;
+        ::close(fd);
+        return false;
+    }
+    size_t length = static_cast<size_t>(file_stat.st_size);
+    void * address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        cerr << "can't map message trace " << filename << " " << strerror(errno) << endl;
+        return false;
+    }
+    madvise(address, length, MADV_SEQUENTIAL);
+    mapping = shared_ptr<const void>(address, [length](const void * mapped) {
+        munmap(const_cast<void *>(mapped), length);
+    });
+    data = static_cast<const char *>(address);
+    size = length;
+
+    uint32_t file_version = 0;
+    memcpy(&file_version, data + sizeof(MessageTrace::magic), sizeof(file_version));
+    if (memcmp(data, MessageTrace::magic, sizeof(MessageTrace::magic)) != 0 || file_version != MessageTrace::version) {
+        cerr << filename << " isn't a version " << MessageTrace::version << " message trace" << endl;
+        return false;
+    }
+    offset = header_size;
+    return true;
+#endif
+}
+
+template <typename T>
+static bool read_value(const char * data, size_t size, size_t & offset, T & value) {
+    if (size - offset < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+bool TraceReader::next(TracedMessage & message) {
+    while (offset < size) {
+        uint8_t kind = 0;
+        read_value(data, size, offset, kind);
+        if (kind == MessageTrace::PAYLOAD) {
+            uint32_t id = 0;
+            uint32_t payload_size = 0;
+            if (!read_value(data, size, offset, id) || !read_value(data, size, offset, payload_size) || size - offset < payload_size) {
+                break;
+            }
+            PayloadView payload;
+            payload.owner = mapping;
+            payload.data = data + offset;
+            payload.size = payload_size;
+            offset += payload_size;
+            payloads[id] = payload;
+            continue;
+        }
+        if (kind != MessageTrace::MESSAGE) {
+            cerr << "unknown record in message trace at " << offset - 1 << endl;
+            break;
+        }
+
+        uint64_t microseconds = 0;
+        uint8_t message_type = 0;
+        uint8_t name_length = 0;
+        uint8_t pixel_format = 0;
+        uint32_t payload_id = 0;
+        if (!read_value(data, size, offset, microseconds) || !read_value(data, size, offset, message_type) ||
+            !read_value(data, size, offset, name_length) || size - offset < name_length) {
+            break;
+        }
+        message.image_name.assign(data + offset, name_length);
+        offset += name_length;
+        if (!read_value(data, size, offset, message.width) || !read_value(data, size, offset, message.height) ||
+            !read_value(data, size, offset, pixel_format) || !read_value(data, size, offset, payload_id)) {
+            break;
+        }
+        message.arrived = Seconds(microseconds / 1e6);
+        message.message_type = static_cast<MessageData::MessageType>(message_type);
+        message.pixel_format = pixel_format < MessageData::PIXEL_FORMAT_COUNT ? static_cast<MessageData::PixelFormat>(pixel_format) : MessageData::GRAY8;
+        message.payload = PayloadView();
+        if (payload_id != MessageTrace::no_payload) {
+            auto found = payloads.find(payload_id);
+            if (found == payloads.end()) {
+                cerr << "message trace refers to payload " << payload_id << " before it was written" << endl;
+                break;
+            }
+            message.payload = found->second;
+        }
+        return true;
+    }
+    offset = size;
+    return false;
+}
@@ -0,0 +1,108 @@
+#ifndef MESSAGE_TRACE_H
+#define MESSAGE_TRACE_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+
+#include "comms.h"
+
+// A server's received messages, in the order and at the time they arrived, so a problem that
+// depends on their timing can be played back on another machine (see trace_replay.cpp).
+//
+// The file is "MRRTRACE", a 4 byte version, then records, in host byte order
+// (little endian on x86 and the Pi, as on the wire):
+//   PAYLOAD  1 byte kind, 4 byte id, 4 byte size, the bytes
+//   MESSAGE  1 byte kind, 8 byte microseconds since the trace started, 1 byte type, 1 byte name
+//            length, the name, 2 byte width, 2 byte height, 1 byte pixel format, 4 byte payload id
+// A payload is written once, the first time a message carries it; any later message with the same
+// content_hash refers back to it, so a clip that loops costs its frames once.
+class MessageTrace {
+public:
+    static const char magic[8];
+    static const uint32_t version = 1;
+    enum RecordKind {
+        PAYLOAD = 1,
+        MESSAGE = 2,
+    };
+    // a message without a payload
+    static const uint32_t no_payload = 0xffffffff;
+
+    ~MessageTrace();
+
+    // queued beyond max_queued_bytes, payloads are dropped with their messages and counted
+    bool open(const string & filename, size_t max_queued_bytes = 256 << 20);
+    // receive threads: only takes a reference to the payload, the writer thread hashes and writes it
+    void record(MessageData * message_data, const SteadyClock::time_point & arrived);
+    // writes what is still queued
+    void close();
+    void dump(ofstream & out, const string & label);
+
+private:
+    struct Entry {
+        SteadyClock::time_point arrived;
+        MessageData::MessageType message_type;
+        string image_name;
+        uint16_t width;
+        uint16_t height;
+        MessageData::PixelFormat pixel_format;
+        PayloadView payload;
+    };
+
+    void execute_write();
+    void write(const Entry & entry);
+
+    ofstream file;
+    SteadyClock::time_point start;
+    thread * write_thread = nullptr;
+    atomic<bool> keep_going{true};
+    Waiter write_waiter;
+
+    mutex queue_mutex;
+    deque<Entry> queue;
+    size_t max_queued_bytes = 0;
+    size_t queued_bytes = 0;
+
+    // writer thread only
+    map<string, uint32_t> payload_ids;  // by content_hash
+
+    atomic<long> recorded_count{0};
+    atomic<long> dropped_count{0};
+    atomic<long> payload_count{0};
+    atomic<long> repeated_count{0};
+    atomic<long long> byte_count{0};
+    SD behind_sd;
+};
+
+// one message as it was traced
+struct TracedMessage {
+    Seconds arrived;  // since the trace started
+    MessageData::MessageType message_type = MessageData::NONE;
+    string image_name;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    MessageData::PixelFormat pixel_format = MessageData::GRAY8;
+    // a view into the mapped trace file
+    PayloadView payload;
+};
+
+// Reads a trace back a message at a time; payloads stay in the mapped file.
+class TraceReader {
+public:
+    bool open(const string & filename);
+    // false at the end of the trace, or where it was cut short
+    bool next(TracedMessage & message);
+
+private:
+    shared_ptr<const void> mapping;
+    const char * data = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+    map<uint32_t, PayloadView> payloads;
+};
+
+#endif // MESSAGE_TRACE_H
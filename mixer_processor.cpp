@@ -1,6 +1,20 @@
 #include "mixer_processor.h"
+#include "timeline.h"
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+
+int mixerImageType(MessageData::PixelFormat pixelFormat) {
+    switch (pixelFormat) {
+        case MessageData::GRAY10:
+        case MessageData::GRAY16:
+            return CV_16UC1;
+        case MessageData::BGR8:
+            return CV_8UC3;
+        default:
+            return CV_8UC1;
+    }
+}
 
 cv::Mat loadImage(const std::string& imageFile) {
     cv::Mat img = cv::imread(imageFile, cv::IMREAD_GRAYSCALE);
@@ -12,14 +26,15 @@ cv::Mat loadImage(const std::string& imageFile) {
 }
 
 
-std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter) {
+// nextValue() gives each pixel's 0-255 value
+template <typename NextValue>
+static std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter, NextValue nextValue) {
     std::vector<cv::Mat> noiseFrames;
     for (int i = 0; i < numFrames; ++i) {
         cv::Mat noise(height, width, CV_8UC1);
         for (int y = 0; y < height; ++y) {
             for (int x = 0; x < width; ++x) {
-                float value = static_cast<float>(rand() % 256);
-                noise.at<uchar>(y, x) = static_cast<uchar>(value);
+                noise.at<uchar>(y, x) = static_cast<uchar>(nextValue());
             }
         }
         if (applyFilter) {
@@ -37,39 +52,372 @@ std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, b
     return noiseFrames;
 }
 
-cv::Mat createParabolicLUT() {
-    cv::Mat lut(1, 256, CV_8UC1);
-    for (int i = 0; i < 256; ++i) {
-        float normalized = i / 255.0f;
+std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter) {
+    return generateNoiseFrames(width, height, numFrames, applyFilter, [] { return rand() % 256; });
+}
+
+std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter, std::mt19937& random) {
+    std::uniform_int_distribution<int> values(0, 255);
+    return generateNoiseFrames(width, height, numFrames, applyFilter, [&] { return values(random); });
+}
+
+template <int Bits> cv::Mat createParabolicLUT() {
+    const int size = 1 << Bits;
+    cv::Mat lut(1, size, CV_8UC1);
+    for (int i = 0; i < size; ++i) {
+        float normalized = i / static_cast<float>(size - 1);
         lut.at<uchar>(i) = static_cast<uchar>(std::round(255.0f * normalized * normalized));
     }
     return lut;
 }
 
+template cv::Mat createParabolicLUT<8>();
+template cv::Mat createParabolicLUT<10>();
+template cv::Mat createParabolicLUT<16>();
+
+cv::Mat createParabolicLUT(MessageData::PixelFormat pixelFormat) {
+    switch (pixelFormat) {
+        case MessageData::GRAY10:
+            return createParabolicLUT<PixelTraits<MessageData::GRAY10>::bits>();
+        case MessageData::GRAY16:
+            return createParabolicLUT<PixelTraits<MessageData::GRAY16>::bits>();
+        default:
+            return createParabolicLUT<8>();
+    }
+}
+
+const char* Mixer::degradationName(Degradation degradation) {
+    switch (degradation) {
+        case TWO_LAYERS:
+            return "two layers";
+        case HALF_RESOLUTION:
+            return "half resolution";
+        default:
+            return "full quality";
+    }
+}
 
+Mixer::Mixer(int width, int height, int numNoiseFrames, bool filterNoise, unsigned seed) {
+    std::mt19937 random(seed);
+    noiseFrames = generateNoiseFrames(width, height, std::max(1, numNoiseFrames), filterNoise, random);
+    for (int format = 0; format < MessageData::PIXEL_FORMAT_COUNT; ++format) {
+        luts[format] = createParabolicLUT(static_cast<MessageData::PixelFormat>(format));
+    }
+}
+
+void Mixer::push(const cv::Mat& image, MessageData::PixelFormat pixelFormat, const std::shared_ptr<const void>& owner) {
+    // no fading from one format to another
+    if (pixelFormat != layerFormat) {
+        layers.clear();
+        layerFormat = pixelFormat;
+    }
+    Layer layer;
+    layer.image = image;
+    layer.owner = owner;
+    // the first layer is all there is to show
+    layer.fadeTimer = layers.empty() ? fadeFrames : -1;
+    layers.push_back(layer);
+}
 
-void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
-                         cv::Mat& outputImg, const cv::Mat& lut,
-                         float img1Weight, float noiseWeight, float gain) {
+void Mixer::replace(const cv::Mat& shown, const cv::Mat& image, const std::shared_ptr<const void>& owner) {
+    for (auto& layer : layers) {
+        if (layer.image.data == shown.data) {
+            layer.image = image;
+            layer.owner = owner;
+        }
+    }
+}
+
+bool Mixer::shows(const cv::Mat& image) const {
+    for (const auto& layer : layers) {
+        if (layer.image.data == image.data) {
+            return true;
+        }
+    }
+    return false;
+}
+
+float Mixer::fade() const {
+    if (layers.empty()) {
+        return 0;
+    }
+    return static_cast<float>(std::max(layers.back().fadeTimer, 0)) / fadeFrames;
+}
+
+const std::vector<uchar>& Mixer::levelsFor(const cv::Mat& lut) {
+    if (lut.ptr<uchar>(0) != levelsLut || outputGain != levelsGain) {
+        levels.resize(lut.cols);
+        const uchar* lutEntries = lut.ptr<uchar>(0);
+        for (size_t i = 0; i < levels.size(); ++i) {
+            levels[i] = cv::saturate_cast<uchar>(lutEntries[i] * outputGain);
+        }
+        levelsLut = lutEntries;
+        levelsGain = outputGain;
+    }
+    return levels;
+}
+
+// Every stage rounds and saturates to the bit depth, as addWeighted does for 8 bits (but ties round up:
+// the weights are positive, so it adds .5 and truncates). A row goes a block of pixels at a time, the arithmetic
+// in loops the compiler vectorizes when the count is the constant blockPixels, then the table lookups
+static const int blockPixels = 16;
+
+template <typename Pixel, int Channels, int Bits>
+static inline void blendPixels(const Pixel* samples1, const Pixel* samples2, const uchar* noise, uchar* output, int pixels,
+                               const uchar* levels, float img1Weight, float img2Weight, float imageWeight, float noiseScale) {
+    const int maxSample = (1 << Bits) - 1;
+    int index[blockPixels * Channels];
+    for (int i = 0; i < pixels * Channels; ++i) {
+        int blended = static_cast<int>(samples1[i] * img1Weight + samples2[i] * img2Weight + 0.5f);
+        index[i] = blended < maxSample ? blended : maxSample;
+    }
+    for (int pixel = 0; pixel < pixels; ++pixel) {
+        float pixelNoise = noise[pixel] * noiseScale + 0.5f;
+        for (int channel = 0; channel < Channels; ++channel) {
+            int mixed = static_cast<int>(index[pixel * Channels + channel] * imageWeight + pixelNoise);
+            index[pixel * Channels + channel] = mixed < maxSample ? mixed : maxSample;
+        }
+    }
+    for (int i = 0; i < pixels * Channels; ++i) {
+        output[i] = levels[index[i]];
+    }
+}
+
+// The (8 bit, single channel) noise is stretched to the bit depth and added to every channel
+template <typename Pixel, int Channels, int Bits>
+void Mixer::blend(const cv::Mat& img1, const cv::Mat& img2, const cv::Mat& noiseFrame, const cv::Mat& lut, float img1Weight) {
+    const int maxSample = (1 << Bits) - 1;
+    float img2Weight = 1.0f - img1Weight;
+    float imageWeight = 1.0f - noiseWeight;
+    // 0-255 noise covers the whole sample range
+    float noiseScale = Bits == 8 ? noiseWeight : noiseWeight * maxSample / 255.0f;
+    const uchar* levels = levelsFor(lut).data();
+
+    output.create(img1.rows, img1.cols, CV_8UC(Channels));
+    int wholeBlocks = img1.cols - img1.cols % blockPixels;
+    for (int y = 0; y < img1.rows; ++y) {
+        const Pixel* row1 = img1.ptr<Pixel>(y);
+        const Pixel* row2 = img2.ptr<Pixel>(y);
+        const uchar* noiseRow = noiseFrame.ptr<uchar>(y);
+        uchar* outputRow = output.ptr<uchar>(y);
+        for (int x = 0; x < wholeBlocks; x += blockPixels) {
+            blendPixels<Pixel, Channels, Bits>(row1 + x * Channels, row2 + x * Channels, noiseRow + x, outputRow + x * Channels,
+                                               blockPixels, levels, img1Weight, img2Weight, imageWeight, noiseScale);
+        }
+        if (wholeBlocks < img1.cols) {
+            int x = wholeBlocks;
+            blendPixels<Pixel, Channels, Bits>(row1 + x * Channels, row2 + x * Channels, noiseRow + x, outputRow + x * Channels,
+                                               img1.cols - x, levels, img1Weight, img2Weight, imageWeight, noiseScale);
+        }
+    }
+}
+
+// 8 bit grayscale keeps OpenCV's own vectorized passes, into scratch that stays allocated between frames
+template <>
+void Mixer::blend<uchar, 1, 8>(const cv::Mat& img1, const cv::Mat& img2, const cv::Mat& noiseFrame, const cv::Mat& lut, float img1Weight) {
     float img2Weight = 1.0f - img1Weight;
-    
-    // Determine the current noise frame
-    static int noiseFrameIndex = 0;
-    cv::Mat noiseFrame = noiseFrames[noiseFrameIndex];
-    noiseFrameIndex = (noiseFrameIndex + 1) % noiseFrames.size();
     
     // Blend images
-    cv::Mat blendedImage;
     cv::addWeighted(img1, img1Weight, img2, img2Weight, 0, blendedImage);
     
     // Blend noise with the image
-    cv::Mat blendedWithNoise;
     cv::addWeighted(blendedImage, 1.0f - noiseWeight, noiseFrame, noiseWeight, 0, blendedWithNoise);
     
     // Apply parabolic LUT
-    cv::Mat lutApplied;
     cv::LUT(blendedWithNoise, lut, lutApplied);
     
     // Apply gain directly
-    lutApplied.convertTo(outputImg, -1, gain, 0);
-}
\ No newline at end of file
+    lutApplied.convertTo(output, -1, outputGain, 0);
+}
+
+// weights add up to 1 << weightBits; 15 bits keep a 16 bit sample times its weight, summed, inside an int
+static const int weightBits = 15;
+
+template <typename Pixel, int Channels, int Bits>
+static inline void compositePixels(const uchar* const* layerRows, const int* weights, int layerCount, int offset,
+                                   const uchar* noise, uchar* output, int pixels, const uchar* levels,
+                                   float imageWeight, float noiseScale) {
+    const int maxSample = (1 << Bits) - 1;
+    int index[blockPixels * Channels];
+    for (int i = 0; i < pixels * Channels; ++i) {
+        index[i] = 1 << (weightBits - 1);
+    }
+    for (int layer = 0; layer < layerCount; ++layer) {
+        const Pixel* samples = reinterpret_cast<const Pixel*>(layerRows[layer]) + offset;
+        int weight = weights[layer];
+        for (int i = 0; i < pixels * Channels; ++i) {
+            index[i] += weight * samples[i];
+        }
+    }
+    for (int i = 0; i < pixels * Channels; ++i) {
+        int blended = index[i] >> weightBits;
+        index[i] = blended < maxSample ? blended : maxSample;
+    }
+    for (int pixel = 0; pixel < pixels; ++pixel) {
+        float pixelNoise = noise[pixel] * noiseScale + 0.5f;
+        for (int channel = 0; channel < Channels; ++channel) {
+            int mixed = static_cast<int>(index[pixel * Channels + channel] * imageWeight + pixelNoise);
+            index[pixel * Channels + channel] = mixed < maxSample ? mixed : maxSample;
+        }
+    }
+    for (int i = 0; i < pixels * Channels; ++i) {
+        output[i] = levels[index[i]];
+    }
+}
+
+// Each block of pixels reads every layer once, accumulating in fixed point, then goes through the
+// noise and the LUT as in blend()
+template <typename Pixel, int Channels, int Bits>
+void Mixer::composite(const cv::Mat& noiseFrame, const cv::Mat& lut) {
+    const int maxSample = (1 << Bits) - 1;
+    float imageWeight = 1.0f - noiseWeight;
+    float noiseScale = Bits == 8 ? noiseWeight : noiseWeight * maxSample / 255.0f;
+    const uchar* levels = levelsFor(lut).data();
+
+    // rounded, with whatever rounding leaves over going to the heaviest layer so the sum is exact
+    int layerCount = static_cast<int>(shownImages.size());
+    layerWeights.resize(layerCount);
+    layerRows.resize(layerCount);
+    int total = 0;
+    int heaviest = 0;
+    for (int layer = 0; layer < layerCount; ++layer) {
+        layerWeights[layer] = static_cast<int>(shownWeights[layer] * (1 << weightBits) + 0.5f);
+        total += layerWeights[layer];
+        heaviest = layerWeights[layer] > layerWeights[heaviest] ? layer : heaviest;
+    }
+    layerWeights[heaviest] += (1 << weightBits) - total;
+
+    const cv::Mat& first = *shownImages[0];
+    output.create(first.rows, first.cols, CV_8UC(Channels));
+    int wholeBlocks = first.cols - first.cols % blockPixels;
+    for (int y = 0; y < first.rows; ++y) {
+        for (int layer = 0; layer < layerCount; ++layer) {
+            layerRows[layer] = shownImages[layer]->ptr<uchar>(y);
+        }
+        const uchar* noiseRow = noiseFrame.ptr<uchar>(y);
+        uchar* outputRow = output.ptr<uchar>(y);
+        for (int x = 0; x < wholeBlocks; x += blockPixels) {
+            compositePixels<Pixel, Channels, Bits>(layerRows.data(), layerWeights.data(), layerCount, x * Channels, noiseRow + x,
+                                                   outputRow + x * Channels, blockPixels, levels, imageWeight, noiseScale);
+        }
+        if (wholeBlocks < first.cols) {
+            int x = wholeBlocks;
+            compositePixels<Pixel, Channels, Bits>(layerRows.data(), layerWeights.data(), layerCount, x * Channels, noiseRow + x,
+                                                   outputRow + x * Channels, first.cols - x, levels, imageWeight, noiseScale);
+        }
+    }
+}
+
+template <MessageData::PixelFormat Format>
+void Mixer::mixFormat(const cv::Mat& noiseFrame) {
+    typedef PixelTraits<Format> Traits;
+    if (shownImages.size() == 1) {
+        TIMELINE_ZONE("blend");
+        blend<typename Traits::Pixel, Traits::channels, Traits::bits>(*shownImages[0], *shownImages[0], noiseFrame, luts[Format], 1);
+    }
+    else if (shownImages.size() == 2) {
+        TIMELINE_ZONE("blend");
+        // the top one's weight is its fade, the other gets the rest
+        blend<typename Traits::Pixel, Traits::channels, Traits::bits>(*shownImages[1], *shownImages[0], noiseFrame, luts[Format],
+                                                                     shownWeights[1]);
+    }
+    else {
+        TIMELINE_ZONE("composite");
+        composite<typename Traits::Pixel, Traits::channels, Traits::bits>(noiseFrame, luts[Format]);
+    }
+}
+
+const cv::Mat& Mixer::mix() {
+    TIMELINE_ZONE("mix");
+    auto begin = SteadyClock::now();
+    if (layers.empty()) {
+        return output;
+    }
+
+    // step the fades; everything under a layer that has finished fading in is hidden for good
+    size_t covered = 0;
+    for (size_t layer = 0; layer < layers.size(); ++layer) {
+        layers[layer].fadeTimer = std::min(layers[layer].fadeTimer + 1, fadeFrames);
+        if (layers[layer].fadeTimer >= fadeFrames) {
+            covered = layer;
+        }
+    }
+    size_t layerLimit = degradation >= TWO_LAYERS ? std::min(maxLayers, static_cast<size_t>(2)) : maxLayers;
+    covered = std::max(covered, layers.size() > layerLimit ? layers.size() - layerLimit : 0);
+    layers.erase(layers.begin(), layers.begin() + covered);
+
+    // weights from the top down, the bottom layer takes what is left
+    shownImages.clear();
+    shownWeights.clear();
+    float remaining = 1;
+    for (size_t layer = layers.size(); layer-- > 0;) {
+        float weight = layer == 0 ? remaining : remaining * layers[layer].fadeTimer / fadeFrames;
+        remaining -= weight;
+        if (weight > 0) {
+            shownImages.push_back(&layers[layer].image);
+            shownWeights.push_back(weight);
+        }
+    }
+    // bottom first, like the layers
+    std::reverse(shownImages.begin(), shownImages.end());
+    std::reverse(shownWeights.begin(), shownWeights.end());
+
+    // Determine the current noise frame
+    const cv::Mat* noiseFrame = &noiseFrames[noiseFrameIndex];
+    noiseFrameIndex = (noiseFrameIndex + 1) % noiseFrames.size();
+
+    // nearest neighbour halves: every pass after this touches a quarter of the pixels
+    bool half = degradation >= HALF_RESOLUTION;
+    const cv::Mat& full = *shownImages[0];
+    if (half) {
+        cv::Size halfSize((full.cols + 1) / 2, (full.rows + 1) / 2);
+        halfImages.resize(shownImages.size());
+        for (size_t shown = 0; shown < shownImages.size(); ++shown) {
+            cv::resize(*shownImages[shown], halfImages[shown], halfSize, 0, 0, cv::INTER_NEAREST);
+            shownImages[shown] = &halfImages[shown];
+        }
+        // the noise doesn't change, it is halved once
+        if (halfNoiseFrames.size() != noiseFrames.size() || halfNoiseFrames[0].size() != halfSize) {
+            halfNoiseFrames.resize(noiseFrames.size());
+            for (size_t frame = 0; frame < noiseFrames.size(); ++frame) {
+                cv::resize(noiseFrames[frame], halfNoiseFrames[frame], halfSize, 0, 0, cv::INTER_NEAREST);
+            }
+        }
+        noiseFrame = &halfNoiseFrames[noiseFrame - noiseFrames.data()];
+    }
+
+    switch (layerFormat) {
+        case MessageData::GRAY10:
+            mixFormat<MessageData::GRAY10>(*noiseFrame);
+            break;
+        case MessageData::GRAY16:
+            mixFormat<MessageData::GRAY16>(*noiseFrame);
+            break;
+        case MessageData::BGR8:
+            mixFormat<MessageData::BGR8>(*noiseFrame);
+            break;
+        default:
+            mixFormat<MessageData::GRAY8>(*noiseFrame);
+            break;
+    }
+
+    if (half) {
+        TIMELINE_ZONE("upscale");
+        cv::resize(output, scaledOutput, full.size(), 0, 0, cv::INTER_LINEAR);
+    }
+
+    std::lock_guard<std::mutex> guard(statsMutex);
+    frameCount++;
+    compositeCount += shownImages.size() > 2 ? 1 : 0;
+    degradedCount += degradation > FULL_QUALITY ? 1 : 0;
+    mixSd.increment(SteadyClock::now(), begin);
+    return half ? scaledOutput : output;
+}
+
+void Mixer::dump(std::ofstream& out, const std::string& label) {
+    std::lock_guard<std::mutex> guard(statsMutex);
+    out << label << " frames: " << frameCount << " over two layers: " << compositeCount << " degraded: " << degradedCount
+        << " (" << degradationName(degradation) << ") layers: " << layers.size()
+        << " fade: " << fade() << std::endl;
+    mixSd.dump(out, label + " mix");
+}
@@ -4,20 +4,157 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <string>
+#include <random>
+#include <mutex>
+#include <fstream>
+#include <memory>
 
+#include "comms.h"
+
+
+// What the mixer needs to know about each pixel format it handles; one specialization per format.
+// Whatever comes in, the output is 8 bits per channel for the display.
+template <MessageData::PixelFormat Format> struct PixelTraits;
+
+template <> struct PixelTraits<MessageData::GRAY8> {
+    typedef uchar Pixel;
+    static const int channels = 1;
+    static const int bits = 8;
+};
+
+template <> struct PixelTraits<MessageData::GRAY10> {
+    typedef ushort Pixel;
+    static const int channels = 1;
+    static const int bits = 10;
+};
+
+template <> struct PixelTraits<MessageData::GRAY16> {
+    typedef ushort Pixel;
+    static const int channels = 1;
+    static const int bits = 16;
+};
+
+template <> struct PixelTraits<MessageData::BGR8> {
+    typedef uchar Pixel;
+    static const int channels = 3;
+    static const int bits = 8;
+};
+
+// The cv::Mat type an image in this format is wrapped in
+int mixerImageType(MessageData::PixelFormat pixelFormat);
 
 // Load a grayscale image
 cv::Mat loadImage(const std::string& imageFile);
 
 // Generate grayscale noise frames
 std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter);
+// the same, drawing from random instead of rand(), so generators on other threads don't interfere
+std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter, std::mt19937& random);
+
+// Create a parabolic lookup table, one 8 bit entry for each of the 2^Bits sample values
+template <int Bits> cv::Mat createParabolicLUT();
+// the table for the format's bit depth
+cv::Mat createParabolicLUT(MessageData::PixelFormat pixelFormat = MessageData::GRAY8);
+
+// One output channel: a stack of images, each fading in over the ones below it, blended with
+// noise, then the LUT and the gain. It owns everything that takes: its noise frames and its place
+// in them, a LUT for each bit depth, the layers and their fades, the scratch images the passes
+// write into and its frame time. Several outputs (two heads, a preview next to the main display)
+// each get a Mixer and can mix on threads of their own; a single Mixer is for one thread at a time.
+//
+// A layer's weight is its fade times what the layers above it leave over, so an image that arrives
+// mid-fade fades in over the transition still going on underneath instead of cutting it short.
+// Layers under one that has finished fading in are dropped. While no more than two layers show,
+// the two-image blend runs; more are summed in one pass with 15 bit fixed-point weights.
+class Mixer {
+public:
+    // cheaper ways to mix, for when frames would be late; each does what the ones before it do too
+    enum Degradation {
+        FULL_QUALITY,
+        TWO_LAYERS,       // no more than two layers, older fades are cut short and the two-image blend runs
+        HALF_RESOLUTION,  // mixed from every other pixel of every other row, then scaled back up
+        DEGRADATION_COUNT
+    };
+    static const char* degradationName(Degradation degradation);
+
+    // seed picks the noise, give outputs that should look different different seeds
+    Mixer(int width, int height, int numNoiseFrames = 30, bool filterNoise = true, unsigned seed = 1);
+
+    float noiseWeight = .6f;
+    float outputGain = 1.8f;
+    // frames for an image to fade in
+    int fadeFrames = 38;
+    // the oldest layers are dropped beyond this many, as if the next one up had finished fading in
+    size_t maxLayers = 8;
+    Degradation degradation = FULL_QUALITY;
+
+    // image starts fading in on top on the next mix(); in another format than the one showing it
+    // replaces all the layers at once. owner, if given, is held for as long as the layer is.
+    void push(const cv::Mat& image, MessageData::PixelFormat pixelFormat, const std::shared_ptr<const void>& owner = nullptr);
+    // layers showing shown's pixels show image instead, their fades carry on; for swapping in
+    // another copy of the same image, or moving the screen off a buffer that is about to be reused
+    void replace(const cv::Mat& shown, const cv::Mat& image, const std::shared_ptr<const void>& owner = nullptr);
+    // whether a layer shows image's pixels
+    bool shows(const cv::Mat& image) const;
+    MessageData::PixelFormat format() const { return layerFormat; }
+    size_t layerCount() const { return layers.size(); }
+    // the top layer's fade, 0 = just pushed, 1 = all that shows
+    float fade() const;
+    // steps the fades and mixes one output frame, CV_8UC(channels) of the format, the size of the
+    // images pushed. The result is valid until the next call; empty until something is pushed
+    const cv::Mat& mix();
+    // frames mixed, how many needed more than two layers or were degraded, and the time each took
+    void dump(std::ofstream& out, const std::string& label);
+
+private:
+    struct Layer {
+        cv::Mat image;
+        std::shared_ptr<const void> owner;
+        // frames since it was pushed, -1 until the first mix()
+        int fadeTimer = -1;
+    };
+
+    template <typename Pixel, int Channels, int Bits>
+    void blend(const cv::Mat& img1, const cv::Mat& img2, const cv::Mat& noiseFrame, const cv::Mat& lut, float img1Weight);
+    // sums layerRows' images with the fixed-point weights in layerWeights
+    template <typename Pixel, int Channels, int Bits>
+    void composite(const cv::Mat& noiseFrame, const cv::Mat& lut);
+    // blend() or composite() with the format's PixelTraits and its LUT
+    template <MessageData::PixelFormat Format>
+    void mixFormat(const cv::Mat& noiseFrame);
+    // the LUT with the gain folded in, rebuilt only when either changes
+    const std::vector<uchar>& levelsFor(const cv::Mat& lut);
+
+    std::vector<cv::Mat> noiseFrames;
+    size_t noiseFrameIndex = 0;
+    cv::Mat luts[MessageData::PIXEL_FORMAT_COUNT];
+
+    // bottom first
+    std::vector<Layer> layers;
+    MessageData::PixelFormat layerFormat = MessageData::GRAY8;
+    // this frame's layers with a weight, and their weights
+    std::vector<const cv::Mat*> shownImages;
+    std::vector<float> shownWeights;
 
-// Create a parabolic lookup table
-cv::Mat createParabolicLUT();
+    cv::Mat blendedImage;
+    cv::Mat blendedWithNoise;
+    cv::Mat lutApplied;
+    cv::Mat output;
+    // HALF_RESOLUTION: the shown layers and the noise frames at half size, and output scaled back up
+    std::vector<cv::Mat> halfImages;
+    std::vector<cv::Mat> halfNoiseFrames;
+    cv::Mat scaledOutput;
+    std::vector<uchar> levels;
+    const uchar* levelsLut = nullptr;
+    float levelsGain = 0;
+    std::vector<int> layerWeights;
+    std::vector<const uchar*> layerRows;
 
-// Function to blend images and noise, and apply LUT
-void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames, 
-                         cv::Mat& resultImg, const cv::Mat& lut, float imageBlendWeight, 
-                         float noiseWeight, float outputGain);
+    std::mutex statsMutex;
+    long frameCount = 0;
+    long compositeCount = 0;
+    long degradedCount = 0;
+    SD mixSd;
+};
 
-#endif // MIXER_PROCESSOR_H
\ No newline at end of file
+#endif // MIXER_PROCESSOR_H
@@ -0,0 +1,514 @@
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+#include <random>
+
+#include "multicast.h"
+#include "thread_config.h"
+
+using namespace std;
+
+// keeps a datagram under a 1500 byte ethernet mtu with room for ip/udp headers
+static const size_t fragment_payload = 1400;
+static const uint32_t fragment_magic = 0x4d52524d;  // "MRRM"
+// incomplete frames kept at once; anything older is given up on
+static const size_t max_assemblies = 8;
+
+// sent in host byte order, like the tcp framing
+struct FragmentHeader {
+    uint32_t magic;
+    // picked when the sender starts, so a restarted client's sequences aren't taken for old ones
+    uint32_t session;
+    uint32_t sequence;
+    uint32_t message_size;
+    uint16_t fragment_index;
+    uint16_t fragment_count;
+};
+
+bool split_group_address(const string & address, string & group, string & port) {
+    auto colon = address.rfind(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == address.size()) {
+        return false;
+    }
+    group = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+static void close_socket(SOCKET sock_fd) {
+#ifdef _WINDOWS
+    closesocket(sock_fd);
+#else
+    ::close(sock_fd);
+#endif
+}
+
+MulticastSender::~MulticastSender() {
+    if (sock_fd >= 0) {
+        close_socket(sock_fd);
+    }
+}
+
+bool MulticastSender::open(const string & group, const string & port, const string & interface_address, int ttl) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    
+    addrinfo * group_info;
+    int addrinfo_result = getaddrinfo(group.c_str(), port.c_str(), &hints, &group_info);
+    if (addrinfo_result != 0) {
+        cerr << "multicast group " << group << ":" << port << " " << gai_strerror(addrinfo_result) << endl;
+        return false;
+    }
+    memcpy(&group_addr, group_info->ai_addr, group_info->ai_addrlen);
+    group_addr_size = static_cast<socklen_t>(group_info->ai_addrlen);
+    freeaddrinfo(group_info);
+    
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        cerr << "opening multicast socket " << strerror(errno) << endl;
+        return false;
+    }
+    
+    unsigned char ttl_value = static_cast<unsigned char>(ttl);
+    setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &ttl_value, sizeof(ttl_value));
+    // servers on this host (or a loopback test) get the frames too
+    unsigned char loop = 1;
+    setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *) &loop, sizeof(loop));
+    // a whole frame goes out in one burst
+    int buffer_size = 4 << 20;
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, (const char *) &buffer_size, sizeof(buffer_size));
+    
+    if (!interface_address.empty()) {
+        in_addr interface_addr;
+        if (inet_pton(AF_INET, interface_address.c_str(), &interface_addr) != 1 ||
+            setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_IF, (const char *) &interface_addr, sizeof(interface_addr)) != 0) {
+            cerr << "can't send multicast on interface " << interface_address << endl;
+            close_socket(sock_fd);
+            sock_fd = -1;
+            return false;
+        }
+    }
+    
+    // any other session at all will do, a clash only matters if it falls on a restart
+    session = random_device()();
+    cout << "multicasting to " << group << ":" << port << " session " << session << endl;
+    return true;
+}
+
+void MulticastSender::send_fragment(const SentFrame & frame, uint16_t fragment_index) {
+    char datagram[sizeof(FragmentHeader) + fragment_payload];
+    size_t message_size = frame.header.size() + frame.payload.size + frame.trailer.size();
+    size_t offset = fragment_index * fragment_payload;
+    size_t length = min(fragment_payload, message_size - offset);
+    
+    FragmentHeader header;
+    header.magic = fragment_magic;
+    header.session = session;
+    header.sequence = frame.sequence;
+    header.message_size = static_cast<uint32_t>(message_size);
+    header.fragment_index = fragment_index;
+    header.fragment_count = frame.fragment_count;
+    memcpy(datagram, &header, sizeof(header));
+    
+    // the first fragment straddles the message header and the payload, the last one the payload and the trailer
+    char * out = datagram + sizeof(header);
+    const char * piece_data[] = {frame.header.data(), frame.payload.data, frame.trailer.data()};
+    size_t piece_size[] = {frame.header.size(), frame.payload.size, frame.trailer.size()};
+    size_t piece_start = 0;
+    for (int i = 0; i < 3; i++) {
+        size_t begin_at = max(offset, piece_start);
+        size_t end_at = min(offset + length, piece_start + piece_size[i]);
+        if (begin_at < end_at) {
+            memcpy(out + begin_at - offset, piece_data[i] + begin_at - piece_start, end_at - begin_at);
+        }
+        piece_start += piece_size[i];
+    }
+    
+    SteadyClock::time_point due;
+    {
+        // repairs interleave with a frame that's still going out
+        lock_guard<mutex> guard(this->history_mutex);
+        sendto(sock_fd, datagram, sizeof(header) + length, 0, (const sockaddr *) &group_addr, group_addr_size);
+        datagrams_sent += 1;
+        if (max_bytes_per_second <= 0) {
+            return;
+        }
+        
+        auto now = SteadyClock::now();
+        paced_bytes += sizeof(header) + length;
+        due = pace_start + chrono::duration_cast<SteadyClock::duration>(Seconds(paced_bytes / max_bytes_per_second));
+        if (due + chrono::milliseconds(10) < now) {
+            // idle since the last burst, don't let it build up credit
+            pace_start = now;
+            paced_bytes = 0;
+        }
+    }
+    if (due > SteadyClock::now() + chrono::milliseconds(1)) {
+        this_thread::sleep_until(due);
+    }
+}
+
+void MulticastSender::send(MessageData * message_data) {
+    SentFrame frame;
+    frame.header = message_data->header.empty() ? message_data->serialize_header() : message_data->header;
+    frame.trailer = message_data->trailer();
+    if (message_data->payload.data) {
+        frame.payload = message_data->payload;
+    }
+    else if (!message_data->image_data.empty()) {
+        // kept for repairs after message_data is gone
+        auto copy = make_shared<string>(message_data->image_data);
+        frame.payload.owner = copy;
+        frame.payload.data = copy->data();
+        frame.payload.size = copy->size();
+    }
+    if (message_data->auto_delete) {
+        delete message_data;
+    }
+    
+    size_t message_size = frame.header.size() + frame.payload.size + frame.trailer.size();
+    size_t fragment_count = (message_size + fragment_payload - 1) / fragment_payload;
+    if (fragment_count > 0xffff) {
+        cerr << "message of " << message_size << " bytes is too large to multicast" << endl;
+        return;
+    }
+    frame.fragment_count = static_cast<uint16_t>(fragment_count);
+    
+    {
+        lock_guard<mutex> guard(this->history_mutex);
+        frame.sequence = next_sequence++;
+        frames_sent += 1;
+        history.push_back(frame);
+        while (history.size() > history_size) {
+            history.pop_front();
+        }
+    }
+    for (uint16_t i = 0; i < frame.fragment_count; i++) {
+        send_fragment(frame, i);
+    }
+}
+
+void MulticastSender::repair(const MessageData & nack) {
+    // "session:sequence"
+    char * end = nullptr;
+    uint32_t nack_session = static_cast<uint32_t>(strtoul(nack.image_name.c_str(), &end, 10));
+    uint32_t sequence = *end == ':' ? static_cast<uint32_t>(strtoul(end + 1, nullptr, 10)) : 0;
+    
+    SentFrame frame;
+    {
+        lock_guard<mutex> guard(this->history_mutex);
+        nacks_received += 1;
+        if (nack_session != session) {
+            // asks for a frame from before this sender started
+            stale_nacks += 1;
+            return;
+        }
+        auto sent = find_if(history.begin(), history.end(), [sequence](const SentFrame & sent) {
+            return sent.sequence == sequence;
+        });
+        if (sent == history.end()) {
+            // too old, the server gives up on it eventually
+            repair_misses += 1;
+            return;
+        }
+        frame = *sent;
+    }
+    
+    // a list of fragment indexes, or nothing if the whole frame went missing
+    vector<uint16_t> fragment_indexes(nack.payload_size() / sizeof(uint16_t));
+    if (!fragment_indexes.empty()) {
+        memcpy(fragment_indexes.data(), nack.payload_data(), fragment_indexes.size() * sizeof(uint16_t));
+    }
+    else {
+        for (uint16_t i = 0; i < frame.fragment_count; i++) {
+            fragment_indexes.push_back(i);
+        }
+    }
+    for (auto fragment_index : fragment_indexes) {
+        if (fragment_index < frame.fragment_count) {
+            send_fragment(frame, fragment_index);
+            lock_guard<mutex> guard(this->history_mutex);
+            fragments_resent += 1;
+        }
+    }
+}
+
+void MulticastSender::dump(ofstream & out) {
+    lock_guard<mutex> guard(this->history_mutex);
+    out << "multicast frames: " << frames_sent << " datagrams: " << datagrams_sent << " nacks: " << nacks_received
+        << " resent: " << fragments_resent << " too_old: " << repair_misses << " other_session: " << stale_nacks << endl;
+    if (datagrams_sent > 0) {
+        out << "repair overhead: " << 100.0 * fragments_resent / datagrams_sent << "%" << endl;
+    }
+}
+
+MulticastReceiver::~MulticastReceiver() {
+    stop();
+    if (sock_fd >= 0) {
+        close_socket(sock_fd);
+    }
+}
+
+bool MulticastReceiver::open(const string & group, const string & port, const string & interface_address) {
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        cerr << "opening multicast socket " << strerror(errno) << endl;
+        return false;
+    }
+    
+    // several servers on one host (or a loopback test) listen on the same group and port
+    int reuse = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &reuse, sizeof(reuse));
+#endif
+    // room for a few whole frames while the receive thread is busy
+    int buffer_size = 8 << 20;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, (const char *) &buffer_size, sizeof(buffer_size));
+    
+    sockaddr_in socket_addr;
+    memset(&socket_addr, 0, sizeof(socket_addr));
+    socket_addr.sin_family = AF_INET;
+    socket_addr.sin_addr.s_addr = INADDR_ANY;
+    socket_addr.sin_port = htons(stoi(port));
+    if (::bind(sock_fd, (sockaddr *) &socket_addr, sizeof(socket_addr)) == -1) {
+        cerr << "multicast bind to port " << port << " failed " << strerror(errno) << endl;
+        return false;
+    }
+    
+    ip_mreq membership;
+    if (inet_pton(AF_INET, group.c_str(), &membership.imr_multiaddr) != 1) {
+        cerr << "bad multicast group " << group << endl;
+        return false;
+    }
+    membership.imr_interface.s_addr = INADDR_ANY;
+    if (!interface_address.empty() && inet_pton(AF_INET, interface_address.c_str(), &membership.imr_interface) != 1) {
+        cerr << "bad multicast interface " << interface_address << endl;
+        return false;
+    }
+    if (setsockopt(sock_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *) &membership, sizeof(membership)) != 0) {
+        cerr << "joining multicast group " << group << " failed " << strerror(errno) << endl;
+        return false;
+    }
+    
+    cout << "listening to multicast " << group << ":" << port << endl;
+    return true;
+}
+
+void MulticastReceiver::start(Comm * comm) {
+    if (receive_thread) {
+        return;
+    }
+    this->comm = comm;
+    keep_going = true;
+    receive_thread = new thread(&MulticastReceiver::execute_receive, this);
+}
+
+void MulticastReceiver::stop() {
+    keep_going = false;
+    if (receive_thread) {
+        receive_thread->join();
+        delete receive_thread;
+        receive_thread = nullptr;
+    }
+}
+
+void MulticastReceiver::execute_receive() {
+    ThreadConfig::enter(MULTICAST_THREAD);
+    pollfd ufds[1];
+    ufds[0].fd = sock_fd;
+    ufds[0].events = POLLIN;
+    char datagram[sizeof(FragmentHeader) + fragment_payload];
+    
+    while (keep_going) {
+        int poll_result = poll(ufds, 1, 5);
+        if (poll_result < 0 && errno != EINTR) {
+            cerr << "multicast poll error " << strerror(errno) << endl;
+            break;
+        }
+        
+        auto now = SteadyClock::now();
+        lock_guard<mutex> guard(this->stats_mutex);
+        if (poll_result > 0) {
+            // drain everything that's queued before looking for gaps
+            while (true) {
+                ssize_t received_count = recv(sock_fd, datagram, sizeof(datagram), MSG_DONTWAIT);
+                if (received_count <= 0) {
+                    break;
+                }
+                handle_datagram(datagram, static_cast<size_t>(received_count), now);
+            }
+        }
+        send_nacks(now);
+    }
+    
+    cout << "exited multicast receive thread" << endl;
+}
+
+void MulticastReceiver::handle_datagram(const char * datagram, size_t size, const SteadyClock::time_point & now) {
+    FragmentHeader header;
+    if (size < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, datagram, sizeof(header));
+    if (header.magic != fragment_magic || header.fragment_count == 0 || header.fragment_index >= header.fragment_count ||
+        header.fragment_count != (static_cast<size_t>(header.message_size) + fragment_payload - 1) / fragment_payload) {
+        return;
+    }
+    datagrams_received += 1;
+    if (header.message_size > max_message_size) {
+        // checked before anything is allocated for it
+        oversize_count += 1;
+        return;
+    }
+    
+    if (simulated_loss > 0 && rand() < simulated_loss * RAND_MAX) {
+        simulated_drops += 1;
+        return;
+    }
+    if (!have_session || header.session != session) {
+        // the sender restarted and counts from 1 again, nothing kept from before belongs to it
+        if (have_session) {
+            frames_lost += static_cast<long>(assemblies.size());
+            session_changes += 1;
+        }
+        session = header.session;
+        have_session = true;
+        assemblies.clear();
+        highest_sequence = 0;
+        last_delivered = 0;
+    }
+    if (header.sequence <= last_delivered) {
+        // a repair that another server asked for, or one that came too late
+        duplicate_count += 1;
+        return;
+    }
+    
+    // frames that never showed up at all are asked for as a whole
+    if (highest_sequence != 0 && header.sequence > highest_sequence + 1) {
+        uint32_t first_missing = max(highest_sequence + 1, header.sequence - static_cast<uint32_t>(max_assemblies));
+        for (uint32_t missing = first_missing; missing < header.sequence; missing++) {
+            if (assemblies.find(missing) == assemblies.end()) {
+                assemblies[missing].last_fragment = now;
+            }
+        }
+    }
+    highest_sequence = max(highest_sequence, header.sequence);
+    
+    Assembly & assembly = assemblies[header.sequence];
+    if (assembly.message_size == 0) {
+        assembly.message_size = header.message_size;
+        assembly.fragment_count = header.fragment_count;
+        assembly.received.assign(header.fragment_count, false);
+        assembly.bytes = make_shared<string>(header.message_size, '\0');
+    }
+    size_t offset = header.fragment_index * fragment_payload;
+    size_t length = size - sizeof(header);
+    if (header.message_size != assembly.message_size || header.fragment_count != assembly.fragment_count ||
+        offset + length > assembly.message_size) {
+        return;
+    }
+    assembly.last_fragment = now;
+    if (assembly.received[header.fragment_index]) {
+        duplicate_count += 1;
+        return;
+    }
+    memcpy(&(*assembly.bytes)[offset], datagram + sizeof(header), length);
+    assembly.received[header.fragment_index] = true;
+    assembly.received_count += 1;
+    if (assembly.received_count < assembly.fragment_count) {
+        return;
+    }
+    
+    // complete: the reassembly buffer becomes the payload, no further copy
+    PayloadView message;
+    message.owner = assembly.bytes;
+    message.data = assembly.bytes->data();
+    message.size = assembly.bytes->size();
+    MessageData * message_data = MessageData::from_view(message);
+    frames_completed += 1;
+    if (assembly.nack_count > 0) {
+        frames_repaired += 1;
+    }
+    last_delivered = header.sequence;
+    
+    // anything older can only be shown out of order now
+    for (auto it = assemblies.begin(); it != assemblies.end() && it->first <= header.sequence;) {
+        if (it->first != header.sequence) {
+            frames_lost += 1;
+        }
+        it = assemblies.erase(it);
+    }
+    
+    if (message_data && comm) {
+        comm->receive_external(message_data);
+    }
+    else {
+        delete message_data;
+    }
+}
+
+void MulticastReceiver::send_nacks(const SteadyClock::time_point & now) {
+    while (assemblies.size() > max_assemblies) {
+        assemblies.erase(assemblies.begin());
+        frames_lost += 1;
+    }
+    
+    for (auto it = assemblies.begin(); it != assemblies.end();) {
+        Assembly & assembly = it->second;
+        Seconds quiet = now - assembly.last_fragment;
+        Seconds since_nack = now - assembly.last_nack;
+        // backs off in case the repair is just queued behind a large frame
+        double retry_interval = nack_interval * (1 << min(assembly.nack_count, 8));
+        if (quiet.count() < nack_delay || (assembly.nack_count > 0 && since_nack.count() < retry_interval)) {
+            ++it;
+            continue;
+        }
+        if (assembly.nack_count >= max_nacks) {
+            frames_lost += 1;
+            it = assemblies.erase(it);
+            continue;
+        }
+        
+        string missing;
+        for (uint16_t i = 0; i < assembly.fragment_count; i++) {
+            if (!assembly.received[i]) {
+                missing.append(reinterpret_cast<const char *>(&i), sizeof(i));
+            }
+        }
+        fragments_requested += assembly.message_size == 0 ? 1 : static_cast<long>(missing.size() / sizeof(uint16_t));
+        if (comm) {
+            comm->send(new MessageData(MessageData::MessageType::NACK, to_string(session) + ":" + to_string(it->first), missing));
+        }
+        nacks_sent += 1;
+        assembly.nack_count += 1;
+        assembly.last_nack = now;
+        ++it;
+    }
+}
+
+void MulticastReceiver::dump(ofstream & out) {
+    lock_guard<mutex> guard(this->stats_mutex);
+    out << "multicast datagrams: " << datagrams_received << " duplicates: " << duplicate_count
+        << " simulated_drops: " << simulated_drops << " oversize: " << oversize_count << " session_changes: " << session_changes << endl;
+    out << "frames: " << frames_completed << " repaired: " << frames_repaired << " lost: " << frames_lost
+        << " nacks: " << nacks_sent << " fragments_requested: " << fragments_requested << endl;
+    if (datagrams_received > 0) {
+        out << "requested again: " << 100.0 * fragments_requested / datagrams_received << "% of datagrams" << endl;
+    }
+    if (frames_repaired + frames_lost > 0) {
+        out << "repair: " << 100.0 * frames_repaired / (frames_repaired + frames_lost) << "% of damaged frames" << endl;
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <chrono>
+
+#include "comms.h"
+
+// One-to-many frame distribution over UDP multicast.
+// A message is serialized as it would be for tcp, split into sequenced
+// datagrams and sent once to the group; every server reassembles it.
+// Missing fragments are requested with a NACK over the server's normal
+// tcp Comm connection and resent by the client from its recent history.
+
+// "239.255.0.1:5600" -> group and port; false if there's no port
+bool split_group_address(const string & address, string & group, string & port);
+
+class MulticastSender {
+public:
+    ~MulticastSender();
+    // interface_address picks the outgoing interface ("" = the default route)
+    bool open(const string & group, const string & port, const string & interface_address = "", int ttl = 1);
+    // sends the message to the group and disposes of it (honours auto_delete)
+    void send(MessageData * message_data);
+    // resend what a server's NACK asks for; clients have their Comms hand NACKs straight here as
+    // they arrive (Comm::set_multicast_sender), a frame loop would ask too late
+    void repair(const MessageData & nack);
+    void dump(ofstream & out);
+    
+    // frames kept for repair
+    size_t history_size = 16;
+    // datagrams are paced so a burst doesn't overrun the servers' socket buffers (0 = unpaced);
+    // the default is about a gigabit link
+    double max_bytes_per_second = 120e6;
+
+private:
+    struct SentFrame {
+        uint32_t sequence;
+        string header;
+        PayloadView payload;
+        // the CRC32C, when the message has one
+        string trailer;
+        uint16_t fragment_count;
+    };
+    
+    void send_fragment(const SentFrame & frame, uint16_t fragment_index);
+    
+    SOCKET sock_fd = -1;
+    sockaddr_storage group_addr;
+    socklen_t group_addr_size = 0;
+    uint32_t session = 0;
+    uint32_t next_sequence = 1;
+    mutex history_mutex;
+    deque<SentFrame> history;
+    SteadyClock::time_point pace_start;
+    double paced_bytes = 0;
+    
+    long frames_sent = 0;
+    long datagrams_sent = 0;
+    long nacks_received = 0;
+    long fragments_resent = 0;
+    long repair_misses = 0;
+    long stale_nacks = 0;
+};
+
+class MulticastReceiver {
+public:
+    ~MulticastReceiver();
+    bool open(const string & group, const string & port, const string & interface_address = "");
+    // complete frames are handed to comm as if it had received them; NACKs go out through it
+    void start(Comm * comm);
+    void stop();
+    void dump(ofstream & out);
+    
+    double nack_delay = 0.005;  // seconds of silence before asking for missing fragments
+    double nack_interval = 0.02;  // seconds before asking again for the same frame, doubled each time
+    int max_nacks = 5;  // then the frame is given up on
+    double simulated_loss = 0;  // fraction of datagrams to drop, for testing repair on loopback
+    // larger frames are dropped before anything is allocated for them
+    uint32_t max_message_size = 64 << 20;
+
+private:
+    struct Assembly {
+        uint32_t message_size = 0;  // 0 until a fragment of the frame has arrived
+        uint16_t fragment_count = 0;
+        uint16_t received_count = 0;
+        vector<bool> received;
+        shared_ptr<string> bytes;
+        SteadyClock::time_point last_fragment;
+        SteadyClock::time_point last_nack;
+        int nack_count = 0;
+    };
+    
+    void execute_receive();
+    void handle_datagram(const char * datagram, size_t size, const SteadyClock::time_point & now);
+    void send_nacks(const SteadyClock::time_point & now);
+    
+    SOCKET sock_fd = -1;
+    Comm * comm = nullptr;
+    thread * receive_thread = nullptr;
+    atomic<bool> keep_going{false};
+    map<uint32_t, Assembly> assemblies;
+    uint32_t session = 0;  // the sender's, from the fragments
+    bool have_session = false;
+    uint32_t highest_sequence = 0;
+    uint32_t last_delivered = 0;
+    
+    mutex stats_mutex;
+    long datagrams_received = 0;
+    long duplicate_count = 0;
+    long simulated_drops = 0;
+    long oversize_count = 0;
+    long session_changes = 0;
+    long frames_completed = 0;
+    long frames_repaired = 0;
+    long frames_lost = 0;
+    long nacks_sent = 0;
+    long fragments_requested = 0;
+};
+
+#endif // MULTICAST_H
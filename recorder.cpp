@@ -0,0 +1,232 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/mathematics.h>
+}
+
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#include "recorder.h"
+#include "thread_config.h"
+#include "timeline.h"
+
+using namespace std;
+
+// milliseconds since open(), so dropped frames leave a gap instead of speeding the recording up
+static const AVRational record_time_base = {1, 1000};
+
+static string av_error(int error) {
+    char buffer[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(error, buffer, sizeof(buffer));
+    return buffer;
+}
+
+Recorder::Recorder(int slot_count) : slots(static_cast<size_t>(max(2, slot_count))) {
+}
+
+Recorder::~Recorder() {
+    close();
+}
+
+bool Recorder::open(const string & pattern, int width, int height, double fps, double segment_seconds, long bit_rate) {
+    const AVCodec * codec = avcodec_find_encoder_by_name("libx264");
+    if (codec == nullptr) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    if (codec == nullptr) {
+        cerr << "no video encoder for recording" << endl;
+        return false;
+    }
+    int result = avformat_alloc_output_context2(&format, nullptr, "segment", pattern.c_str());
+    if (result < 0) {
+        cerr << "can't record to " << pattern << " " << av_error(result) << endl;
+        return false;
+    }
+
+    this->width = width;
+    this->height = height;
+    stream = avformat_new_stream(format, nullptr);
+    context = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (stream == nullptr || context == nullptr || frame == nullptr || packet == nullptr) {
+        cerr << "can't allocate a recorder" << endl;
+        return false;
+    }
+
+    context->width = width;
+    context->height = height;
+    context->pix_fmt = AV_PIX_FMT_YUV420P;
+    context->time_base = record_time_base;
+    context->framerate = av_d2q(fps > 0 ? fps : 30, 1000);
+    context->bit_rate = bit_rate;
+    // segments can only start on a keyframe
+    context->gop_size = max(1, static_cast<int>(fps * 2 + 0.5));
+    if (format->oformat->flags & AVFMT_GLOBALHEADER) {
+        context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    AVDictionary * codec_options = nullptr;
+    if (strcmp(codec->name, "libx264") == 0) {
+        // the display needs the cpu more than the archive needs the bytes
+        av_dict_set(&codec_options, "preset", "ultrafast", 0);
+    }
+    result = avcodec_open2(context, codec, &codec_options);
+    av_dict_free(&codec_options);
+    if (result < 0) {
+        cerr << "can't open recording encoder " << codec->name << " " << av_error(result) << endl;
+        return false;
+    }
+    avcodec_parameters_from_context(stream->codecpar, context);
+    stream->time_base = context->time_base;
+
+    AVDictionary * format_options = nullptr;
+    av_dict_set(&format_options, "segment_time", to_string(segment_seconds).c_str(), 0);
+    // each file plays on its own
+    av_dict_set(&format_options, "reset_timestamps", "1", 0);
+    result = avformat_write_header(format, &format_options);
+    av_dict_free(&format_options);
+    if (result < 0) {
+        cerr << "can't start recording " << pattern << " " << av_error(result) << endl;
+        return false;
+    }
+
+    frame->format = context->pix_fmt;
+    frame->width = width;
+    frame->height = height;
+    result = av_frame_get_buffer(frame, 0);
+    if (result < 0) {
+        cerr << "can't allocate a recording frame " << av_error(result) << endl;
+        return false;
+    }
+    int chroma_height = (height + 1) / 2;
+    memset(frame->data[1], 128, static_cast<size_t>(frame->linesize[1]) * chroma_height);
+    memset(frame->data[2], 128, static_cast<size_t>(frame->linesize[2]) * chroma_height);
+
+    // all the memory the recording will ever queue, up front
+    for (auto & slot : slots) {
+        slot.pixels.resize(static_cast<size_t>(width) * height);
+    }
+    start = SteadyClock::now();
+    record_thread = new thread(&Recorder::execute_record, this);
+    return true;
+}
+
+bool Recorder::submit(const unsigned char * pixels, size_t stride) {
+    TIMELINE_ZONE("record submit");
+    submitted_count += 1;
+    size_t write = head.load(memory_order_relaxed);
+    if (record_thread == nullptr || write - tail.load(memory_order_acquire) >= slots.size()) {
+        dropped_count += 1;
+        return false;
+    }
+    Slot & slot = slots[write % slots.size()];
+    for (int row = 0; row < height; row++) {
+        memcpy(&slot.pixels[static_cast<size_t>(row) * width], pixels + row * stride, width);
+    }
+    slot.submitted = SteadyClock::now();
+    head.store(write + 1, memory_order_release);
+    return true;
+}
+
+void Recorder::execute_record() {
+    ThreadConfig::enter(RECORD_THREAD);
+    while (true) {
+        size_t read = tail.load(memory_order_relaxed);
+        if (read == head.load(memory_order_acquire)) {
+            if (!keep_going) {
+                break;
+            }
+            // nothing to wait on without a lock, the ring is checked again in a couple of ms
+            ThreadConfig::sleep_for(chrono::milliseconds(2));
+            continue;
+        }
+        encode(&slots[read % slots.size()]);
+        tail.store(read + 1, memory_order_release);
+    }
+
+    // flush what the encoder still holds
+    if (avcodec_send_frame(context, nullptr) >= 0) {
+        write_packets();
+    }
+}
+
+void Recorder::encode(const Slot * slot) {
+    TIMELINE_ZONE("encode");
+    auto begin = SteadyClock::now();
+    int result = av_frame_make_writable(frame);
+    if (result < 0) {
+        cerr << "recording frame not writable " << av_error(result) << endl;
+        failed_count += 1;
+        return;
+    }
+    for (int row = 0; row < height; row++) {
+        memcpy(frame->data[0] + row * frame->linesize[0], &slot->pixels[static_cast<size_t>(row) * width], width);
+    }
+    chrono::duration<long long, milli> since_start = chrono::duration_cast<chrono::milliseconds>(slot->submitted - start);
+    frame->pts = max(last_pts + 1, since_start.count());
+    last_pts = frame->pts;
+
+    result = avcodec_send_frame(context, frame);
+    if (result < 0) {
+        cerr << "recording encode failed " << av_error(result) << endl;
+        failed_count += 1;
+        return;
+    }
+    write_packets();
+    recorded_count += 1;
+    auto now = SteadyClock::now();
+    encode_sd.increment(now, begin);
+    behind_sd.increment(now, slot->submitted);
+}
+
+void Recorder::write_packets() {
+    while (true) {
+        int result = avcodec_receive_packet(context, packet);
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF) {
+            return;
+        }
+        if (result < 0) {
+            cerr << "recording encode failed " << av_error(result) << endl;
+            failed_count += 1;
+            return;
+        }
+        byte_count += packet->size;
+        av_packet_rescale_ts(packet, context->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        // takes the packet's data, leaves it blank for the next one
+        result = av_interleaved_write_frame(format, packet);
+        if (result < 0) {
+            cerr << "recording write failed " << av_error(result) << endl;
+            failed_count += 1;
+        }
+    }
+}
+
+void Recorder::close() {
+    keep_going = false;
+    if (record_thread) {
+        record_thread->join();
+        delete record_thread;
+        record_thread = nullptr;
+        av_write_trailer(format);
+    }
+    avcodec_free_context(&context);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    // the segment muxer opens and closes its files itself
+    avformat_free_context(format);
+    format = nullptr;
+    stream = nullptr;
+}
+
+void Recorder::dump(ofstream & out, const string & label) {
+    Seconds elapsed = SteadyClock::now() - start;
+    double kbps = elapsed.count() > 0 ? byte_count * 8 / elapsed.count() / 1000 : 0;
+    out << label << " frames submitted: " << submitted_count << " recorded: " << recorded_count << " dropped: " << dropped_count
+        << " failed: " << failed_count << " queued: " << head.load() - tail.load() << "/" << slots.size() << " kbit/s: " << kbps << endl;
+    encode_sd.dump(out, label + " encode");
+    behind_sd.dump(out, label + " behind");
+}
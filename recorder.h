@@ -0,0 +1,76 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+
+#include "comms.h"
+
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVStream;
+struct AVFrame;
+struct AVPacket;
+
+// Archives what a display showed: the render loop submits each composed 8 bit frame,
+// a background thread encodes them (libx264 if present, else mpeg4) into a series of
+// files with libavformat's segment muxer.
+// The frames wait in a ring of slot_count preallocated slots shared without locks by the
+// one thread that submits and the one that encodes; when the encoder falls behind and
+// the ring is full, new frames are dropped, submit() never waits and memory stays put.
+class Recorder {
+public:
+    Recorder(int slot_count = 8);
+    // encodes what is still queued and closes the last file
+    ~Recorder();
+
+    // pattern names the files with a printf style segment number, e.g. "display_%03d.mkv";
+    // the extension picks the container. A new file starts every segment_seconds (at the next keyframe).
+    bool open(const string & pattern, int width, int height, double fps, double segment_seconds = 60, long bit_rate = 2000000);
+    // render thread: copies height rows of width bytes, stride apart; false if it was dropped
+    bool submit(const unsigned char * pixels, size_t stride);
+    void close();
+    void dump(ofstream & out, const string & label);
+
+private:
+    struct Slot {
+        vector<unsigned char> pixels;
+        SteadyClock::time_point submitted;
+    };
+
+    void execute_record();
+    void encode(const Slot * slot);
+    // hands the encoder's packets to the muxer
+    void write_packets();
+
+    vector<Slot> slots;
+    // both count up forever; head is only stored by submit(), tail only by the record thread
+    atomic<size_t> head{0};
+    atomic<size_t> tail{0};
+    atomic<bool> keep_going{true};
+    thread * record_thread = nullptr;
+
+    int width = 0;
+    int height = 0;
+    AVFormatContext * format = nullptr;
+    AVCodecContext * context = nullptr;
+    AVStream * stream = nullptr;
+    AVFrame * frame = nullptr;
+    AVPacket * packet = nullptr;
+    SteadyClock::time_point start;
+    long long last_pts = -1;
+
+    atomic<long> submitted_count{0};
+    atomic<long> dropped_count{0};
+    atomic<long> recorded_count{0};
+    atomic<long> failed_count{0};
+    atomic<long long> byte_count{0};
+    SD encode_sd;
+    // submit() to encoded, how far behind the recording runs
+    SD behind_sd;
+};
+
+#endif // RECORDER_H
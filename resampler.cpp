@@ -0,0 +1,115 @@
+extern "C" {
+#include <libswscale/swscale.h>
+#include <libavutil/pixfmt.h>
+}
+
+#include <string.h>
+#include <algorithm>
+
+#include "resampler.h"
+
+using namespace std;
+
+// at or beyond this much shrinking, bilinear skips source pixels and fine detail turns to moiré
+static const double area_min_factor = 1.5;
+
+Resampler::~Resampler() {
+    sws_freeContext(context);
+}
+
+// each destination sample is the rounded mean of a 2x2 block, channel by channel;
+// plain loops the compiler vectorizes
+template <typename Sample, int Channels>
+static void halve(const unsigned char * source, size_t source_stride, unsigned char * destination, int width, int height) {
+    for (int row = 0; row < height; row++) {
+        auto top = reinterpret_cast<const Sample *>(source + 2 * row * source_stride);
+        auto bottom = reinterpret_cast<const Sample *>(source + (2 * row + 1) * source_stride);
+        auto out = reinterpret_cast<Sample *>(destination) + static_cast<size_t>(row) * width * Channels;
+        for (int column = 0; column < width * Channels; column++) {
+            int left = column / Channels * 2 * Channels + column % Channels;
+            uint32_t sum = top[left] + top[left + Channels] + bottom[left] + bottom[left + Channels];
+            out[column] = static_cast<Sample>((sum + 2) >> 2);
+        }
+    }
+}
+
+static AVPixelFormat av_pixel_format(MessageData::PixelFormat pixel_format) {
+    switch (pixel_format) {
+        case MessageData::GRAY10:
+            return AV_PIX_FMT_GRAY10LE;
+        case MessageData::GRAY16:
+            return AV_PIX_FMT_GRAY16LE;
+        case MessageData::BGR8:
+            return AV_PIX_FMT_BGR24;
+        default:
+            return AV_PIX_FMT_GRAY8;
+    }
+}
+
+bool Resampler::resample(const char * source, int source_width, int source_height, size_t source_stride,
+                         char * destination, int width, int height, MessageData::PixelFormat pixel_format) {
+    if (source_width <= 0 || source_height <= 0 || width <= 0 || height <= 0) {
+        return false;
+    }
+    auto begin = SteadyClock::now();
+    auto source_bytes = reinterpret_cast<const unsigned char *>(source);
+    auto destination_bytes = reinterpret_cast<unsigned char *>(destination);
+    size_t row_bytes = width * MessageData::bytes_per_pixel(pixel_format);
+
+    if (source_width == width && source_height == height) {
+        for (int row = 0; row < height; row++) {
+            memcpy(destination_bytes + row * row_bytes, source_bytes + row * source_stride, row_bytes);
+        }
+        copied_count += 1;
+    }
+    else if (source_width == 2 * width && source_height == 2 * height) {
+        switch (pixel_format) {
+            case MessageData::GRAY10:
+            case MessageData::GRAY16:
+                halve<uint16_t, 1>(source_bytes, source_stride, destination_bytes, width, height);
+                break;
+            case MessageData::BGR8:
+                halve<uint8_t, 3>(source_bytes, source_stride, destination_bytes, width, height);
+                break;
+            default:
+                halve<uint8_t, 1>(source_bytes, source_stride, destination_bytes, width, height);
+                break;
+        }
+        halved_count += 1;
+    }
+    else {
+        double factor = max(static_cast<double>(source_width) / width, static_cast<double>(source_height) / height);
+        int flags = factor >= area_min_factor ? SWS_AREA : SWS_BILINEAR;
+        const uint8_t * source_planes[] = {source_bytes};
+        const int source_strides[] = {static_cast<int>(source_stride)};
+        uint8_t * destination_planes[] = {destination_bytes};
+        const int destination_strides[] = {static_cast<int>(row_bytes)};
+
+        lock_guard<mutex> guard(sws_mutex);
+        // the same context comes back as long as the sizes and method stay put
+        AVPixelFormat format = av_pixel_format(pixel_format);
+        context = sws_getCachedContext(context, source_width, source_height, format,
+                                       width, height, format, flags, nullptr, nullptr, nullptr);
+        if (context == nullptr) {
+            return false;
+        }
+        sws_scale(context, source_planes, source_strides, 0, source_height, destination_planes, destination_strides);
+        if (flags == SWS_AREA) {
+            area_count += 1;
+        }
+        else {
+            bilinear_count += 1;
+        }
+    }
+
+    lock_guard<mutex> guard(sd_mutex);
+    resample_sd.increment(SteadyClock::now(), begin);
+    return true;
+}
+
+void Resampler::dump(ofstream & out, const string & label) {
+    out << label << " copied: " << copied_count << " halved: " << halved_count << " area: " << area_count
+        << " bilinear: " << bilinear_count << endl;
+    lock_guard<mutex> guard(sd_mutex);
+    resample_sd.dump(out, label + " time");
+}
@@ -0,0 +1,40 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+
+#include "comms.h"
+
+struct SwsContext;
+
+// Scales images to another size, in any of MessageData's pixel formats, picking the method by the scale factor:
+// a copy when the size already matches, a 2x2 box filter when exactly halving,
+// otherwise libswscale with a cached SwsContext: area averaging when shrinking by 1.5x
+// or more (every source pixel counts, nothing aliases), bilinear for smaller steps and
+// for enlarging.
+// Safe to call from several threads; the swscale path takes turns.
+class Resampler {
+public:
+    ~Resampler();
+
+    // destination gets width x height pixels, rows back to back; false if a size is 0
+    bool resample(const char * source, int source_width, int source_height, size_t source_stride,
+                  char * destination, int width, int height, MessageData::PixelFormat pixel_format = MessageData::GRAY8);
+    void dump(ofstream & out, const string & label);
+
+private:
+    mutex sws_mutex;
+    SwsContext * context = nullptr;
+
+    atomic<long> copied_count{0};
+    atomic<long> halved_count{0};
+    atomic<long> area_count{0};
+    atomic<long> bilinear_count{0};
+    mutex sd_mutex;
+    SD resample_sd;
+};
+
+#endif // RESAMPLER_H
@@ -0,0 +1,333 @@
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <iostream>
+#include <new>
+
+#include "shm_ring.h"
+
+using namespace std;
+
+static const uint32_t ring_magic = 0x4d525232;  // "MRR2"
+static const size_t cache_line = 64;
+
+enum SlotState : uint32_t {
+    SLOT_FREE,
+    SLOT_FULL,
+    SLOT_READING
+};
+
+enum EndState : uint32_t {
+    END_NONE,
+    END_ATTACHED,
+    END_CLOSED
+};
+
+// std::atomic<uint32_t> is lock-free and layout compatible with uint32_t on
+// every platform we build for, so it can live in memory shared between processes
+struct ShmRing::Header {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t slot_stride;
+    // futex words: bumped whenever a slot is filled / freed
+    atomic<uint32_t> write_seq;
+    atomic<uint32_t> free_seq;
+    atomic<uint32_t> creator_state;
+    atomic<uint32_t> opener_state;
+};
+
+struct ShmRing::Slot {
+    atomic<uint32_t> state;
+    uint32_t reserved;
+    uint64_t length;
+    // the writer's count of messages before this one; slots fill in any order, they are read in this one
+    uint64_t sequence;
+    
+    char * data() { return reinterpret_cast<char *>(this) + sizeof(Slot); }
+};
+
+static size_t round_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+size_t ShmRing::header_stride() {
+    return round_up(sizeof(ShmRing::Header), cache_line);
+}
+
+static void futex_wait(atomic<uint32_t> * word, uint32_t expected, double timeout) {
+#ifdef __linux__
+    timespec wait_time;
+    wait_time.tv_sec = static_cast<time_t>(timeout);
+    wait_time.tv_nsec = static_cast<long>((timeout - wait_time.tv_sec) * 1e9);
+    // not FUTEX_PRIVATE: the waker is in the other process
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, &wait_time, nullptr, 0);
+#else
+    if (word->load() == expected) {
+        this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+#endif
+}
+
+static void futex_wake(atomic<uint32_t> * word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+ShmRing::ShmRing() {
+}
+
+ShmRing::~ShmRing() {
+    set_attached(false);
+#ifndef _WINDOWS
+    // views still held by the reader keep the mapping, see read()
+    if (owner) {
+        shm_unlink(name.c_str());
+    }
+#endif
+}
+
+ShmRing * ShmRing::create(const string & name, uint32_t slot_count, size_t slot_size) {
+#ifdef _WINDOWS
+    cerr << "shared memory transport isn't available on windows" << endl;
+    return nullptr;
+#else
+    // never taken over: it may belong to a server that is running
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        cerr << "shared memory " << name << " already exists: another server is using it, or one that crashed left it behind"
+             << " (remove /dev/shm" << name << ")" << endl;
+        return nullptr;
+    }
+    if (fd < 0) {
+        cerr << "shm_open " << name << " failed " << strerror(errno) << endl;
+        return nullptr;
+    }
+    
+    size_t slot_stride = round_up(sizeof(Slot) + slot_size, cache_line);
+    size_t size = header_stride() + slot_stride * slot_count;
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        cerr << "sizing shared memory " << name << " failed " << strerror(errno) << endl;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    
+    void * address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        cerr << "mapping shared memory " << name << " failed " << strerror(errno) << endl;
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    
+    ShmRing * ring = new ShmRing();
+    ring->name = name;
+    ring->owner = true;
+    ring->mapping = shared_ptr<void>(address, [size](void * mapped) { munmap(mapped, size); });
+    ring->header = new (address) Header();
+    ring->header->slot_count = slot_count;
+    ring->header->slot_size = slot_size;
+    ring->header->slot_stride = slot_stride;
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->slot_stride = slot_stride;
+    ring->header->write_seq = 0;
+    ring->header->free_seq = 0;
+    ring->header->creator_state = END_ATTACHED;
+    ring->header->opener_state = END_NONE;
+    for (uint32_t i = 0; i < slot_count; i++) {
+        Slot * slot = new (ring->slot(i)) Slot();
+        slot->state = SLOT_FREE;
+        slot->length = 0;
+        slot->sequence = 0;
+    }
+    // the opener checks the magic last, so it never sees a half built ring
+    atomic_thread_fence(memory_order_release);
+    ring->header->magic = ring_magic;
+    return ring;
+#endif
+}
+
+ShmRing * ShmRing::open(const string & name) {
+#ifdef _WINDOWS
+    return nullptr;
+#else
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    
+    struct stat shm_stat;
+    if (fstat(fd, &shm_stat) != 0 || static_cast<size_t>(shm_stat.st_size) < header_stride()) {
+        ::close(fd);
+        return nullptr;
+    }
+    
+    size_t size = static_cast<size_t>(shm_stat.st_size);
+    void * address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    
+    Header * header = static_cast<Header *>(address);
+    atomic_thread_fence(memory_order_acquire);
+    // the geometry is read once and checked; what the peer writes to the header later can't move a slot
+    uint32_t slot_count = header->slot_count;
+    size_t slot_size = header->slot_size;
+    size_t slot_stride = header->slot_stride;
+    if (header->magic != ring_magic || slot_count == 0 || slot_stride < sizeof(Slot) + slot_size ||
+        slot_stride > (size - header_stride()) / slot_count) {
+        munmap(address, size);
+        return nullptr;
+    }
+    
+    ShmRing * ring = new ShmRing();
+    ring->name = name;
+    ring->mapping = shared_ptr<void>(address, [size](void * mapped) { munmap(mapped, size); });
+    ring->header = header;
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->slot_stride = slot_stride;
+    ring->set_attached(true);
+    return ring;
+#endif
+}
+
+ShmRing::Slot * ShmRing::slot(uint64_t index) const {
+    char * base = reinterpret_cast<char *>(header) + header_stride();
+    return reinterpret_cast<Slot *>(base + (index % slot_count) * slot_stride);
+}
+
+size_t ShmRing::max_message_size() const {
+    return slot_size;
+}
+
+void ShmRing::set_attached(bool attached) {
+    if (header == nullptr) {
+        return;
+    }
+    auto & state = owner ? header->creator_state : header->opener_state;
+    state = attached ? END_ATTACHED : END_CLOSED;
+    // wake a peer blocked on either word so it notices
+    header->write_seq++;
+    header->free_seq++;
+    futex_wake(&header->write_seq);
+    futex_wake(&header->free_seq);
+}
+
+bool ShmRing::peer_attached() const {
+    return (owner ? header->opener_state : header->creator_state) == END_ATTACHED;
+}
+
+bool ShmRing::peer_closed() const {
+    return (owner ? header->opener_state : header->creator_state) == END_CLOSED;
+}
+
+bool ShmRing::write(const string & message_header, const char * payload, size_t payload_size, double timeout, const string & trailer) {
+    size_t length = message_header.size() + payload_size + trailer.size();
+    if (length > slot_size) {
+        cerr << "message of " << length << " bytes doesn't fit a " << slot_size << " byte shared memory slot" << endl;
+        return false;
+    }
+    
+    // any free slot will do: one the reader holds on to (an image that is still showing) doesn't
+    // stop the messages behind it
+    Slot * next = nullptr;
+    auto deadline = SteadyClock::now() + std::chrono::duration_cast<SteadyClock::duration>(Seconds(timeout));
+    while (true) {
+        uint32_t seq = header->free_seq.load(memory_order_acquire);
+        for (uint32_t i = 0; i < slot_count && next == nullptr; i++) {
+            Slot * candidate = slot(head + i);
+            if (candidate->state.load(memory_order_acquire) == SLOT_FREE) {
+                next = candidate;
+            }
+        }
+        if (next) {
+            break;
+        }
+        Seconds remaining = deadline - SteadyClock::now();
+        if (remaining.count() <= 0 || peer_closed()) {
+            return false;
+        }
+        futex_wait(&header->free_seq, seq, remaining.count());
+    }
+    
+    memcpy(next->data(), message_header.data(), message_header.size());
+    if (payload_size > 0) {
+        memcpy(next->data() + message_header.size(), payload, payload_size);
+    }
+    if (!trailer.empty()) {
+        memcpy(next->data() + message_header.size() + payload_size, trailer.data(), trailer.size());
+    }
+    next->length = length;
+    next->sequence = head;
+    next->state.store(SLOT_FULL, memory_order_release);
+    head += 1;
+    
+    header->write_seq.fetch_add(1, memory_order_release);
+    futex_wake(&header->write_seq);
+    return true;
+}
+
+bool ShmRing::read(PayloadView & message, double timeout) {
+    Slot * next = nullptr;
+    auto deadline = SteadyClock::now() + std::chrono::duration_cast<SteadyClock::duration>(Seconds(timeout));
+    while (true) {
+        uint32_t seq = header->write_seq.load(memory_order_acquire);
+        // usually the slot tail points at, unless the writer had to go around a held one
+        for (uint32_t i = 0; i < slot_count && next == nullptr; i++) {
+            Slot * candidate = slot(tail + i);
+            if (candidate->state.load(memory_order_acquire) == SLOT_FULL && candidate->sequence == tail) {
+                next = candidate;
+            }
+        }
+        if (next) {
+            break;
+        }
+        Seconds remaining = deadline - SteadyClock::now();
+        if (remaining.count() <= 0) {
+            return false;
+        }
+        futex_wait(&header->write_seq, seq, remaining.count());
+    }
+    
+    tail += 1;
+    size_t length = static_cast<size_t>(next->length);
+    if (length > slot_size) {
+        // a corrupt (or hostile) peer; the slot goes back without being looked at
+        cerr << "shared memory slot claims " << length << " bytes, more than its " << slot_size << endl;
+        next->state.store(SLOT_FREE, memory_order_release);
+        header->free_seq.fetch_add(1, memory_order_release);
+        futex_wake(&header->free_seq);
+        return false;
+    }
+    next->state.store(SLOT_READING, memory_order_relaxed);
+    
+    // the view frees the slot when the caller is done with it, which may be after
+    // later slots; the writer goes on with the other free ones meanwhile
+    Header * ring_header = header;
+    shared_ptr<void> ring_mapping = mapping;
+    message.owner = shared_ptr<const void>(next, [ring_header, ring_mapping](const void * done) {
+        auto done_slot = static_cast<Slot *>(const_cast<void *>(done));
+        done_slot->state.store(SLOT_FREE, memory_order_release);
+        ring_header->free_seq.fetch_add(1, memory_order_release);
+        futex_wake(&ring_header->free_seq);
+    });
+    message.data = next->data();
+    message.size = length;
+    return true;
+}
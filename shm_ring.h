@@ -0,0 +1,59 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+#include "comms.h"
+
+// One-way ring of fixed-size message slots in POSIX shared memory, for a
+// client and server on the same host (Comm addresses of the form shm://name).
+// The writer copies a serialized message into a free slot; the reader takes
+// them in the order they were written and gets a view straight into the slot,
+// which is handed back to the writer when the last reference to that view is
+// dropped, in any order. A view held on to only takes its own slot out of use.
+// Waiting uses futexes on the shared words (polling where futexes don't exist).
+class ShmRing {
+public:
+    ~ShmRing();
+    
+    // the server side creates the ring (and removes it again on delete)
+    static ShmRing * create(const string & name, uint32_t slot_count, size_t slot_size);
+    // nullptr if the ring doesn't exist (yet)
+    static ShmRing * open(const string & name);
+    
+    // false on timeout, or if the message doesn't fit in a slot
+    bool write(const string & header, const char * payload, size_t payload_size, double timeout, const string & trailer = string());
+    // false on timeout, or for a slot claiming more than slot_size bytes (it is dropped); on success
+    // message views the whole serialized message
+    bool read(PayloadView & message, double timeout);
+    
+    size_t max_message_size() const;
+    // lets the other side know this end is attached / gone
+    void set_attached(bool attached);
+    bool peer_attached() const;
+    bool peer_closed() const;
+
+private:
+    struct Header;
+    struct Slot;
+    
+    ShmRing();
+    Slot * slot(uint64_t index) const;
+    static size_t header_stride();
+    
+    string name;
+    bool owner = false;
+    // unmapped once the ring and every view into it are gone
+    shared_ptr<void> mapping;
+    Header * header = nullptr;
+    // the header's geometry as it was at create() or open()
+    uint32_t slot_count = 0;
+    size_t slot_size = 0;
+    size_t slot_stride = 0;
+    uint64_t head = 0;  // messages written
+    uint64_t tail = 0;  // messages read
+};
+
+#endif // SHM_RING_H
@@ -10,26 +10,54 @@
 #include <map>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
 
 
 #include "comms.h"
+#include "asset_cache.h"
+#include "frame_source.h"
+#include "multicast.h"
+#include "video_codec.h"
+#include "thread_config.h"
+
+#define DEFAULT_FPS .5 // 2 seconds per image
 
 void usage()
 {
-    cout << "usage: MRR_Pi_client_2 [-r repeat_count]  [-f fps] [-p port_number] [-i ip_address] [-p port_number] [-i ip_address] ..." << endl;
+    cout << "usage: MRR_Pi_client_2 [-r repeat_count]  [-f fps] [-w window] [-s source [-z frame_size] [-x frame_width] [-t pixel_format]] [-m group:port] [-c] [-v] [-e kbit/s] [-k preload_depth] [-T role=cores[:priority],...] [-l] [-p port_number] [-i ip_address] [-p port_number] [-i ip_address] ..." << endl;
     cout << endl;
     cout << "Sample MRR_Pi client code which sends images to one or more MRR_Pi servers." << endl;
     cout << "Each server is described by both a port_number and an ip_address," << endl;
     cout << "so the count of port_numbers must mach the count of ip_addresses," << endl;
     cout << "which are paired by their order in the command line." << endl;
-    cout << "If both MRR_Pi_Client_2 and MRR_Pi_server_2 are on the same machine, use 127.0.0.1 as the ip address." << endl;
+    cout << "If both MRR_Pi_Client_2 and MRR_Pi_server_2 are on the same machine, use 127.0.0.1 as the ip address," << endl;
+    cout << "or shm://name / unix:///path (matching the server's -i) to pass frames through shared memory or a unix socket;" << endl;
+    cout << "their port_number is ignored." << endl;
     cout << "Repeat_count defaults to 0 (loop forever), it is the total number of image files to send to each server, repeatedly picking from the 5 images in the 'raw' folder." << endl;
-    cout << "Default fps is 30" << endl;
+    cout << "Default fps is " << DEFAULT_FPS << endl;
+    cout << "Window is the most images that may be unacknowledged by a server, default 2 (0 = no flow control)." << endl;
+    cout << "A server that falls behind gets a lower frame rate and skipped frames instead of a growing queue." << endl;
+    cout << "A server that goes away is reconnected to automatically; once back it gets the newest image first." << endl;
+    cout << "Source plays a clip instead of the 'raw' stills: either one file of concatenated frames," << endl;
+    cout << "or a directory with one file per numbered frame. Frame_size defaults to 1024x768 bytes, frame_width to 1024;" << endl;
+    cout << "the server scales frames of another size to its display. Pixel_format is gray8 (the default), gray10, gray16" << endl;
+    cout << "(2 bytes per pixel, little endian) or bgr8 (3 bytes per pixel); -e needs gray8." << endl;
+    cout << "Group:port multicasts each frame once to every server (started with the same -m) instead of once per connection;" << endl;
+    cout << "all servers then show the same image, and the tcp connections only carry acks and repair requests." << endl;
+    cout << "Preload_depth > 0 pushes that many upcoming stills to each server in the background; the server stages them" << endl;
+    cout << "and a DISPLAY_NOW then shows one without waiting for the transfer (servers: -b sets the staging memory)." << endl;
+    cout << "-c sends an image a server has already seen as a 16 byte reference into its cache; it is only sent whole again on a miss." << endl;
+    cout << "-v adds a CRC32C of each image, which the server checks; images that fail it are dropped and counted." << endl;
+    cout << "-e encodes the frames as video (libx264 if present, else mpeg4) at that bit rate, one stream per server;" << endl;
+    cout << "the server decodes them on a thread of its own. Not with -m or -k." << endl;
+    cout << "-T pins each kind of thread to cores, a priority of 1-99 runs it SCHED_FIFO; roles main (the send loop), connect," << endl;
+    cout << "send, receive, multicast, prefetch (reads the clip ahead). -l locks all memory in RAM." << endl;
     cout << endl;
 
     cout << "sample command line (server is running on default port on localhost): ./MRR_Pi_client_2" << endl;
     cout << "sample command line (specify port and ip_address): ./MRR_Pi_client_2 -i 127.0.0.1 -p 5569" << endl;
     cout << "sample command line (two servers specified): ./MRR_Pi_client_2 -i 127.0.0.1 -p 5569 -i 127.0.0.1 -p 5570" << endl;
+    cout << "sample command line (multicast to two servers): ./MRR_Pi_client_2 -m 239.255.0.1:5600 -i 10.0.0.2 -p 5569 -i 10.0.0.3 -p 5569" << endl;
     cout << endl;
 }
 
@@ -48,32 +76,158 @@ Comm *comm_factory()
 int main(int argc, char *argv[])
 {
 
-    float fps = .5; // was30  1.1 seconds per image
+    float fps = DEFAULT_FPS;
+    int window = 2;
+    string source_path;
+    string multicast_address;
+    bool image_refs = false;
+    bool checksums = false;
+    bool lock_memory = false;
+    int preload_depth = 0;
+    long video_kbps = 0;
+    size_t frame_size = 1024 * 768;
+    int frame_width = 1024;
+    MessageData::PixelFormat pixel_format = MessageData::GRAY8;
     long loop_count = 0;
 
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+        {
+            image_refs = true;
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+            checksums = true;
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            lock_memory = true;
+        }
+    }
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+        {
+            fps = atof(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            window = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            source_path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            frame_size = strtoul(argv[i + 1], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-x") == 0)
+        {
+            frame_width = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            const char *names[] = {"gray8", "gray10", "gray16", "bgr8"};
+            int format = 0;
+            while (format < MessageData::PIXEL_FORMAT_COUNT && strcmp(argv[i + 1], names[format]) != 0)
+            {
+                format++;
+            }
+            if (format == MessageData::PIXEL_FORMAT_COUNT)
+            {
+                cout << "unknown pixel format " << argv[i + 1] << endl;
+                return -1;
+            }
+            pixel_format = static_cast<MessageData::PixelFormat>(format);
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            multicast_address = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            preload_depth = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-e") == 0)
+        {
+            video_kbps = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-T") == 0)
+        {
+            if (!ThreadConfig::parse(argv[i + 1]))
+            {
+                return -1;
+            }
+        }
+    }
+
+    // before the prefetch and Comm threads start, they take their placement as they do
+    ThreadConfig::enter(MAIN_THREAD);
+    if (lock_memory && !ThreadConfig::lock_memory())
+    {
+        return -1;
+    }
+
+    // the stills in 'raw' are all 1024x768
+    int frame_height = 768;
+    FrameSource *frame_source = nullptr;
+    if (!source_path.empty())
+    {
+        size_t row_bytes = frame_width * MessageData::bytes_per_pixel(pixel_format);
+        if (frame_width <= 0 || frame_size % row_bytes != 0)
+        {
+            cout << "frame_size " << frame_size << " isn't a whole number of " << row_bytes << " byte rows" << endl;
+            return -1;
+        }
+        frame_height = static_cast<int>(frame_size / row_bytes);
+    }
+    else
+    {
+        frame_width = 1024;
+        pixel_format = MessageData::GRAY8;
+    }
+    if (video_kbps > 0 && pixel_format != MessageData::GRAY8)
+    {
+        cout << "-e only encodes gray8 frames" << endl;
+        return -1;
+    }
+    if (!source_path.empty())
+    {
+        // read ahead about half a second of frames
+        frame_source = FrameSource::open(source_path, frame_size, max(4, (int)(fps / 2)));
+        if (frame_source == nullptr)
+        {
+            return -1;
+        }
+    }
+
     std::string connections[5] = {"x", "-i", "127.0.0.1", "-p", "5569"};
 
     char *argv_file[5];
 
-    std::string strr;
-    strr = "123";
-
     for (int i = 0; i < 5; i++)
     {
         argv_file[i] = new char[connections[i].length() + 1];
         strcpy(argv_file[i], connections[i].c_str());
     }
 
-    for (int i = 0; i < 5; i++)
+    // the servers on the command line (-i, each with its -p), the local one on 5569 if none are given
+    bool servers_given = false;
+    for (int i = 1; i < argc - 1; i++)
     {
-        std::cout << "XXXXXXXXXXXXXXXXXXXXXXXXXXXXX argc " << argv_file[i] << " " << endl;
+        if (strcmp(argv[i], "-i") == 0)
+        {
+            servers_given = true;
+        }
     }
 
     usage();
 
     auto blocking_send = Comm::NON_BLOCKING;
 
-    list<Comm *> comms = Comm::start_clients(nullptr, 5, argv_file, comm_factory);
+    list<Comm *> comms = servers_given ? Comm::start_clients(nullptr, argc, argv, comm_factory) : Comm::start_clients(nullptr, 5, argv_file, comm_factory);
     if (comms.empty())
     {
         return -1;
@@ -92,9 +246,63 @@ int main(int argc, char *argv[])
 
     for (auto comm : comms)
     {
+        comm->set_flow_control(window, fps);
+        comm->set_image_refs(image_refs);
+        comm->set_checksums(checksums);
         comm->send_start_timer();
     }
 
+    MulticastSender *multicast_sender = nullptr;
+    if (!multicast_address.empty())
+    {
+        string group, port;
+        multicast_sender = new MulticastSender();
+        if (!split_group_address(multicast_address, group, port) || !multicast_sender->open(group, port))
+        {
+            return -1;
+        }
+        // servers ask for the fragments they missed, repaired as the asks arrive
+        for (auto comm : comms)
+        {
+            comm->set_multicast_sender(multicast_sender);
+        }
+    }
+
+    // -e: each server gets a stream of its own, the frames it is sent depend on the ones before
+    struct VideoStream
+    {
+        VideoEncoder encoder;
+        long reconnects = 0;
+    };
+    map<Comm *, VideoStream> video_streams;
+    if (video_kbps > 0 && !multicast_sender && preload_depth == 0)
+    {
+        for (auto comm : comms)
+        {
+            if (!video_streams[comm].encoder.open(frame_width, frame_height, fps, video_kbps * 1000))
+            {
+                return -1;
+            }
+        }
+    }
+
+    // each file is mapped once, the views go to the sockets without being copied
+    AssetCache asset_cache;
+
+    // preload mode: the names each server has staged (or soon will), next to show first
+    map<Comm *, deque<string>> upcoming;
+    long preload_count = 0;
+    auto top_up = [&](Comm *comm)
+    {
+        while ((int)upcoming[comm].size() < preload_depth)
+        {
+            auto raw_filename = files[rand() % files_len];
+            auto preload_name = raw_filename + "__p" + to_string(++preload_count);
+            comm->send_preload(preload_name, asset_cache.get(raw_filename), frame_width, frame_height, pixel_format);
+            upcoming[comm].push_back(preload_name);
+        }
+    };
+
     SD blocking_sd;
     SD loop_sd;
     long late_count = 0;
@@ -106,16 +314,32 @@ int main(int argc, char *argv[])
     {
         loop_count++;
         // gather and process image here
-        list<string> images_to_send;
-        list<string> names_to_send;
+        // servers showing the same file share one message, see Comm::fan_out
+        map<string, list<Comm *>> comms_by_file;
+        // the clip keeps playing in real time, servers that skip a frame miss it
+        PayloadView clip_frame;
+        if (frame_source)
+        {
+            clip_frame = frame_source->next_frame();
+        }
+        // a multicast frame goes to every server, so they all get the same file
+        auto shared_filename = files[rand() % files_len];
         for (auto &comm : comms)
         {
-            // don't really have to load the file every time, but it simulates work being done
-            auto raw_filename = files[rand() % files_len];
-            string image_data = load_image(raw_filename);
-            images_to_send.push_back(image_data);
-            auto send_name = raw_filename + "__" + to_string(loop_count);
-            names_to_send.push_back(send_name);
+            // in preload mode nothing big goes out on time, see below
+            if (preload_depth > 0 && !frame_source && !multicast_sender)
+            {
+                break;
+            }
+            // a server that is behind skips this frame
+            if (!comm->ready_to_send())
+            {
+                continue;
+            }
+
+            // every server gets the same clip frame
+            auto raw_filename = frame_source ? string("frame") : multicast_sender ? shared_filename : files[rand() % files_len];
+            comms_by_file[raw_filename].push_back(comm);
         }
 
         // 'sleep' until it's time to send images
@@ -125,20 +349,80 @@ int main(int argc, char *argv[])
         Seconds elapsed = SteadyClock::now() - begin;
         if (elapsed.count() < goal)
         {
-            this_thread::sleep_for(std::chrono::duration<double>(goal - elapsed.count()));
+            ThreadConfig::sleep_for(Seconds(goal - elapsed.count()));
         }
 
         auto before_send = SteadyClock::now();
 
+        if (preload_depth > 0 && !frame_source && !multicast_sender)
+        {
+            for (auto comm : comms)
+            {
+                top_up(comm);
+                comm->send_display_now(upcoming[comm].front());
+                upcoming[comm].pop_front();
+                top_up(comm);
+            }
+        }
+
         // now send
-        for (auto &comm : comms)
+        for (auto &file_comms : comms_by_file)
         {
-            string image_data = images_to_send.front();
-            images_to_send.pop_front();
-            string send_name = names_to_send.front();
-            names_to_send.pop_front();
+            PayloadView image_data = frame_source ? clip_frame : asset_cache.get(file_comms.first);
+            auto send_name = file_comms.first + "__" + to_string(loop_count);
+
+            if (multicast_sender)
+            {
+                // sent once to the group; each server still acks over its own connection
+                auto now = SteadyClock::now();
+                for (auto comm : file_comms.second)
+                {
+                    if (comm->flow_control().window > 0)
+                    {
+                        comm->flow_control().sent(send_name, now);
+                    }
+                }
+                auto message_data = new MessageData(MessageData::MessageType::IMAGE, send_name, image_data);
+                message_data->width = static_cast<uint16_t>(frame_width);
+                message_data->height = static_cast<uint16_t>(frame_height);
+                message_data->pixel_format = pixel_format;
+                if (checksums)
+                {
+                    message_data->add_crc();
+                }
+                multicast_sender->send(message_data);
+            }
+            else if (!video_streams.empty())
+            {
+                for (auto comm : file_comms.second)
+                {
+                    auto &stream = video_streams[comm];
+                    // what was in flight when the link dropped is gone, start over from a keyframe
+                    if (comm->reconnects() != stream.reconnects)
+                    {
+                        stream.reconnects = comm->reconnects();
+                        stream.encoder.request_keyframe();
+                    }
+                    string packet = stream.encoder.encode(image_data);
+                    if (!packet.empty())
+                    {
+                        comm->send_video(send_name, packet);
+                    }
+                }
+            }
+            else
+            {
+                Comm::fan_out_image(file_comms.second, send_name, image_data, frame_width, frame_height, pixel_format);
+            }
+        }
 
-            comm->send_image(send_name, image_data);
+        // nothing else the servers send back is used
+        for (auto comm : comms)
+        {
+            while (auto message_data = comm->next_received())
+            {
+                delete message_data;
+            }
         }
 
         Seconds send_elapsed = SteadyClock::now() - before_send;
@@ -152,6 +436,37 @@ int main(int argc, char *argv[])
         out << "frame: " << loop_count + 1 << endl;
 
         loop_sd.dump(out, "loop");
+        asset_cache.dump(out);
+        if (multicast_sender)
+        {
+            multicast_sender->dump(out);
+        }
+        if (frame_source)
+        {
+            frame_source->dump(out);
+        }
+        ThreadConfig::dump(out, "threads");
+        for (auto comm : comms)
+        {
+            comm->flow_control().dump(out, comm->ip() + ":" + comm->port());
+            comm->dump_link(out, comm->ip() + ":" + comm->port());
+            if (image_refs)
+            {
+                comm->dump_image_refs(out, comm->ip() + ":" + comm->port());
+            }
+            if (checksums)
+            {
+                comm->dump_checksums(out, comm->ip() + ":" + comm->port());
+            }
+            if (!video_streams.empty())
+            {
+                video_streams[comm].encoder.dump(out, comm->ip() + ":" + comm->port());
+            }
+            if (preload_depth > 0)
+            {
+                comm->dump_preload(out, comm->ip() + ":" + comm->port());
+            }
+        }
         out.close();
         // end debugging
     }
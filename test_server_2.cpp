@@ -17,6 +17,14 @@
 // #include <pthread.h>
 
 #include "comms.h"
+#include "multicast.h"
+#include "video_codec.h"
+#include "recorder.h"
+#include "resampler.h"
+#include "thread_config.h"
+#include "message_trace.h"
+#include "timeline.h"
+#include "frame_governor.h"
 
 #define APPLY_LOW_PASS_FILTER true // low pass filter the noise Set to false to disable low-pass filtering
 
@@ -30,10 +38,22 @@
 
 #define OUTPUT_GAIN 1.8 // Adjust this value for output gain of the final image
 
-#define FADE_TIMER_TC 64 // Adjust this value for lenngth of fade
-
 #define FADE_TIME 38 // Adjust this value for lenngth of fade  nominal 38 frames
 
+#define MAX_FADE_LAYERS 8 // images fading in over each other at once, the oldest go beyond this
+
+#define OVERRUN_TIME .04 // a frame taking longer than this is reported, and with -z its timeline written
+
+#define OVERRUN_TIMELINE_GAP 10 // seconds between timelines written for overruns, the first shows where it started
+
+// set by SIGUSR1, the frame loop writes the timeline
+static volatile sig_atomic_t timeline_requested = 0;
+
+static void request_timeline(int)
+{
+    timeline_requested = 1;
+}
+
 inline bool ends_with(std::string const &value, std::string const &ending)
 {
     if (ending.size() > value.size())
@@ -41,6 +61,44 @@ inline bool ends_with(std::string const &value, std::string const &ending)
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+// images a client sends at another resolution are scaled to the display's as they come in,
+// on the thread that received them, so the render loop only ever sees display sized frames
+class DisplayComm : public Comm
+{
+public:
+    int display_width = 1024;
+    int display_height = 768;
+    Resampler resampler;
+
+protected:
+    void prepare_image(MessageData *message_data)
+    {
+        // without a geometry there is nothing to go by, the render loop shows it only if it fits exactly
+        size_t pixel_bytes = MessageData::bytes_per_pixel(message_data->pixel_format);
+        if (!message_data->has_geometry() ||
+            (message_data->width == display_width && message_data->height == display_height) ||
+            message_data->payload_size() < static_cast<size_t>(message_data->width) * message_data->height * pixel_bytes)
+        {
+            return;
+        }
+        TIMELINE_ZONE("resample");
+        string scaled(static_cast<size_t>(display_width) * display_height * pixel_bytes, '\0');
+        if (resampler.resample(message_data->payload_data(), message_data->width, message_data->height, message_data->width * pixel_bytes,
+                               &scaled[0], display_width, display_height, message_data->pixel_format))
+        {
+            message_data->payload = PayloadView();
+            message_data->image_data.swap(scaled);
+            message_data->width = static_cast<uint16_t>(display_width);
+            message_data->height = static_cast<uint16_t>(display_height);
+        }
+    }
+};
+
+Comm *display_comm_factory()
+{
+    return new DisplayComm();
+}
+
 void usage()
 {
     cout << "Sample MRR_Pi server code handling display and image messages." << endl;
@@ -48,21 +106,41 @@ void usage()
     cout << endl;
     cout << "usage: MRR_Pi_server" << endl;
     cout << "  [-p port number, range 1024 to 49151, default = " << Comm::default_port << " ]" << endl;
+    cout << "  [-i shm://name or unix:///path, use shared memory or a unix socket instead of tcp when the client is on the same machine]" << endl;
+    cout << "  [-c MB, cache for images a client (run with -c) sends by reference, default " << (Comm::image_cache_bytes >> 20) << ", 0 = off]" << endl;
+    cout << "  [-b MB, memory for images a client (run with -k) preloads ahead of their DISPLAY_NOW, default 64, 0 = off]" << endl;
+    cout << "  [-m group:port, also receive images multicast by the client (run with the same -m), missing pieces are requested over the tcp connection]" << endl;
+    cout << "  (frames from a client run with -e arrive encoded, they are decoded on a thread of their own)" << endl;
+    cout << "  (frames at another resolution are scaled to 1024x768 as they arrive; 8 bit grey, 10 and 16 bit grey and 8 bit BGR are shown as sent)" << endl;
+    cout << "  [-g rows, start the transition to an image while it is still arriving, staging it this many rows at a time; tcp and unix only, default 0 = off]" << endl;
+    cout << "  [-r pattern, record what is shown into a new file every minute, e.g. display_%03d.mkv; frames the encoder can't keep up with are dropped]" << endl;
+    cout << "  [-T role=cores[:priority],..., pin each kind of thread to cores, priority 1-99 runs it SCHED_FIFO; roles main (the frame loop), connect, send, receive, display, decode, record, multicast]" << endl;
+    cout << "  [-l, lock all memory in RAM]" << endl;
+    cout << "  [-q file, trace every message received (payloads once each) with its arrival time, for MRR_Pi_trace_replay]" << endl;
+    cout << "  [-H, headless: no window, frames are composed but not shown]" << endl;
+    cout << "  [-n frames, stop after this many frames]" << endl;
+    cout << "  [-F file, write each frame's interval and work time in ms, as csv]" << endl;
+    cout << "  [-G level, when frames run out of time mix more cheaply, down to level 1 (two layers at most) or 2 (also at half resolution),"
+            " and back up once there is time again; default 0 = off]" << endl;
+    cout << "  [-z, time each stage of each frame and the network threads; the last second is written as timeline_<port>_<frame>.json"
+            " (chrome://tracing or ui.perfetto.dev) when a frame overruns, everything kept on 't' or SIGUSR1]" << endl;
     cout << endl;
 
     cout << "sample command line (runs server on the default port): ./MRR_Pi_server" << endl;
     cout << "sample command line (specifies port): ./MRR_Pi_server -p 5577" << endl;
+    cout << "sample command line (shared memory, client run with -i shm://display_1): ./MRR_Pi_server -i shm://display_1" << endl;
+    cout << "sample command line (multicast): ./MRR_Pi_server -p 5577 -m 239.255.0.1:5600" << endl;
+    cout << "sample command line (transition starts while the image arrives): ./MRR_Pi_server -g 64" << endl;
+    cout << "sample command line (trace a session): ./MRR_Pi_server -q session.trace" << endl;
+    cout << "sample command line (replay it, client run as MRR_Pi_trace_replay -t session.trace): ./MRR_Pi_server -H -n 3000 -F frames.csv" << endl;
+    cout << "sample command line (where the overruns come from): ./MRR_Pi_server -z" << endl;
+    cout << "sample command line (keep frames on time on a slow display): ./MRR_Pi_server -G 2" << endl;
+    cout << "sample command line (frame loop alone on core 3, network on 0-2): ./MRR_Pi_server -T main=3:80,receive=0-2:60,send=0-2,connect=0-2 -l" << endl;
     cout << endl;
 }
 
 int main(int argc, char *argv[])
 {
-    int Fade_Timer = 0;
-    // int Fade_Timer_TC = 64; //  at  30 fps  64/30 seconds
-    // int Fade_Time = 38;
-    bool New_Image = false;
-    float Fade_Val = 0;
-
     float avg_sum = 0;
     int average_cnter = 0;
 
@@ -78,7 +156,6 @@ int main(int argc, char *argv[])
 
     // use memcopy to convert Jonathan's container to an opencv Mat   // had ame offset reults
     cv::Mat image1(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
-    cv::Mat image2(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
     // cv::Mat image_mixed(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
     // cv::Mat image_test(height, width, CV_8UC1);  // Create an empty cv::Mat with the desired dimensions
     cv::Mat transformedImg(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
@@ -104,44 +181,193 @@ int main(int argc, char *argv[])
 
     double fps = 30;
 
-    Comm *comm = Comm::start_server(nullptr, argc, argv);
+    string multicast_address;
+    long preload_mb = -1;
+    long ingest_band_rows = 0;
+    string record_pattern;
+    bool lock_memory = false;
+    bool headless = false;
+    bool timeline = false;
+    string trace_filename;
+    string frame_times_filename;
+    int max_degradation = 0;
+    long max_loop = std::numeric_limits<long>::max();
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            lock_memory = true;
+        }
+        else if (strcmp(argv[i], "-H") == 0)
+        {
+            headless = true;
+        }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            timeline = true;
+        }
+    }
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0)
+        {
+            multicast_address = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            Comm::image_cache_bytes = strtoul(argv[i + 1], nullptr, 10) << 20;
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            preload_mb = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-g") == 0)
+        {
+            ingest_band_rows = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            record_pattern = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-T") == 0)
+        {
+            if (!ThreadConfig::parse(argv[i + 1]))
+            {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            trace_filename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            max_loop = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-F") == 0)
+        {
+            frame_times_filename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-G") == 0)
+        {
+            max_degradation = atoi(argv[i + 1]);
+        }
+    }
+
+    // placed before any other thread starts, they all take their placement as they start
+    ThreadConfig::enter(MAIN_THREAD);
+    if (lock_memory && !ThreadConfig::lock_memory())
+    {
+        return -1;
+    }
+
+    // before the network threads start, so they record theirs too
+    if (timeline)
+    {
+        Timeline::enable();
+        signal(SIGUSR1, request_timeline);
+    }
+    auto last_overrun_timeline = SteadyClock::now() - Seconds(OVERRUN_TIMELINE_GAP);
+
+    // opened before the server starts, and hooked up as soon as it is listening
+    MessageTrace message_trace;
+    if (!trace_filename.empty() && !message_trace.open(trace_filename))
+    {
+        return -1;
+    }
+
+    Comm *comm = Comm::start_server(nullptr, argc, argv, display_comm_factory);
     if (comm == nullptr)
     {
         return -1;
     }
+    if (!trace_filename.empty())
+    {
+        comm->set_trace(&message_trace);
+    }
 
-    // for debugging
-    string files[] = {
-        "../raw/24-06-03-04-30-10.raw",
-        "../raw/24-06-03-04-31-09.raw",
-        "../raw/24-06-03-04-35-02.raw",
-        "../raw/24-06-03-04-32-06.raw",
-        "../raw/24-06-03-04-37-06.raw"};
-
-    // cache image data for later checking against incoming image data
-    std::unordered_map<std::string, string> file_strings;
-    for (auto &filename : files)
+    if (preload_mb >= 0)
+    {
+        comm->set_preload_budget(static_cast<size_t>(preload_mb) << 20);
+    }
+    if (ingest_band_rows > 0)
     {
-        file_strings[filename] = load_image(filename);
+        comm->set_ingest(width, ingest_band_rows);
+    }
+
+    // encoded on a thread of its own, the loop only copies each frame into its queue
+    Recorder *recorder = nullptr;
+    if (!record_pattern.empty())
+    {
+        recorder = new Recorder();
+        if (!recorder->open(record_pattern, width, height, fps))
+        {
+            return -1;
+        }
+    }
+
+    // frames sent to the group arrive through comm like any other image
+    MulticastReceiver multicast_receiver;
+    if (!multicast_address.empty())
+    {
+        string group, port;
+        if (!split_group_address(multicast_address, group, port) || !multicast_receiver.open(group, port))
+        {
+            return -1;
+        }
+        multicast_receiver.start(comm);
     }
-    // end debugging
 
     long image_count = 0;
-    long matched_count = 0;
-    long mismatched_count = 0;
     auto begin = SteadyClock::now();
 
-    long max_loop = std::numeric_limits<long>::max();
-
     SD loop_sd;
-    deque<MessageData *> cached_messages;
+    VideoDecoder video_decoder;
+    video_decoder.set_output_size(width, height);
+
+    // -g: the image still arriving, rows not in yet are the previous image's
+    shared_ptr<IngestFrame> ingest_frame;
+    string ingest_name;
+    size_t staged_rows = 0;
+    cv::Mat staged_image(height, width, CV_8UC1);
+
+    // the display's output channel: its noise, the parabolic lookup tables for gamma correction and the fade
+    Mixer mixer(image1.cols, image1.rows, NUM_OF_NOISE_FRAMES, APPLY_LOW_PASS_FILTER);
+    mixer.noiseWeight = NOISE_WEIGHT;
+    mixer.outputGain = OUTPUT_GAIN;
+    mixer.fadeFrames = FADE_TIME;
+    mixer.maxLayers = MAX_FADE_LAYERS;
+    // image1 is the newest image, the one the others are fading out under
+    mixer.push(image1, MessageData::GRAY8);
+    // steps the mixer's degradation down when a frame's work leaves too little of the frame time
+    vector<string> degradation_names;
+    for (int degradation = 0; degradation < Mixer::DEGRADATION_COUNT; degradation++)
+    {
+        degradation_names.push_back(Mixer::degradationName(static_cast<Mixer::Degradation>(degradation)));
+    }
+    FrameGovernor governor(1 / fps, degradation_names, max_degradation);
+    // the recording is grey, a colour display is converted for it
+    cv::Mat recorded_image;
 
-    // generate noise
-    std::vector<cv::Mat> noiseFrames = generateNoiseFrames(image1.cols, image1.rows, NUM_OF_NOISE_FRAMES, APPLY_LOW_PASS_FILTER);
-    //  Create the parabolic lookup table for gamma correction
-    cv::Mat lut = createParabolicLUT();
+    // an image is shown when it fills the display exactly, in whatever format it came
+    auto fits_display = [size](const MessageData *message_data)
+    {
+        return message_data->payload_size() == size * MessageData::bytes_per_pixel(message_data->pixel_format);
+    };
+    auto display_mat = [width, height](const MessageData *message_data)
+    {
+        return cv::Mat(height, width, mixerImageType(message_data->pixel_format), const_cast<char *>(message_data->payload_data()));
+    };
+
+    // one line per frame, to compare the distribution between builds on the same trace
+    std::ofstream frame_times;
+    if (!frame_times_filename.empty())
+    {
+        frame_times.open(frame_times_filename);
+        frame_times << "frame,interval_ms,work_ms" << endl;
+    }
 
-    if (FULLSCREEN_MODE)
+    if (FULLSCREEN_MODE && !headless)
     {
         cv::namedWindow("Grayscale Image 3", cv::WINDOW_NORMAL);
         cv::setWindowProperty("Grayscale Image 3", cv::WND_PROP_FULLSCREEN, cv::WINDOW_FULLSCREEN); // Set window to fullscreen
@@ -150,45 +376,120 @@ int main(int argc, char *argv[])
     for (long loop_count = 0; loop_count < max_loop; loop_count++)
     {
 
+        TIMELINE_ZONE("frame");
+        while (auto frame = comm->next_ingest())
+        {
+            // another resolution: shown once it's all in and scaled; staging is in 8 bit grey,
+            // so with anything else on screen the new image waits until it is all in too
+            if (frame->payload.size != static_cast<size_t>(size) || mixer.format() != MessageData::GRAY8)
+            {
+                continue;
+            }
+            // the transition starts now, from the image on screen to whatever rows are in
+            // (back to back frames: a layer still shows the last one staged, it keeps a copy)
+            if (mixer.shows(staged_image))
+            {
+                mixer.replace(staged_image, staged_image.clone());
+            }
+            image1.copyTo(staged_image);
+            image1 = staged_image;
+            mixer.push(staged_image, MessageData::GRAY8);
+            ingest_frame = frame;
+            ingest_name = frame->image_name;
+            staged_rows = 0;
+        }
+        if (ingest_frame)
+        {
+            size_t rows = min(ingest_frame->completed_rows(), static_cast<size_t>(height));
+            if (rows > staged_rows)
+            {
+                TIMELINE_ZONE("ingest copy");
+                memcpy(staged_image.ptr(static_cast<int>(staged_rows)), ingest_frame->payload.data + staged_rows * width, (rows - staged_rows) * width);
+                staged_rows = rows;
+            }
+            if (ingest_frame->complete() || ingest_frame->abandoned())
+            {
+                ingest_frame.reset();
+            }
+        }
+
         deque<MessageData *> to_delete;
         deque<MessageData *> received_messages;
-        while (auto message_data = comm->next_received())
+        // what came in since the last frame
         {
-            received_messages.push_back(message_data);
+            TIMELINE_ZONE("drain");
+            while (auto message_data = comm->next_received())
+            {
+                // encoded frames come back out of the decoder as IMAGEs
+                if (message_data->message_type == MessageData::MessageType::VIDEO)
+                {
+                    video_decoder.decode(message_data);
+                    continue;
+                }
+                received_messages.push_back(message_data);
+            }
+            while (auto message_data = video_decoder.next_decoded())
+            {
+                if (message_data->message_type == MessageData::MessageType::VIDEO)
+                {
+                    // it gave no frame, but the client is waiting for the ack to send the next one
+                    comm->send_ack(message_data->image_name);
+                    delete message_data;
+                    continue;
+                }
+                received_messages.push_back(message_data);
+            }
         }
 
         // loop here isn't strictly necessary, since images will probably arrive one at a time
         for (auto message_data : received_messages)
         {
+            TIMELINE_ZONE("image");
             bool do_delete = true; // delete messages that don't contain images
-            if (message_data->message_type == MessageData::MessageType::IMAGE)
+            // a DISPLAY_NOW for a preloaded image carries it, the transition starts without a transfer
+            bool staged = message_data->message_type == MessageData::MessageType::DISPLAY_NOW && message_data->payload_size() > 0;
+            if (message_data->message_type == MessageData::MessageType::IMAGE || staged)
             {
-                do_delete = false;
-                cached_messages.push_back(message_data);
+                // the client keeps only a few frames in flight, ack so it can send the next one
+                if (!staged)
+                {
+                    comm->send_ack(message_data->image_name);
+                }
 
                 // for debugging
-                cout << "got image '" << message_data->image_name << "' sz:" << message_data->image_data.size() << endl;
+                cout << "got image '" << message_data->image_name << "' sz:" << message_data->payload_size() << endl;
 
-                New_Image = true;
-
-                image_count += 1;
-
-                for (auto filename : files)
+                // a frame staged while it arrived already has its transition going
+                bool ingest_arrived = !staged && !ingest_name.empty() && message_data->image_name == ingest_name;
+                if (fits_display(message_data))
                 {
-                    if (message_data->image_name.find(filename) != string::npos)
+                    // the layer reads the payload in place (a memfd is never copied) and keeps the
+                    // message alive for as long as it shows; every layer holding a shared memory slot
+                    // could take all of the ring's, so those are copied out first
+                    do_delete = false;
+                    comm->keep_payload(message_data);
+                    shared_ptr<const void> owner(message_data);
+                    image1 = display_mat(message_data);
+                    if (ingest_arrived && message_data->pixel_format == MessageData::GRAY8)
+                    {
+                        // the same rows as staged_image, read in place from here on
+                        mixer.replace(staged_image, image1, owner);
+                    }
+                    else
                     {
-                        if (message_data->image_data == file_strings[filename])
-                        {
-                            matched_count += 1;
-                        }
-                        else
-                        {
-                            mismatched_count += 1;
-                        }
-                        break;
+                        // a new image fades in over whatever is still fading; one that was staged
+                        // as 8 bit grey but isn't starts over with what it really is
+                        ingest_frame.reset();
+                        ingest_name.clear();
+                        mixer.push(image1, message_data->pixel_format, owner);
                     }
                 }
-                // end debugging
+                if (ingest_arrived)
+                {
+                    ingest_name.clear();
+                }
+
+                image_count += 1;
             }
 
             if (do_delete)
@@ -197,42 +498,35 @@ int main(int argc, char *argv[])
             }
         }
 
-        while (cached_messages.size() > 2)
-        {
-            to_delete.push_back(cached_messages.front());
-            cached_messages.pop_front();
-        }
-
         // delete unwanted messages
         for (auto message_data : to_delete)
         {
+            TIMELINE_ZONE("delete");
             cout << "deleting ty:" << message_data->message_type << " " << message_data->image_name << endl;
             delete message_data;
         }
 
-        if (New_Image)
+        auto mix_begin = SteadyClock::now();
+        transformedImg = mixer.mix();
+        Seconds mix_time = SteadyClock::now() - mix_begin;
+
+        if (recorder && transformedImg.channels() == 1)
         {
-            Fade_Timer = 0;
-            // image2 = image1.clone();
-            memcpy(image2.data, cached_messages[0]->image_data.c_str(), size * sizeof(uchar));
-            if (cached_messages.size() > 1)
-            {
-                memcpy(image1.data, cached_messages[1]->image_data.c_str(), size * sizeof(uchar));
-            }
-            New_Image = false;
-            Fade_Val = 0;
+            recorder->submit(transformedImg.data, transformedImg.step);
         }
-        else if (Fade_Timer < FADE_TIMER_TC)
+        else if (recorder)
         {
-            Fade_Timer++;
-            Fade_Val = (float)(Fade_Timer <= FADE_TIME ? Fade_Timer : FADE_TIME) / (float)FADE_TIME;
+            cv::cvtColor(transformedImg, recorded_image, cv::COLOR_BGR2GRAY);
+            recorder->submit(recorded_image.data, recorded_image.step);
         }
 
-        blendImagesAndNoise(image1, image2, noiseFrames, transformedImg, lut, Fade_Val, NOISE_WEIGHT, OUTPUT_GAIN);
-
 
         end_check_2 = std::chrono::high_resolution_clock::now();
         elapsed_2 = end_check_2 - start_check_2;
+        if (max_degradation > 0)
+        {
+            mixer.degradation = static_cast<Mixer::Degradation>(governor.update(elapsed_2.count(), mix_time.count(), SteadyClock::now()));
+        }
         average_cnter++;
         if( average_cnter >= 30)
         {
@@ -249,45 +543,111 @@ int main(int argc, char *argv[])
         Seconds elapsed = SteadyClock::now() - begin;
         if (elapsed.count() < goal)
         {
-            this_thread::sleep_for(std::chrono::duration<double>(goal - elapsed.count()));
+            TIMELINE_ZONE("pace");
+            ThreadConfig::sleep_for(Seconds(goal - elapsed.count()));
         }
 
         start_check_2 = std::chrono::high_resolution_clock::now();
 
         // display images code here
         // Display the image
-        cv::imshow("Grayscale Image 3", transformedImg);
-        // cv::imshow("Grayscale Image 3", image_mixed);
+        if (!headless)
+        {
+            {
+                TIMELINE_ZONE("imshow");
+                cv::imshow("Grayscale Image 3", transformedImg);
+            }
+            // cv::imshow("Grayscale Image 3", image_mixed);
 
-        // needed for opencv loop
-        int key = cv::waitKey(1);
-        if (key == 27)
-        { // ASCII code for the escape key
-            break;
+            // needed for opencv loop
+            int key;
+            {
+                TIMELINE_ZONE("waitKey");
+                key = cv::waitKey(1);
+            }
+            if (key == 27)
+            { // ASCII code for the escape key
+                break;
+            }
+            if (key == 't')
+            {
+                timeline_requested = 1;
+            }
         }
 
         // check for long frame times
         end_check = std::chrono::high_resolution_clock::now();
         elapsed = end_check - start_check;
         start_check = std::chrono::high_resolution_clock::now();
-        if (elapsed.count() > .04)
+        if (elapsed.count() > OVERRUN_TIME)
+        {
             cout << "XXXXXXXXXXXXXXXXXX  " << elapsed.count() << endl;
+            // the second up to it; overruns often come in runs, one file shows how the run started
+            if (timeline && SteadyClock::now() - last_overrun_timeline > Seconds(OVERRUN_TIMELINE_GAP) &&
+                Timeline::write_chrome("timeline_" + comm->port() + "_" + to_string(loop_count) + ".json", 1))
+            {
+                last_overrun_timeline = SteadyClock::now();
+            }
+        }
+        if (timeline_requested)
+        {
+            timeline_requested = 0;
+            Timeline::write_chrome("timeline_" + comm->port() + "_" + to_string(loop_count) + ".json");
+        }
 
 
         // for debugging
         auto current = SteadyClock::now();
-        loop_sd.increment(current);
+        double interval = loop_sd.increment(current);
+        if (frame_times.is_open() && loop_count > 0)
+        {
+            frame_times << loop_count << "," << interval * 1000 << "," << elapsed_2.count() * 1000 << "\n";
+        }
         // for debugging
         elapsed = current - begin;
+        TIMELINE_ZONE("counters");
         std::ofstream out("server_counter_2_" + comm->port() + ".txt");
         out << "t:" << elapsed.count() << "s" << endl;
         out << "images_rec'd: " << image_count << endl;
-        out << "match: " << matched_count << endl;
-        out << "mismatch: " << mismatched_count << endl;
+        // images from a client run with -v carry a CRC32C, the ones that fail it never get here
+        comm->dump_checksums(out, "integrity");
         loop_sd.dump(out, "loop");
+        comm->dump_link(out, "link");
+        comm->dump_image_refs(out, "image refs");
+        comm->dump_preload(out, "preload");
+        mixer.dump(out, "mixer");
+        if (max_degradation > 0)
+        {
+            governor.dump(out, "governor");
+        }
+        video_decoder.dump(out, "decoder");
+        static_cast<DisplayComm *>(comm)->resampler.dump(out, "resample");
+        if (!trace_filename.empty())
+        {
+            message_trace.dump(out, "trace");
+        }
+        if (timeline)
+        {
+            Timeline::dump(out, "timeline");
+        }
+        ThreadConfig::dump(out, "threads");
+        if (recorder)
+        {
+            recorder->dump(out, "recorder");
+        }
+        if (!multicast_address.empty())
+        {
+            multicast_receiver.dump(out);
+        }
         out.close();
         // end debugging
     }
 
+    // finishes the file being written
+    delete recorder;
+    comm->set_trace(nullptr);
+    message_trace.close();
+    Timeline::close();
+
     return 0;
 }
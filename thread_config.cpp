@@ -0,0 +1,335 @@
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#ifndef _WINDOWS
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "thread_config.h"
+
+using namespace std;
+
+static const char * const role_names[THREAD_ROLE_COUNT] = {
+    "main", "connect", "send", "receive", "display", "decode", "record", "multicast", "prefetch", "trace"
+};
+
+struct Placement {
+    vector<int> cores;  // empty = any
+    int priority = 0;  // SCHED_FIFO priority, 0 = the normal scheduler
+};
+
+struct RoleStats {
+    atomic<long> thread_count{0};
+    atomic<long> placement_failures{0};
+    // switches of the role's threads that have ended or moved on to another role
+    long voluntary = 0;
+    long involuntary = 0;
+    atomic<long> sleep_count{0};
+    atomic<long long> late_ns{0};
+    atomic<long long> latest_ns{0};
+};
+
+// a thread that has entered a role, with its switch counts at that point
+struct LiveThread {
+    ThreadRole role;
+    long voluntary;
+    long involuntary;
+};
+
+static Placement placements[THREAD_ROLE_COUNT];
+static RoleStats role_stats[THREAD_ROLE_COUNT];
+static bool memory_locked = false;
+// guards placements once threads are running, live_threads and the ended switch counts
+static mutex threads_mutex;
+static map<long, LiveThread> live_threads;  // by thread id
+
+static long thread_id() {
+#ifdef __linux__
+    return static_cast<long>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+
+// the calling thread's context switches so far
+static void own_switches(long & voluntary, long & involuntary) {
+    voluntary = 0;
+    involuntary = 0;
+#ifdef __linux__
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        voluntary = usage.ru_nvcsw;
+        involuntary = usage.ru_nivcsw;
+    }
+#endif
+}
+
+// another thread's, from its /proc status
+static void task_switches(long tid, long & voluntary, long & involuntary) {
+    static const string voluntary_key("voluntary_ctxt_switches:");
+    static const string involuntary_key("nonvoluntary_ctxt_switches:");
+    voluntary = 0;
+    involuntary = 0;
+    ifstream status("/proc/self/task/" + to_string(tid) + "/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, voluntary_key.size(), voluntary_key) == 0) {
+            voluntary = atol(line.c_str() + voluntary_key.size());
+        }
+        else if (line.compare(0, involuntary_key.size(), involuntary_key) == 0) {
+            involuntary = atol(line.c_str() + involuntary_key.size());
+        }
+    }
+}
+
+// one per thread: counts the switches of the role it is in when it enters another or ends
+struct ThreadRecord {
+    ThreadRole role = THREAD_ROLE_COUNT;
+    long tid = 0;
+
+    ~ThreadRecord() {
+        leave();
+    }
+
+    void leave() {
+        if (role == THREAD_ROLE_COUNT) {
+            return;
+        }
+        long voluntary, involuntary;
+        own_switches(voluntary, involuntary);
+        lock_guard<mutex> guard(threads_mutex);
+        auto found = live_threads.find(tid);
+        if (found != live_threads.end()) {
+            role_stats[role].voluntary += voluntary - found->second.voluntary;
+            role_stats[role].involuntary += involuntary - found->second.involuntary;
+            live_threads.erase(found);
+        }
+        role = THREAD_ROLE_COUNT;
+    }
+};
+
+static thread_local ThreadRecord this_thread_record;
+
+// "3", "0-2" or "1+3"
+static bool parse_cores(const string & text, vector<int> & cores) {
+    cores.clear();
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = min(text.find('+', start), text.size());
+        string part = text.substr(start, end - start);
+        char * rest = nullptr;
+        long first = strtol(part.c_str(), &rest, 10);
+        long last = first;
+        if (rest != part.c_str() && *rest == '-') {
+            const char * second = rest + 1;
+            last = strtol(second, &rest, 10);
+            if (rest == second) {
+                return false;
+            }
+        }
+        if (part.empty() || *rest != '\0' || first < 0 || last < first || last >= 1024) {
+            return false;
+        }
+        for (long core = first; core <= last; core++) {
+            cores.push_back(static_cast<int>(core));
+        }
+        start = end + 1;
+    }
+    return !cores.empty();
+}
+
+bool ThreadConfig::parse(const string & spec) {
+    Placement parsed[THREAD_ROLE_COUNT];
+    size_t start = 0;
+    while (start < spec.size()) {
+        size_t end = min(spec.find(',', start), spec.size());
+        string item = spec.substr(start, end - start);
+        start = end + 1;
+        size_t equals = item.find('=');
+        if (equals == string::npos) {
+            cerr << "thread placement '" << item << "' isn't role=cores[:priority]" << endl;
+            return false;
+        }
+        string name = item.substr(0, equals);
+        int role = 0;
+        while (role < THREAD_ROLE_COUNT && name != role_names[role]) {
+            role++;
+        }
+        if (role == THREAD_ROLE_COUNT) {
+            cerr << "unknown thread role '" << name << "'" << endl;
+            return false;
+        }
+        string cores = item.substr(equals + 1);
+        size_t colon = cores.find(':');
+        if (colon != string::npos) {
+            char * rest = nullptr;
+            string priority = cores.substr(colon + 1);
+            parsed[role].priority = static_cast<int>(strtol(priority.c_str(), &rest, 10));
+            if (priority.empty() || *rest != '\0' || parsed[role].priority < 1 || parsed[role].priority > 99) {
+                cerr << "thread priority for " << name << " must be 1 to 99" << endl;
+                return false;
+            }
+            cores.resize(colon);
+        }
+        // "main=:80" only sets the priority
+        if (!cores.empty() && !parse_cores(cores, parsed[role].cores)) {
+            cerr << "can't read cores '" << cores << "' for " << name << endl;
+            return false;
+        }
+    }
+
+    lock_guard<mutex> guard(threads_mutex);
+    for (int role = 0; role < THREAD_ROLE_COUNT; role++) {
+        placements[role] = parsed[role];
+    }
+    return true;
+}
+
+bool ThreadConfig::lock_memory() {
+#ifdef _WINDOWS
+    cerr << "locking memory isn't supported on windows" << endl;
+    return false;
+#else
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        cerr << "can't lock memory: " << strerror(errno) << " (needs CAP_IPC_LOCK or a big enough ulimit -l)" << endl;
+        return false;
+    }
+    memory_locked = true;
+    return true;
+#endif
+}
+
+void ThreadConfig::enter(ThreadRole role) {
+    this_thread_record.leave();
+    Placement placement;
+    LiveThread live;
+    live.role = role;
+    own_switches(live.voluntary, live.involuntary);
+    this_thread_record.role = role;
+    this_thread_record.tid = thread_id();
+    {
+        lock_guard<mutex> guard(threads_mutex);
+        placement = placements[role];
+        live_threads[this_thread_record.tid] = live;
+    }
+    RoleStats & stats = role_stats[role];
+    stats.thread_count += 1;
+
+    // a failure is reported once per role, the others go the same way
+    bool failed = false;
+    string reason;
+#ifdef __linux__
+    if (!placement.cores.empty()) {
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        for (int core : placement.cores) {
+            CPU_SET(core, &cores);
+        }
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+        if (result != 0) {
+            failed = true;
+            reason = string("can't pin to its cores: ") + strerror(result);
+        }
+    }
+    if (placement.priority > 0) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = placement.priority;
+        int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (result != 0) {
+            failed = true;
+            reason = string("can't run SCHED_FIFO: ") + strerror(result) + (result == EPERM ? " (needs CAP_SYS_NICE or an rtprio limit)" : "");
+        }
+    }
+#else
+    if (!placement.cores.empty() || placement.priority > 0) {
+        failed = true;
+        reason = "thread placement is only supported on linux";
+    }
+#endif
+    if (failed && stats.placement_failures++ == 0) {
+        cerr << role_names[role] << " thread " << reason << endl;
+    }
+}
+
+ThreadRole ThreadConfig::role() {
+    return this_thread_record.role;
+}
+
+void ThreadConfig::sleep_for(const Seconds & duration) {
+    auto begin = SteadyClock::now();
+    this_thread::sleep_for(duration);
+    ThreadRole role = this_thread_record.role;
+    if (role == THREAD_ROLE_COUNT) {
+        return;
+    }
+    auto late = chrono::duration_cast<chrono::nanoseconds>(SteadyClock::now() - begin - duration).count();
+    late = max(late, static_cast<decltype(late)>(0));
+    RoleStats & stats = role_stats[role];
+    stats.sleep_count += 1;
+    stats.late_ns += late;
+    // the role's threads may race to raise it
+    long long latest = stats.latest_ns.load(memory_order_relaxed);
+    while (late > latest && !stats.latest_ns.compare_exchange_weak(latest, late, memory_order_relaxed)) {
+    }
+}
+
+void ThreadConfig::dump(ofstream & out, const string & label) {
+    long voluntary[THREAD_ROLE_COUNT] = {0};
+    long involuntary[THREAD_ROLE_COUNT] = {0};
+    long running[THREAD_ROLE_COUNT] = {0};
+    Placement placement[THREAD_ROLE_COUNT];
+    {
+        lock_guard<mutex> guard(threads_mutex);
+        for (auto & entry : live_threads) {
+            long thread_voluntary, thread_involuntary;
+            task_switches(entry.first, thread_voluntary, thread_involuntary);
+            ThreadRole role = entry.second.role;
+            voluntary[role] += max(0L, thread_voluntary - entry.second.voluntary);
+            involuntary[role] += max(0L, thread_involuntary - entry.second.involuntary);
+            running[role] += 1;
+        }
+        for (int role = 0; role < THREAD_ROLE_COUNT; role++) {
+            voluntary[role] += role_stats[role].voluntary;
+            involuntary[role] += role_stats[role].involuntary;
+            placement[role] = placements[role];
+        }
+    }
+
+    out << label << " memory locked: " << (memory_locked ? "yes" : "no") << endl;
+    for (int role = 0; role < THREAD_ROLE_COUNT; role++) {
+        RoleStats & stats = role_stats[role];
+        if (stats.thread_count == 0) {
+            continue;
+        }
+        string cores;
+        for (int core : placement[role].cores) {
+            cores += (cores.empty() ? "" : "+") + to_string(core);
+        }
+        long sleeps = stats.sleep_count;
+        double late_ms = sleeps > 0 ? stats.late_ns / 1e6 / sleeps : 0;
+        out << label << " " << role_names[role] << " cores: " << (cores.empty() ? "any" : cores)
+            << " fifo: " << placement[role].priority << " threads: " << stats.thread_count << " running: " << running[role]
+            << " placement failures: " << stats.placement_failures << " switches voluntary: " << voluntary[role]
+            << " involuntary: " << involuntary[role] << " sleeps: " << sleeps << " late ms mean: " << late_ms
+            << " max: " << stats.latest_ns / 1e6 << endl;
+    }
+}
+
+const char * ThreadConfig::role_name(ThreadRole role) {
+    return role < THREAD_ROLE_COUNT ? role_names[role] : "none";
+}
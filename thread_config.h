@@ -0,0 +1,49 @@
+#ifndef THREAD_CONFIG_H
+#define THREAD_CONFIG_H
+
+#include <string>
+#include <fstream>
+
+#include "comms.h"
+
+// what a thread is there for; placement and the numbers in dump() go by this
+enum ThreadRole {
+    MAIN_THREAD,  // the server's frame loop, the client's send loop
+    CONNECT_THREAD,
+    SEND_THREAD,
+    RECEIVE_THREAD,
+    DISPLAY_THREAD,
+    DECODE_THREAD,
+    RECORD_THREAD,
+    MULTICAST_THREAD,
+    PREFETCH_THREAD,
+    TRACE_THREAD,
+    THREAD_ROLE_COUNT
+};
+
+// The cores each role may run on and how it is scheduled, e.g. on a 4 core Pi the frame loop
+// alone on core 3 under SCHED_FIFO with the network threads kept to the others, so a burst of
+// packets can't preempt the compositor when a frame is due. Configured once, before any Comm
+// connects; every thread calls enter() with its role as it starts and takes its placement from
+// there. Roles nobody configured keep the normal scheduler and every core.
+// Per role it counts context switches, voluntary (the thread waited) and involuntary (something
+// else got the core), and how late threads woke from sleep_for(). Linux only; elsewhere
+// placements are refused and only the wake up times are counted.
+class ThreadConfig {
+public:
+    // comma separated role=cores[:priority], cores as 3, 0-2 or 1+3, priority 1-99 for SCHED_FIFO,
+    // e.g. "main=3:80,receive=2:60,send=0-2,connect=0-2"; false (and nothing changed) if it doesn't parse
+    static bool parse(const string & spec);
+    // keeps every page of the process in RAM, now and from now on, so a page fault can't stall a frame
+    static bool lock_memory();
+    // the calling thread has role from now on: its placement is applied and its context switches counted
+    static void enter(ThreadRole role);
+    // the calling thread's, THREAD_ROLE_COUNT if it hasn't entered one
+    static ThreadRole role();
+    // this_thread::sleep_for, counting how far past duration the calling thread woke
+    static void sleep_for(const Seconds & duration);
+    static void dump(ofstream & out, const string & label);
+    static const char * role_name(ThreadRole role);
+};
+
+#endif // THREAD_CONFIG_H
@@ -0,0 +1,187 @@
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#include "timeline.h"
+#include "thread_config.h"
+
+using namespace std;
+
+atomic<bool> Timeline::on{false};
+
+// A slot is written with relaxed stores between two of its sequence: 0 while it is being written,
+// then the index of the zone in it + 1. A reader copying a slot out checks the sequence didn't change
+// under it, so a slot overwritten while it was read is skipped rather than read torn.
+struct TimelineSlot {
+    atomic<uint64_t> sequence{0};
+    atomic<const char *> name{nullptr};
+    atomic<int64_t> begin{0};  // ns on the steady clock
+    atomic<int64_t> end{0};
+    atomic<uint32_t> thread_number{0};
+};
+
+struct TimelineEvent {
+    const char * name;
+    int64_t begin;
+    int64_t end;
+    uint32_t thread_number;
+};
+
+static TimelineSlot * slots = nullptr;
+static uint64_t slot_mask = 0;
+static atomic<uint64_t> next_index{0};
+
+// thread numbers are indexes into thread_names
+static mutex threads_mutex;
+static vector<string> thread_names;
+
+static mutex writer_mutex;
+static thread * writer = nullptr;
+static atomic<bool> writing{false};
+static atomic<long> file_count{0};
+static atomic<long> busy_count{0};
+static atomic<long> written_events{0};
+static SD write_sd;
+
+static int64_t steady_ns(const SteadyClock::time_point & time) {
+    return chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// the first zone a thread records names it, by the role it is in then
+static uint32_t register_thread() {
+    lock_guard<mutex> guard(threads_mutex);
+    thread_names.push_back(string(ThreadConfig::role_name(ThreadConfig::role())) + " " + to_string(thread_names.size()));
+    return static_cast<uint32_t>(thread_names.size() - 1);
+}
+
+void Timeline::enable(size_t capacity) {
+    if (slots != nullptr) {
+        return;
+    }
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    slots = new TimelineSlot[rounded];
+    slot_mask = rounded - 1;
+    on = true;
+}
+
+void Timeline::record(const char * name, const SteadyClock::time_point & begin, const SteadyClock::time_point & end) {
+    static thread_local uint32_t thread_number = register_thread();
+    uint64_t index = next_index.fetch_add(1, memory_order_relaxed);
+    TimelineSlot & slot = slots[index & slot_mask];
+    slot.sequence.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.name.store(name, memory_order_relaxed);
+    slot.begin.store(steady_ns(begin), memory_order_relaxed);
+    slot.end.store(steady_ns(end), memory_order_relaxed);
+    slot.thread_number.store(thread_number, memory_order_relaxed);
+    slot.sequence.store(index + 1, memory_order_release);
+}
+
+static void write_events(const string & filename, const vector<TimelineEvent> & events, const vector<string> & names) {
+    auto begin = SteadyClock::now();
+    ofstream out(filename);
+    if (!out) {
+        cerr << "can't write timeline " << filename << " " << strerror(errno) << endl;
+        writing = false;
+        return;
+    }
+    // microseconds from the first zone in the file
+    int64_t origin = events.empty() ? 0 : events.front().begin;
+    for (auto & event : events) {
+        origin = min(origin, event.begin);
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+    out << fixed << setprecision(3);
+    bool first = true;
+    for (size_t number = 0; number < names.size(); number++) {
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << number
+            << ",\"args\":{\"name\":\"" << names[number] << "\"}}";
+        first = false;
+    }
+    // zone names are string literals in the source, nothing in them needs escaping
+    for (auto & event : events) {
+        out << (first ? "" : ",\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread_number
+            << ",\"ts\":" << (event.begin - origin) / 1e3 << ",\"dur\":" << (event.end - event.begin) / 1e3 << "}";
+        first = false;
+    }
+    out << "\n]}" << endl;
+    out.close();
+
+    file_count += 1;
+    written_events += static_cast<long>(events.size());
+    write_sd.increment(SteadyClock::now(), begin);
+    writing = false;
+}
+
+bool Timeline::write_chrome(const string & filename, double window) {
+    if (!enabled()) {
+        return false;
+    }
+    lock_guard<mutex> guard(writer_mutex);
+    if (writing) {
+        busy_count += 1;
+        return false;
+    }
+    if (writer) {
+        writer->join();
+        delete writer;
+        writer = nullptr;
+    }
+
+    // oldest first, as far back as the ring goes
+    uint64_t last = next_index.load(memory_order_acquire);
+    uint64_t first = last > slot_mask + 1 ? last - (slot_mask + 1) : 0;
+    int64_t since = window > 0 ? steady_ns(SteadyClock::now()) - static_cast<int64_t>(window * 1e9) : 0;
+    vector<TimelineEvent> events;
+    events.reserve(static_cast<size_t>(last - first));
+    for (uint64_t index = first; index < last; index++) {
+        TimelineSlot & slot = slots[index & slot_mask];
+        uint64_t sequence = slot.sequence.load(memory_order_acquire);
+        TimelineEvent event;
+        event.name = slot.name.load(memory_order_relaxed);
+        event.begin = slot.begin.load(memory_order_relaxed);
+        event.end = slot.end.load(memory_order_relaxed);
+        event.thread_number = slot.thread_number.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence != index + 1 || slot.sequence.load(memory_order_relaxed) != sequence || event.end < since) {
+            continue;
+        }
+        events.push_back(event);
+    }
+    vector<string> names;
+    {
+        lock_guard<mutex> threads_guard(threads_mutex);
+        names = thread_names;
+    }
+
+    writing = true;
+    writer = new thread([filename, events = std::move(events), names = std::move(names)]() {
+        ThreadConfig::enter(TRACE_THREAD);
+        write_events(filename, events, names);
+    });
+    return true;
+}
+
+void Timeline::close() {
+    lock_guard<mutex> guard(writer_mutex);
+    if (writer) {
+        writer->join();
+        delete writer;
+        writer = nullptr;
+    }
+}
+
+void Timeline::dump(ofstream & out, const string & label) {
+    uint64_t recorded = next_index.load(memory_order_relaxed);
+    out << label << " zones: " << recorded << " kept: " << min<uint64_t>(recorded, slots ? slot_mask + 1 : 0)
+        << " files: " << file_count << " zones written: " << written_events << " busy: " << busy_count << endl;
+    write_sd.dump(out, label + " write");
+}
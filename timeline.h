@@ -0,0 +1,60 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <string>
+#include <atomic>
+#include <fstream>
+
+#include "comms.h"
+
+// Where a frame's time went: each thread times the stages it runs through (TIMELINE_ZONE) into
+// one ring of the most recent zones, and the ring is written out as Chrome trace JSON for
+// chrome://tracing or ui.perfetto.dev, one row per thread, named by its ThreadConfig role.
+// Recording takes no lock; a zone is only timed once enable() has been called, until then it
+// costs a relaxed atomic load.
+class Timeline {
+public:
+    // keeps the last capacity zones (rounded up to a power of two) from now on; call it once, before
+    // the threads start
+    static void enable(size_t capacity = 1 << 16);
+    static bool enabled() {
+        return on.load(memory_order_relaxed);
+    }
+    // a zone that ended on the calling thread; name must outlive the timeline (a string literal)
+    static void record(const char * name, const SteadyClock::time_point & begin, const SteadyClock::time_point & end);
+    // the zones that ended in the last window seconds (0 = all that are kept), written on a thread
+    // of its own so the caller only pays for copying them out; false if a file is still being written
+    static bool write_chrome(const string & filename, double window = 0);
+    // waits for the file being written
+    static void close();
+    static void dump(ofstream & out, const string & label);
+
+private:
+    static atomic<bool> on;
+};
+
+// times the scope it is declared in
+class TimelineZone {
+public:
+    explicit TimelineZone(const char * name) : name(Timeline::enabled() ? name : nullptr) {
+        if (this->name) {
+            begin = SteadyClock::now();
+        }
+    }
+    ~TimelineZone() {
+        if (name) {
+            Timeline::record(name, begin, SteadyClock::now());
+        }
+    }
+
+private:
+    const char * name;
+    SteadyClock::time_point begin;
+};
+
+#define TIMELINE_JOIN_(a, b) a##b
+#define TIMELINE_JOIN(a, b) TIMELINE_JOIN_(a, b)
+// TIMELINE_ZONE("mix"); times from here to the end of the enclosing block
+#define TIMELINE_ZONE(name) TimelineZone TIMELINE_JOIN(timeline_zone_, __LINE__)(name)
+
+#endif // TIMELINE_H
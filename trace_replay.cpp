@@ -0,0 +1,152 @@
+// Plays a message trace (recorded by a server run with -q) back to a server, as a client would
+// have sent it: at the times the messages originally arrived, or with -a as fast as the server
+// acks them. Run the server headless with a frame count and a frame time file, e.g.
+//   ./MRR_Pi_server_2 -H -n 3000 -F frames.csv
+//   ./MRR_Pi_trace_replay -t session.trace
+// and compare frames.csv between builds; the input is the same message for message.
+//
+// usage: MRR_Pi_trace_replay -t trace [-a] [-w window] [-i ip_address] [-p port_number]
+// The trace has IMAGE_REFs as the IMAGE they named (the server replayed to may not have it in its
+// cache). What a client doesn't send (acks, heartbeats, ...) is skipped. With -a only images wait
+// for acks, so a control message can reach the server ahead of images traced before it.
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <list>
+
+#include "comms.h"
+#include "message_trace.h"
+#include "thread_config.h"
+
+int main(int argc, char *argv[])
+{
+    string trace_filename;
+    bool as_fast_as_acked = false;
+    int window = 2;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-a") == 0)
+        {
+            as_fast_as_acked = true;
+        }
+    }
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+        {
+            trace_filename = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            window = max(1, atoi(argv[i + 1]));
+        }
+    }
+    if (trace_filename.empty())
+    {
+        cout << "usage: MRR_Pi_trace_replay -t trace [-a] [-w window] [-i ip_address] [-p port_number]" << endl;
+        return -1;
+    }
+
+    TraceReader reader;
+    if (!reader.open(trace_filename))
+    {
+        return -1;
+    }
+
+    Comm::log_messages = false;
+    ThreadConfig::enter(MAIN_THREAD);
+    list<Comm *> comms = Comm::start_clients(nullptr, argc, argv);
+    if (comms.empty() || comms.front()->connect_result() != ConnectError::SUCCESS)
+    {
+        cout << "can't connect to the server" << endl;
+        return -1;
+    }
+    Comm *comm = comms.front();
+    // at the traced times nothing waits on acks, the timing is the trace's
+    comm->set_flow_control(as_fast_as_acked ? window : 0, 0);
+
+    long sent_count = 0;
+    long skipped_count = 0;
+    // how far behind the traced times the sends were
+    long paced_count = 0;
+    double late_total = 0;
+    double latest = 0;
+    auto start = SteadyClock::now();
+    TracedMessage traced;
+    while (reader.next(traced))
+    {
+        bool acked = traced.message_type == MessageData::IMAGE || traced.message_type == MessageData::VIDEO;
+        if (!as_fast_as_acked)
+        {
+            auto due = start + std::chrono::duration_cast<SteadyClock::duration>(traced.arrived);
+            Seconds early = due - SteadyClock::now();
+            if (early.count() > 0)
+            {
+                ThreadConfig::sleep_for(early);
+            }
+            Seconds late = SteadyClock::now() - due;
+            paced_count += 1;
+            late_total += late.count();
+            latest = max(latest, late.count());
+        }
+        else if (acked)
+        {
+            while (!comm->ready_to_send())
+            {
+                ThreadConfig::sleep_for(Seconds(0.0005));
+            }
+        }
+
+        switch (traced.message_type)
+        {
+        case MessageData::IMAGE:
+        case MessageData::VIDEO:
+        {
+            if (as_fast_as_acked)
+            {
+                comm->flow_control().sent(traced.image_name, SteadyClock::now());
+            }
+            auto message_data = new MessageData(traced.message_type, traced.image_name, traced.payload);
+            message_data->width = traced.width;
+            message_data->height = traced.height;
+            message_data->pixel_format = traced.pixel_format;
+            comm->send(message_data);
+            break;
+        }
+        case MessageData::PRELOAD:
+            comm->send_preload(traced.image_name, traced.payload, traced.width, traced.height, traced.pixel_format);
+            break;
+        case MessageData::DISPLAY_NOW:
+            comm->send_display_now(traced.image_name);
+            break;
+        case MessageData::START_TIMER:
+            comm->send_start_timer();
+            break;
+        default:
+            skipped_count += 1;
+            continue;
+        }
+        sent_count += 1;
+
+        // nothing the server sends back besides acks means anything here
+        while (auto message_data = comm->next_received())
+        {
+            delete message_data;
+        }
+    }
+    Seconds elapsed = SteadyClock::now() - start;
+
+    cout << "replayed " << sent_count << " messages in " << elapsed.count() << "s, skipped " << skipped_count << endl;
+    if (!as_fast_as_acked)
+    {
+        double late_mean = paced_count > 0 ? late_total / paced_count : 0;
+        cout << "behind the trace by mean " << late_mean * 1000 << "ms, max " << latest * 1000 << "ms" << endl;
+    }
+
+    // give the server time to take the last messages before the connection is dropped
+    this_thread::sleep_for(std::chrono::seconds(1));
+    return 0;
+}
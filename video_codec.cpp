@@ -0,0 +1,485 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/mathematics.h>
+}
+
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#include "video_codec.h"
+#include "thread_config.h"
+#include "timeline.h"
+
+using namespace std;
+
+// flags byte, then the AVCodecID, little endian
+static const size_t video_header_size = 5;
+static const unsigned char keyframe_flag = 0x01;
+
+static string av_error(int error) {
+    char buffer[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(error, buffer, sizeof(buffer));
+    return buffer;
+}
+
+// the luma plane is all we show; anything else can't be handed over as an 8 bit image
+static bool has_grey_plane(int format) {
+    return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_GRAY8;
+}
+
+static void copy_rows(char * destination, size_t destination_stride, const char * source, size_t source_stride, size_t row_bytes, size_t rows) {
+    for (size_t row = 0; row < rows; row++) {
+        memcpy(destination + row * destination_stride, source + row * source_stride, row_bytes);
+    }
+}
+
+VideoEncoder::~VideoEncoder() {
+    avcodec_free_context(&context);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+}
+
+bool VideoEncoder::open(int width, int height, double fps, long bit_rate, const string & codec_name) {
+    const AVCodec * codec = nullptr;
+    if (!codec_name.empty()) {
+        codec = avcodec_find_encoder_by_name(codec_name.c_str());
+    }
+    else {
+        codec = avcodec_find_encoder_by_name("libx264");
+        if (codec == nullptr) {
+            codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+        }
+    }
+    if (codec == nullptr) {
+        cerr << "no video encoder " << (codec_name.empty() ? "libx264 or mpeg4" : codec_name) << endl;
+        return false;
+    }
+
+    this->width = width;
+    this->height = height;
+    context = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (context == nullptr || frame == nullptr || packet == nullptr) {
+        cerr << "can't allocate a video encoder" << endl;
+        return false;
+    }
+
+    context->width = width;
+    context->height = height;
+    context->pix_fmt = AV_PIX_FMT_YUV420P;
+    context->framerate = av_d2q(fps > 0 ? fps : 30, 1000);
+    context->time_base = av_inv_q(context->framerate);
+    context->bit_rate = bit_rate;
+    // a keyframe a second bounds how long a server that lost the stream shows nothing new
+    context->gop_size = max(1, static_cast<int>(fps + 0.5));
+    // B frames would hold each frame back until a later one is in
+    context->max_b_frames = 0;
+    context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+    AVDictionary * options = nullptr;
+    if (strcmp(codec->name, "libx264") == 0) {
+        // no lookahead, no frame threads: one frame in, one packet out
+        av_dict_set(&options, "preset", "ultrafast", 0);
+        av_dict_set(&options, "tune", "zerolatency", 0);
+        av_dict_set(&options, "forced-idr", "1", 0);
+    }
+    int result = avcodec_open2(context, codec, &options);
+    av_dict_free(&options);
+    if (result < 0) {
+        cerr << "can't open video encoder " << codec->name << " " << av_error(result) << endl;
+        avcodec_free_context(&context);
+        return false;
+    }
+
+    frame->format = context->pix_fmt;
+    frame->width = width;
+    frame->height = height;
+    result = av_frame_get_buffer(frame, 0);
+    if (result < 0) {
+        cerr << "can't allocate a video frame " << av_error(result) << endl;
+        avcodec_free_context(&context);
+        return false;
+    }
+    // grey: flat chroma, written once (av_frame_make_writable copies it along)
+    int chroma_height = (height + 1) / 2;
+    memset(frame->data[1], 128, static_cast<size_t>(frame->linesize[1]) * chroma_height);
+    memset(frame->data[2], 128, static_cast<size_t>(frame->linesize[2]) * chroma_height);
+    return true;
+}
+
+string VideoEncoder::encode(const PayloadView & image) {
+    auto begin = SteadyClock::now();
+    if (context == nullptr || image.size < static_cast<size_t>(width) * height) {
+        failed_count += 1;
+        return string();
+    }
+    // the encoder may still hold the last frame's buffers
+    int result = av_frame_make_writable(frame);
+    if (result < 0) {
+        cerr << "video frame not writable " << av_error(result) << endl;
+        failed_count += 1;
+        return string();
+    }
+    copy_rows(reinterpret_cast<char *>(frame->data[0]), frame->linesize[0], image.data, width, width, height);
+    frame->pts = next_pts++;
+    frame->pict_type = keyframe_requested ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    keyframe_requested = false;
+
+    string payload(video_header_size, '\0');
+    bool keyframe = false;
+    result = avcodec_send_frame(context, frame);
+    while (result >= 0) {
+        result = avcodec_receive_packet(context, packet);
+        if (result < 0) {
+            break;
+        }
+        keyframe = keyframe || (packet->flags & AV_PKT_FLAG_KEY);
+        payload.append(reinterpret_cast<const char *>(packet->data), packet->size);
+        av_packet_unref(packet);
+    }
+    if (result < 0 && result != AVERROR(EAGAIN) && result != AVERROR_EOF) {
+        cerr << "video encode failed " << av_error(result) << endl;
+        failed_count += 1;
+        return string();
+    }
+    if (payload.size() == video_header_size) {
+        // nothing came out this time
+        return string();
+    }
+
+    payload[0] = static_cast<char>(keyframe ? keyframe_flag : 0);
+    uint32_t codec_id = static_cast<uint32_t>(context->codec_id);
+    memcpy(&payload[1], &codec_id, sizeof(codec_id));
+
+    auto now = SteadyClock::now();
+    if (frame_count == 0) {
+        first_frame = now;
+    }
+    last_frame = now;
+    frame_count += 1;
+    keyframe_count += keyframe ? 1 : 0;
+    byte_count += static_cast<long long>(payload.size());
+    encode_sd.increment(now, begin);
+    return payload;
+}
+
+void VideoEncoder::request_keyframe() {
+    keyframe_requested = true;
+}
+
+const char * VideoEncoder::codec_name() const {
+    return context ? context->codec->name : "none";
+}
+
+void VideoEncoder::dump(ofstream & out, const string & label) {
+    Seconds elapsed = last_frame - first_frame;
+    double kbps = elapsed.count() > 0 ? byte_count * 8 / elapsed.count() / 1000 : 0;
+    out << label << " video " << codec_name() << " frames: " << frame_count << " keyframes: " << keyframe_count
+        << " failed: " << failed_count << " bytes: " << byte_count
+        << " bytes/frame: " << (frame_count > 0 ? byte_count / frame_count : 0) << " kbit/s: " << kbps << endl;
+    encode_sd.dump(out, label + " encode");
+}
+
+VideoDecoder::VideoDecoder() : frames_held(make_shared<atomic<long>>(0)) {
+}
+
+VideoDecoder::~VideoDecoder() {
+    {
+        lock_guard<mutex> guard(queue_mutex);
+        keep_going = false;
+    }
+    pending_ready.notify_all();
+    if (decode_thread) {
+        decode_thread->join();
+        delete decode_thread;
+    }
+    close_codec();
+    for (auto & entry : pending) {
+        delete entry.second;
+    }
+    for (auto message_data : decoded) {
+        delete message_data;
+    }
+    // buffers still out in IMAGEs keep their pool alive until they come back
+    for (auto & pool : pools) {
+        av_buffer_pool_uninit(&pool);
+    }
+}
+
+void VideoDecoder::set_output_size(int width, int height) {
+    output_width = width;
+    output_height = height;
+}
+
+void VideoDecoder::decode(MessageData * message_data) {
+    {
+        lock_guard<mutex> guard(queue_mutex);
+        pending.emplace_back(SteadyClock::now(), message_data);
+        if (decode_thread == nullptr) {
+            decode_thread = new thread(&VideoDecoder::execute_decode, this);
+        }
+    }
+    pending_ready.notify_one();
+}
+
+MessageData * VideoDecoder::next_decoded() {
+    lock_guard<mutex> guard(queue_mutex);
+    if (decoded.empty()) {
+        return nullptr;
+    }
+    MessageData * message_data = decoded.front();
+    decoded.pop_front();
+    return message_data;
+}
+
+void VideoDecoder::execute_decode() {
+    ThreadConfig::enter(DECODE_THREAD);
+    while (true) {
+        pair<SteadyClock::time_point, MessageData *> next;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            pending_ready.wait(lock, [this] { return !pending.empty() || !keep_going; });
+            if (!keep_going) {
+                return;
+            }
+            next = pending.front();
+            pending.pop_front();
+        }
+        TIMELINE_ZONE("decode");
+        decode_one(next.second, next.first);
+    }
+}
+
+bool VideoDecoder::open_codec(int codec_id) {
+    const AVCodec * codec = avcodec_find_decoder(static_cast<AVCodecID>(codec_id));
+    if (codec == nullptr) {
+        cerr << "no video decoder for codec id " << codec_id << endl;
+        return false;
+    }
+    context = avcodec_alloc_context3(codec);
+    if (frame == nullptr) {
+        frame = av_frame_alloc();
+        packet = av_packet_alloc();
+    }
+    if (context == nullptr || frame == nullptr || packet == nullptr) {
+        cerr << "can't allocate a video decoder" << endl;
+        avcodec_free_context(&context);
+        return false;
+    }
+    context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    // frame threads would hold frames back, slices don't
+    context->thread_type = FF_THREAD_SLICE;
+    if (codec->capabilities & AV_CODEC_CAP_DR1) {
+        context->opaque = this;
+        context->get_buffer2 = &VideoDecoder::get_buffer;
+    }
+    int result = avcodec_open2(context, codec, nullptr);
+    if (result < 0) {
+        cerr << "can't open video decoder " << codec->name << " " << av_error(result) << endl;
+        avcodec_free_context(&context);
+        return false;
+    }
+    this->codec_id = codec_id;
+    return true;
+}
+
+void VideoDecoder::close_codec() {
+    avcodec_free_context(&context);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    // the codec had them, they won't come out now
+    for (auto & entry : in_codec) {
+        failed_count += 1;
+        finish(entry.message_data, entry.arrived);
+    }
+    in_codec.clear();
+    codec_id = 0;
+}
+
+void VideoDecoder::decode_one(MessageData * message_data, const SteadyClock::time_point & arrived) {
+    auto begin = SteadyClock::now();
+    const char * payload = message_data->payload_data();
+    size_t size = message_data->payload_size();
+    if (byte_count == 0) {
+        first_packet = begin;
+    }
+    last_packet = begin;
+    byte_count += static_cast<long long>(size);
+
+    if (size <= video_header_size) {
+        failed_count += 1;
+        finish(message_data, arrived);
+        return;
+    }
+    bool keyframe = (payload[0] & keyframe_flag) != 0;
+    uint32_t id;
+    memcpy(&id, payload + 1, sizeof(id));
+    if (context == nullptr || static_cast<int>(id) != codec_id) {
+        close_codec();
+        waiting_for_keyframe = true;
+        if (!open_codec(static_cast<int>(id))) {
+            failed_count += 1;
+            finish(message_data, arrived);
+            return;
+        }
+    }
+    // a P frame without what came before it only decodes to garbage
+    if (waiting_for_keyframe && !keyframe) {
+        skipped_count += 1;
+        finish(message_data, arrived);
+        return;
+    }
+    waiting_for_keyframe = false;
+
+    // not reference counted, avcodec_send_packet takes a (padded) copy
+    packet->data = reinterpret_cast<uint8_t *>(const_cast<char *>(payload + video_header_size));
+    packet->size = static_cast<int>(size - video_header_size);
+    packet->pts = next_pts;
+    packet->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+    int result = avcodec_send_packet(context, packet);
+    packet->data = nullptr;
+    packet->size = 0;
+    if (result < 0) {
+        cerr << "video decode failed " << av_error(result) << endl;
+        failed_count += 1;
+        waiting_for_keyframe = true;
+        finish(message_data, arrived);
+        return;
+    }
+    in_codec.push_back({next_pts++, message_data, arrived});
+    receive_frames();
+    decode_sd.increment(SteadyClock::now(), begin);
+}
+
+void VideoDecoder::receive_frames() {
+    while (true) {
+        int result = avcodec_receive_frame(context, frame);
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF) {
+            return;
+        }
+        if (result < 0) {
+            cerr << "video decode failed " << av_error(result) << endl;
+            waiting_for_keyframe = true;
+            return;
+        }
+        // packets before this frame's didn't give one
+        while (frame->pts != AV_NOPTS_VALUE && !in_codec.empty() && in_codec.front().pts < frame->pts) {
+            failed_count += 1;
+            finish(in_codec.front().message_data, in_codec.front().arrived);
+            in_codec.pop_front();
+        }
+        if (in_codec.empty()) {
+            av_frame_unref(frame);
+            continue;
+        }
+        InCodec entry = in_codec.front();
+        in_codec.pop_front();
+        if (!has_grey_plane(frame->format)) {
+            cerr << "video frames in pixel format " << frame->format << " can't be shown" << endl;
+            av_frame_unref(frame);
+            failed_count += 1;
+            finish(entry.message_data, entry.arrived);
+            continue;
+        }
+
+        size_t row_bytes = static_cast<size_t>(frame->width);
+        size_t rows = static_cast<size_t>(frame->height);
+        auto image = new MessageData(MessageData::MessageType::IMAGE, entry.message_data->image_name);
+        if (output_width > 0 && output_height > 0 && (frame->width != output_width || frame->height != output_height)) {
+            row_bytes = static_cast<size_t>(output_width);
+            rows = static_cast<size_t>(output_height);
+            image->image_data.resize(row_bytes * rows);
+            resampler.resample(reinterpret_cast<const char *>(frame->data[0]), frame->width, frame->height, frame->linesize[0],
+                               &image->image_data[0], output_width, output_height);
+        }
+        else if (frame->linesize[0] == frame->width) {
+            // the rows are back to back, the IMAGE reads them where the codec put them;
+            // the pooled buffer goes back when the last view lets go
+            AVFrame * held = av_frame_clone(frame);
+            auto held_count = frames_held;
+            long held_now = ++*held_count;
+            peak_held = max(peak_held, held_now);
+            image->payload.owner = shared_ptr<const void>(held, [held_count](AVFrame * released) {
+                av_frame_free(&released);
+                *held_count -= 1;
+            });
+            image->payload.data = reinterpret_cast<const char *>(held->data[0]);
+            image->payload.size = row_bytes * rows;
+        }
+        else {
+            image->image_data.resize(row_bytes * rows);
+            copy_rows(&image->image_data[0], row_bytes, reinterpret_cast<const char *>(frame->data[0]), frame->linesize[0], row_bytes, rows);
+            copied_count += 1;
+        }
+        image->width = static_cast<uint16_t>(row_bytes);
+        image->height = static_cast<uint16_t>(rows);
+        av_frame_unref(frame);
+        delete entry.message_data;
+        frame_count += 1;
+        finish(image, entry.arrived);
+    }
+}
+
+void VideoDecoder::finish(MessageData * message_data, const SteadyClock::time_point & arrived) {
+    if (message_data->message_type == MessageData::MessageType::IMAGE) {
+        latency_sd.increment(SteadyClock::now(), arrived);
+    }
+    lock_guard<mutex> guard(queue_mutex);
+    decoded.push_back(message_data);
+}
+
+static int align_up(int value, int alignment) {
+    return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+}
+
+int VideoDecoder::get_buffer(AVCodecContext * context, AVFrame * frame, int flags) {
+    auto decoder = static_cast<VideoDecoder *>(context->opaque);
+    if (!has_grey_plane(frame->format)) {
+        return avcodec_default_get_buffer2(context, frame, flags);
+    }
+
+    // the codec writes whole macroblocks, past the visible picture
+    int width = frame->width;
+    int height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(context, &width, &height, linesize_align);
+
+    int planes = frame->format == AV_PIX_FMT_GRAY8 ? 1 : 3;
+    lock_guard<mutex> guard(decoder->pool_mutex);
+    for (int plane = 0; plane < planes; plane++) {
+        int plane_width = plane == 0 ? width : (width + 1) / 2;
+        int plane_height = plane == 0 ? height : (height + 1) / 2;
+        int linesize = align_up(plane_width, linesize_align[plane]);
+        // some decoders read a little past the last row
+        int size = linesize * plane_height + 16 + 64;
+        if (decoder->pools[plane] == nullptr || decoder->pool_sizes[plane] != size) {
+            av_buffer_pool_uninit(&decoder->pools[plane]);
+            decoder->pools[plane] = av_buffer_pool_init(size, nullptr);
+            decoder->pool_sizes[plane] = size;
+        }
+        frame->buf[plane] = decoder->pools[plane] ? av_buffer_pool_get(decoder->pools[plane]) : nullptr;
+        if (frame->buf[plane] == nullptr) {
+            return AVERROR(ENOMEM);
+        }
+        frame->data[plane] = frame->buf[plane]->data;
+        frame->linesize[plane] = linesize;
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+void VideoDecoder::dump(ofstream & out, const string & label) {
+    Seconds elapsed = last_packet - first_packet;
+    double kbps = elapsed.count() > 0 ? byte_count * 8 / elapsed.count() / 1000 : 0;
+    out << label << " video frames: " << frame_count << " skipped to keyframe: " << skipped_count << " failed: " << failed_count
+        << " copied: " << copied_count << " held: " << frames_held->load() << " peak held: " << peak_held
+        << " kbit/s: " << kbps << endl;
+    decode_sd.dump(out, label + " decode");
+    latency_sd.dump(out, label + " arrival to frame");
+    resampler.dump(out, label + " resample");
+}
@@ -0,0 +1,130 @@
+#ifndef VIDEO_CODEC_H
+#define VIDEO_CODEC_H
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+
+#include "comms.h"
+#include "resampler.h"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct AVBufferPool;
+
+// An encoded frame stream instead of raw IMAGEs: the client encodes each frame with a
+// low latency libavcodec encoder and sends it as a VIDEO message, the server decodes
+// them in order on a thread of its own.
+// Frames are 8 bit grey, they travel as the Y plane of YUV 4:2:0 with flat chroma.
+// Each VIDEO payload starts with a flags byte and the AVCodecID (4 bytes), then the packet.
+
+class VideoEncoder {
+public:
+    ~VideoEncoder();
+
+    // codec_name is any encoder libavcodec knows; empty tries libx264, then mpeg4.
+    // One keyframe a second, no B frames, so every frame comes out as soon as it goes in.
+    bool open(int width, int height, double fps, long bit_rate, const string & codec_name = "");
+    // the VIDEO payload for frame (width x height bytes), empty if it couldn't be encoded
+    string encode(const PayloadView & frame);
+    // the next frame is a keyframe, e.g. after a reconnect lost part of the stream
+    void request_keyframe();
+    const char * codec_name() const;
+    void dump(ofstream & out, const string & label);
+
+private:
+    AVCodecContext * context = nullptr;
+    AVFrame * frame = nullptr;
+    AVPacket * packet = nullptr;
+    int width = 0;
+    int height = 0;
+    long long next_pts = 0;
+    bool keyframe_requested = true;
+
+    long frame_count = 0;
+    long keyframe_count = 0;
+    long failed_count = 0;
+    long long byte_count = 0;
+    SteadyClock::time_point first_frame;
+    SteadyClock::time_point last_frame;
+    SD encode_sd;
+};
+
+class VideoDecoder {
+public:
+    VideoDecoder();
+    ~VideoDecoder();
+
+    // frames of another size are scaled to this one on the decode thread; call before decode()
+    void set_output_size(int width, int height);
+    // takes message_data (a VIDEO); decoded on the decode thread, which starts on first use
+    void decode(MessageData * message_data);
+    // every VIDEO handed to decode() comes back once, in order: as an IMAGE whose payload is
+    // the decoded frame in a pooled buffer (back in the pool when the message is deleted),
+    // or as the VIDEO itself if it gave no frame (waiting for a keyframe, corrupt);
+    // ack either so the client's window keeps moving. nullptr if nothing is ready yet.
+    MessageData * next_decoded();
+    void dump(ofstream & out, const string & label);
+
+private:
+    void execute_decode();
+    bool open_codec(int codec_id);
+    void close_codec();
+    void decode_one(MessageData * message_data, const SteadyClock::time_point & arrived);
+    // frames the codec gave back, and the packets that didn't give one
+    void receive_frames();
+    void finish(MessageData * message_data, const SteadyClock::time_point & arrived);
+    // AVCodecContext::get_buffer2, hands the codec buffers from our pools
+    static int get_buffer(AVCodecContext * context, AVFrame * frame, int flags);
+
+    thread * decode_thread = nullptr;
+    atomic<bool> keep_going{true};
+    mutex queue_mutex;
+    condition_variable pending_ready;
+    // VIDEOs waiting for the decode thread (with when they came in), and what it made of them
+    deque<pair<SteadyClock::time_point, MessageData *>> pending;
+    deque<MessageData *> decoded;
+
+    // decode thread only
+    AVCodecContext * context = nullptr;
+    AVFrame * frame = nullptr;
+    AVPacket * packet = nullptr;
+    int codec_id = 0;
+    bool waiting_for_keyframe = true;
+    long long next_pts = 0;
+    int output_width = 0;
+    int output_height = 0;
+    Resampler resampler;
+    struct InCodec {
+        long long pts;
+        MessageData * message_data;
+        SteadyClock::time_point arrived;
+    };
+    // sent to the codec and not out yet, oldest first
+    deque<InCodec> in_codec;
+
+    // one pool per plane, replaced when the frame size changes
+    mutex pool_mutex;
+    AVBufferPool * pools[3] = {nullptr, nullptr, nullptr};
+    int pool_sizes[3] = {0, 0, 0};
+    shared_ptr<atomic<long>> frames_held;
+    long peak_held = 0;
+
+    atomic<long> frame_count{0};
+    atomic<long> skipped_count{0};
+    atomic<long> failed_count{0};
+    atomic<long> copied_count{0};
+    atomic<long long> byte_count{0};
+    SteadyClock::time_point first_packet;
+    SteadyClock::time_point last_packet;
+    SD decode_sd;
+    // from decode() to the frame being ready, time spent queued included
+    SD latency_sd;
+};
+
+#endif // VIDEO_CODEC_H